@@ -0,0 +1,560 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/sha.h>
+#include <openssl/x509v3.h>
+
+#include <ccan/talloc/talloc.h>
+
+#include "authenticode.h"
+#include "fileio.h"
+#include "idc.h"
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define X509_OBJECT_get0_X509(obj) ((obj)->data.x509)
+#define X509_OBJECT_get_type(obj) ((obj)->type)
+#define X509_STORE_CTX_get0_cert(ctx) ((ctx)->cert)
+#define X509_STORE_get0_objects(certs) ((certs)->objs)
+#define X509_get_extended_key_usage(cert) ((cert)->ex_xkusage)
+#define X509_up_ref(cert) CRYPTO_add(&(cert)->references, 1, \
+		CRYPTO_LOCK_X509)
+#define EVP_PKEY_up_ref(pkey) CRYPTO_add(&(pkey)->references, 1, \
+		CRYPTO_LOCK_EVP_PKEY)
+#if OPENSSL_VERSION_NUMBER < 0x10020000L
+#define X509_STORE_CTX_get0_store(ctx) ((ctx)->ctx)
+#endif
+#endif
+
+/* Result of validating a signer's certificate chain. The chain depends on
+ * the intermediates it was built with, so they are part of the key, by a
+ * digest of their fingerprints. Entries are invalidated by changes to the
+ * trust store, via the store generation. */
+struct chain_cache_entry {
+	uint8_t		fingerprint[SHA256_DIGEST_LENGTH];
+	uint8_t		untrusted[SHA256_DIGEST_LENGTH];
+	unsigned int	store_generation;
+	int		flags;
+	int		result;
+};
+
+struct authenticode_verifier {
+	X509_STORE			*store;
+	unsigned int			store_generation;
+	bool				verbose;
+
+	struct chain_cache_entry	*chain_cache;
+	unsigned int			n_chain_cache;
+};
+
+struct authenticode_signer {
+	X509			*cert;
+	STACK_OF(X509)		*certs;
+	EVP_PKEY		*pkey;
+	const EVP_MD		*md;
+	bool			use_skeleton;
+	struct idc_skeleton	*skel;
+};
+
+static int cert_in_store(X509 *cert, X509_STORE_CTX *ctx)
+{
+	STACK_OF(X509_OBJECT) *objs;
+	X509_OBJECT *obj;
+	int i;
+
+	objs = X509_STORE_get0_objects(X509_STORE_CTX_get0_store(ctx));
+
+	for (i = 0; i < sk_X509_OBJECT_num(objs); i++) {
+		obj = sk_X509_OBJECT_value(objs, i);
+
+		if (X509_OBJECT_get_type(obj) == X509_LU_X509 &&
+		    !X509_cmp(X509_OBJECT_get0_X509(obj), cert))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int x509_verify_cb(int status, X509_STORE_CTX *ctx)
+{
+	int err = X509_STORE_CTX_get_error(ctx);
+
+	/* also accept code-signing keys */
+	if (err == X509_V_ERR_INVALID_PURPOSE &&
+			X509_get_extended_key_usage(X509_STORE_CTX_get0_cert(ctx))
+			== XKU_CODE_SIGN)
+		status = 1;
+
+	else if (err == X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY ||
+		 err == X509_V_ERR_CERT_UNTRUSTED ||
+		 err == X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT ||
+		 err == X509_V_ERR_UNABLE_TO_VERIFY_LEAF_SIGNATURE) {
+		/* all certs given with the --cert argument are trusted */
+
+		if (cert_in_store(X509_STORE_CTX_get_current_cert(ctx), ctx))
+			status = 1;
+	} else if (err == X509_V_ERR_CERT_HAS_EXPIRED ||
+		   err == X509_V_ERR_ERROR_IN_CERT_NOT_BEFORE_FIELD ||
+		   err == X509_V_ERR_CERT_NOT_YET_VALID ||
+		   err == X509_V_ERR_ERROR_IN_CERT_NOT_AFTER_FIELD)
+		/* UEFI explicitly allows expired certificates */
+		status = 1;
+
+	return status;
+}
+
+static int verifier_destroy(struct authenticode_verifier *verifier)
+{
+	X509_STORE_free(verifier->store);
+	return 0;
+}
+
+struct authenticode_verifier *authenticode_verifier_new(void *ctx)
+{
+	struct authenticode_verifier *verifier;
+
+	verifier = talloc_zero(ctx, struct authenticode_verifier);
+	verifier->store = X509_STORE_new();
+	if (!verifier->store) {
+		talloc_free(verifier);
+		return NULL;
+	}
+
+	X509_STORE_set_verify_cb_func(verifier->store, x509_verify_cb);
+	talloc_set_destructor(verifier, verifier_destroy);
+
+	return verifier;
+}
+
+int authenticode_verifier_add_cert(struct authenticode_verifier *verifier,
+		X509 *cert)
+{
+	/* the store takes its own reference */
+	if (!X509_STORE_add_cert(verifier->store, cert))
+		return -1;
+
+	verifier->store_generation++;
+	return 0;
+}
+
+int authenticode_verifier_load_cert(struct authenticode_verifier *verifier,
+		const char *filename)
+{
+	X509 *cert;
+	int rc;
+
+	cert = fileio_read_cert(filename);
+	if (!cert)
+		return -1;
+
+	rc = authenticode_verifier_add_cert(verifier, cert);
+	X509_free(cert);
+	return rc;
+}
+
+void authenticode_verifier_set_verbose(struct authenticode_verifier *verifier,
+		bool verbose)
+{
+	verifier->verbose = verbose;
+}
+
+/* Digest the fingerprints of a set of certificates, in order */
+static int certs_digest(STACK_OF(X509) *certs,
+		uint8_t digest[SHA256_DIGEST_LENGTH])
+{
+	uint8_t fingerprint[SHA256_DIGEST_LENGTH];
+	EVP_MD_CTX *ctx;
+	int i, rc;
+
+	ctx = EVP_MD_CTX_create();
+	if (!ctx)
+		return -1;
+
+	rc = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+
+	for (i = 0; rc && i < sk_X509_num(certs); i++)
+		rc = X509_digest(sk_X509_value(certs, i), EVP_sha256(),
+					fingerprint, NULL) &&
+			EVP_DigestUpdate(ctx, fingerprint, sizeof(fingerprint));
+
+	if (rc)
+		rc = EVP_DigestFinal_ex(ctx, digest, NULL);
+
+	EVP_MD_CTX_destroy(ctx);
+	return rc ? 0 : -1;
+}
+
+int authenticode_verify_chain(struct authenticode_verifier *verifier,
+		X509 *signer, STACK_OF(X509) *untrusted, int flags)
+{
+	uint8_t fingerprint[SHA256_DIGEST_LENGTH];
+	uint8_t untrusted_digest[SHA256_DIGEST_LENGTH];
+	struct chain_cache_entry *entry;
+	X509_STORE_CTX *store_ctx;
+	unsigned int i;
+	int rc;
+
+	if (flags & PKCS7_NOCHAIN)
+		untrusted = NULL;
+
+	if (!X509_digest(signer, EVP_sha256(), fingerprint, NULL) ||
+			certs_digest(untrusted, untrusted_digest))
+		return 0;
+
+	for (i = 0; i < verifier->n_chain_cache; i++) {
+		entry = &verifier->chain_cache[i];
+		if (entry->store_generation == verifier->store_generation &&
+				entry->flags == flags &&
+				!memcmp(entry->fingerprint, fingerprint,
+					sizeof(fingerprint)) &&
+				!memcmp(entry->untrusted, untrusted_digest,
+					sizeof(untrusted_digest)))
+			return entry->result;
+	}
+
+	/* as PKCS7_verify would: use the certs in the signature as
+	 * untrusted intermediates, with the S/MIME signing purpose */
+	store_ctx = X509_STORE_CTX_new();
+	if (!store_ctx ||
+			!X509_STORE_CTX_init(store_ctx, verifier->store,
+				signer, untrusted)) {
+		X509_STORE_CTX_free(store_ctx);
+		return 0;
+	}
+	X509_STORE_CTX_set_default(store_ctx, "smime_sign");
+
+	rc = X509_verify_cert(store_ctx) > 0;
+	if (!rc && verifier->verbose)
+		printf("Certificate chain verification failed: %s\n",
+			X509_verify_cert_error_string(
+			    X509_STORE_CTX_get_error(store_ctx)));
+
+	X509_STORE_CTX_free(store_ctx);
+
+	verifier->chain_cache = talloc_realloc(verifier,
+			verifier->chain_cache, struct chain_cache_entry,
+			verifier->n_chain_cache + 1);
+	entry = &verifier->chain_cache[verifier->n_chain_cache++];
+	memcpy(entry->fingerprint, fingerprint, sizeof(fingerprint));
+	memcpy(entry->untrusted, untrusted_digest, sizeof(untrusted_digest));
+	entry->store_generation = verifier->store_generation;
+	entry->flags = flags;
+	entry->result = rc;
+
+	return rc;
+}
+
+/* Validate the certificate chain of each signer of p7 */
+static int verify_signer_chains(struct authenticode_verifier *verifier,
+		PKCS7 *p7, int flags)
+{
+	STACK_OF(X509) *signers;
+	int i, rc;
+
+	signers = PKCS7_get0_signers(p7, NULL, flags);
+	if (!signers)
+		return 0;
+
+	rc = 1;
+
+	for (i = 0; rc && i < sk_X509_num(signers); i++)
+		rc = authenticode_verify_chain(verifier,
+				sk_X509_value(signers, i), p7->d.sign->cert,
+				flags);
+
+	sk_X509_free(signers);
+	return rc;
+}
+
+enum authenticode_status authenticode_verify(
+		struct authenticode_verifier *verifier,
+		struct image *image, PKCS7 *p7, const char **message)
+{
+	enum authenticode_status status;
+	const char *tmp_message;
+	struct idc *idc;
+	BIO *idcbio;
+	int rc, flags;
+
+	if (!message)
+		message = &tmp_message;
+
+	idcbio = BIO_new(BIO_s_mem());
+	idc = IDC_get(p7, idcbio);
+	if (!idc) {
+		*message = "Unable to get IDC from PKCS7";
+		status = AUTHENTICODE_INVALID;
+		goto out;
+	}
+
+	rc = IDC_check_hash(idc, image);
+	IDC_free(idc);
+	if (rc) {
+		*message = "Image fails hash check";
+		status = AUTHENTICODE_INVALID;
+		goto out;
+	}
+
+	flags = PKCS7_BINARY;
+
+	/* OpenSSL 1.0.2e no longer allows calling PKCS7_verify with
+	 * both data and content. Empty out the content. */
+	ASN1_TYPE_free(p7->d.sign->contents->d.other);
+	p7->d.sign->contents->d.ptr = NULL;
+
+	/* the chains have been validated (or found in the cache)
+	 * already, so PKCS7_verify only needs to check the
+	 * signature itself */
+	rc = verify_signer_chains(verifier, p7, flags);
+	if (rc)
+		rc = PKCS7_verify(p7, NULL, verifier->store, idcbio, NULL,
+				flags | PKCS7_NOVERIFY);
+	if (rc) {
+		*message = "PKCS7 verification passed";
+		status = AUTHENTICODE_OK;
+	} else {
+		*message = "PKCS7 verification failed";
+		status = AUTHENTICODE_FAIL;
+		if (verifier->verbose)
+			ERR_print_errors_fp(stderr);
+	}
+
+out:
+	/* don't let errors from one signature accumulate into the next */
+	ERR_clear_error();
+	BIO_free(idcbio);
+
+	return status;
+}
+
+enum authenticode_status authenticode_verify_image(
+		struct authenticode_verifier *verifier, struct image *image,
+		const uint8_t *sig, size_t sig_len,
+		authenticode_sig_fn fn, void *arg, const char **message)
+{
+	enum authenticode_status status, sig_status;
+	const char *tmp_message;
+	const uint8_t *tmp;
+	uint8_t *buf;
+	size_t len;
+	PKCS7 *p7;
+	int i;
+
+	if (!message)
+		message = &tmp_message;
+
+	status = sig_status = AUTHENTICODE_FAIL;
+	*message = "No signatures";
+
+	for (i = 0; ; i++) {
+		if (sig) {
+			if (i)
+				break;
+			tmp = sig;
+			len = sig_len;
+		} else {
+			if (image_get_signature(image, i, &buf, &len))
+				break;
+			tmp = buf;
+		}
+
+		p7 = d2i_PKCS7(NULL, &tmp, len);
+		if (!p7) {
+			*message = "Unable to parse signature data";
+			sig_status = AUTHENTICODE_INVALID;
+			break;
+		}
+
+		if (fn && !fn(arg, i, p7)) {
+			PKCS7_free(p7);
+			continue;
+		}
+
+		sig_status = authenticode_verify(verifier, image, p7, message);
+		PKCS7_free(p7);
+
+		if (sig_status == AUTHENTICODE_INVALID)
+			break;
+
+		if (verifier->verbose)
+			printf("%s\n", *message);
+
+		if (sig_status == AUTHENTICODE_OK)
+			status = AUTHENTICODE_OK;
+	}
+
+	if (status != AUTHENTICODE_OK && sig_status == AUTHENTICODE_INVALID)
+		status = AUTHENTICODE_INVALID;
+
+	return status;
+}
+
+int authenticode_check_signer(PKCS7 *p7, PKCS7_SIGNER_INFO *si, X509 *cert)
+{
+	struct idc *idc;
+	BIO *idcbio, *p7bio;
+	char buf[4096];
+	int rc;
+
+	idcbio = BIO_new(BIO_s_mem());
+	idc = IDC_get(p7, idcbio);
+	if (!idc) {
+		BIO_free(idcbio);
+		return 0;
+	}
+	IDC_free(idc);
+
+	/* as for PKCS7_verify, the content is given separately */
+	ASN1_TYPE_free(p7->d.sign->contents->d.other);
+	p7->d.sign->contents->d.ptr = NULL;
+
+	p7bio = PKCS7_dataInit(p7, idcbio);
+	if (!p7bio) {
+		BIO_free(idcbio);
+		ERR_clear_error();
+		return 0;
+	}
+
+	/* run the content through the digest BIOs */
+	while (BIO_read(p7bio, buf, sizeof(buf)) > 0)
+		;
+
+	rc = PKCS7_signatureVerify(p7bio, p7, si, cert) > 0;
+
+	ERR_clear_error();
+	BIO_free_all(p7bio);
+
+	return rc;
+}
+
+static int signer_destroy(struct authenticode_signer *signer)
+{
+	EVP_PKEY_free(signer->pkey);
+	X509_free(signer->cert);
+	if (signer->certs)
+		sk_X509_pop_free(signer->certs, X509_free);
+	return 0;
+}
+
+struct authenticode_signer *authenticode_signer_new(void *ctx, X509 *cert,
+		EVP_PKEY *pkey, const EVP_MD *md, bool use_skeleton)
+{
+	struct authenticode_signer *signer;
+
+	signer = talloc_zero(ctx, struct authenticode_signer);
+	X509_up_ref(cert);
+	EVP_PKEY_up_ref(pkey);
+	signer->cert = cert;
+	signer->pkey = pkey;
+	signer->md = md;
+	signer->use_skeleton = use_skeleton;
+	talloc_set_destructor(signer, signer_destroy);
+
+	return signer;
+}
+
+int authenticode_signer_add_cert(struct authenticode_signer *signer,
+		X509 *cert)
+{
+	if (!signer->certs)
+		signer->certs = sk_X509_new_null();
+
+	if (!signer->certs || !sk_X509_push(signer->certs, cert))
+		return -1;
+
+	X509_up_ref(cert);
+	return 0;
+}
+
+static int build_signature(struct authenticode_signer *signer,
+		struct image *image, uint8_t **sig, size_t *len)
+{
+	PKCS7_SIGNER_INFO *si;
+	int i, rc, sigsize;
+	uint8_t *tmp;
+	PKCS7 *p7;
+
+	/* set up the PKCS7 object */
+	p7 = PKCS7_new();
+	PKCS7_set_type(p7, NID_pkcs7_signed);
+
+	si = PKCS7_sign_add_signer(p7, signer->cert, signer->pkey,
+			signer->md, PKCS7_BINARY);
+	if (!si) {
+		fprintf(stderr, "error in key/certificate chain\n");
+		ERR_print_errors_fp(stderr);
+		PKCS7_free(p7);
+		return -1;
+	}
+
+	for (i = 0; i < sk_X509_num(signer->certs); i++)
+		PKCS7_add_certificate(p7, sk_X509_value(signer->certs, i));
+
+	PKCS7_content_new(p7, NID_pkcs7_data);
+
+	rc = IDC_set(p7, si, image);
+	if (rc) {
+		PKCS7_free(p7);
+		return -1;
+	}
+
+	sigsize = i2d_PKCS7(p7, NULL);
+	tmp = *sig = talloc_array(image, uint8_t, sigsize);
+	i2d_PKCS7(p7, &tmp);
+	ERR_print_errors_fp(stdout);
+	*len = sigsize;
+
+	PKCS7_free(p7);
+	return 0;
+}
+
+int authenticode_sign(struct authenticode_signer *signer,
+		struct image *image, uint8_t **sig, size_t *len)
+{
+	/* the skeleton is built on first use; if the key can't be
+	 * represented by one, we just build each signature in full */
+	if (signer->use_skeleton && !signer->skel) {
+		signer->skel = IDC_skeleton_new(signer, signer->cert,
+				signer->certs, signer->pkey, signer->md);
+		if (!signer->skel) {
+			ERR_clear_error();
+			signer->use_skeleton = false;
+		}
+	}
+
+	if (signer->skel && !IDC_skeleton_sign(signer->skel, image, sig, len))
+		return 0;
+
+	return build_signature(signer, image, sig, len);
+}
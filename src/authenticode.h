@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#ifndef AUTHENTICODE_H
+#define AUTHENTICODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <openssl/evp.h>
+#include <openssl/pkcs7.h>
+#include <openssl/x509.h>
+
+#include "image.h"
+
+/*
+ * The signing and verification core shared by the tools: building an
+ * Authenticode signature for an image, and checking one against a set
+ * of trusted certificates.
+ */
+
+struct authenticode_verifier;
+struct authenticode_signer;
+
+enum authenticode_status {
+	AUTHENTICODE_OK,
+	AUTHENTICODE_FAIL,	/* signature doesn't verify */
+	AUTHENTICODE_INVALID,	/* signature doesn't cover the image */
+};
+
+struct authenticode_verifier *authenticode_verifier_new(void *ctx);
+int authenticode_verifier_add_cert(struct authenticode_verifier *verifier,
+		X509 *cert);
+int authenticode_verifier_load_cert(struct authenticode_verifier *verifier,
+		const char *filename);
+void authenticode_verifier_set_verbose(struct authenticode_verifier *verifier,
+		bool verbose);
+
+/* Validate signer's chain to a trusted certificate, with untrusted as
+ * the intermediates (unless flags has PKCS7_NOCHAIN). Results are cached
+ * per signer, set of intermediates and flags, as a batch of images will
+ * usually have only a few signers. Returns 1 if the chain is valid. */
+int authenticode_verify_chain(struct authenticode_verifier *verifier,
+		X509 *signer, STACK_OF(X509) *untrusted, int flags);
+
+/* Check that p7 is a valid signature over image. The signed content of
+ * p7 is consumed. On failure, *message (if given) describes why. */
+enum authenticode_status authenticode_verify(
+		struct authenticode_verifier *verifier,
+		struct image *image, PKCS7 *p7, const char **message);
+
+/* Check that si, one of the signer infos of p7, is a valid signature by
+ * cert's key over the signed content. Unlike authenticode_verify, this
+ * neither hashes the image nor validates any chain. The signed content of
+ * p7 is consumed. Returns 1 if the signature is valid. */
+int authenticode_check_signer(PKCS7 *p7, PKCS7_SIGNER_INFO *si, X509 *cert);
+
+/* Called by authenticode_verify_image for each signature, numbered from
+ * zero, before it is checked. Returning false skips the signature. */
+typedef bool (*authenticode_sig_fn)(void *arg, int signum, PKCS7 *p7);
+
+/* Check image's signatures in turn. With sig, only that detached
+ * signature is checked, and not the image's own. The image passes if any
+ * signature verifies. A signature that can't be parsed, or doesn't cover
+ * the image, ends the search, and the image fails unless an earlier
+ * signature verified. fn, if given, may skip signatures. With a verbose
+ * verifier, the result of each check is printed. On failure, *message
+ * (if given) describes why. */
+enum authenticode_status authenticode_verify_image(
+		struct authenticode_verifier *verifier, struct image *image,
+		const uint8_t *sig, size_t sig_len,
+		authenticode_sig_fn fn, void *arg, const char **message);
+
+/* The signer takes its own references to cert and pkey. With
+ * use_skeleton, the invariant parts of the signature are encoded once,
+ * for reuse over many images. */
+struct authenticode_signer *authenticode_signer_new(void *ctx, X509 *cert,
+		EVP_PKEY *pkey, const EVP_MD *md, bool use_skeleton);
+
+/* Include cert in the signatures, as an intermediate for verifiers
+ * building the signer's chain. Must be called before signing. */
+int authenticode_signer_add_cert(struct authenticode_signer *signer,
+		X509 *cert);
+
+/* Sign image, returning the DER-encoded PKCS7 in *sig, allocated as a
+ * talloc child of image */
+int authenticode_sign(struct authenticode_signer *signer,
+		struct image *image, uint8_t **sig, size_t *len);
+
+#endif /* AUTHENTICODE_H */
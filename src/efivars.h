@@ -46,6 +46,26 @@
 	{ 0xc1c41626, 0x504c, 0x4092, \
 	{ 0xac, 0xa9, 0x41, 0xf9, 0x36, 0x93, 0x43, 0x28 } }
 
+#define EFI_CERT_SHA384_GUID \
+	{ 0xff3e5307, 0x9fd0, 0x48c9, \
+	{ 0x85, 0xf1, 0x8a, 0xd5, 0x6c, 0x70, 0x1e, 0x01 } }
+
+#define EFI_CERT_SHA512_GUID \
+	{ 0x093e0fae, 0xa6c4, 0x4f50, \
+	{ 0x9f, 0x1b, 0xd4, 0x1e, 0x2b, 0x89, 0xc1, 0x9a } }
+
+#define EFI_CERT_X509_SHA256_GUID \
+	{ 0x3bd2a492, 0x96c0, 0x4079, \
+	{ 0xb4, 0x20, 0xfc, 0xf9, 0x8e, 0xf1, 0x03, 0xed } }
+
+#define EFI_CERT_X509_SHA384_GUID \
+	{ 0x7076876e, 0x80c2, 0x4ee6, \
+	{ 0xaa, 0xd2, 0x28, 0xb3, 0x49, 0xa6, 0x86, 0x5b } }
+
+#define EFI_CERT_X509_SHA512_GUID \
+	{ 0x446dbf63, 0x2502, 0x4cda, \
+	{ 0xbc, 0xfa, 0x24, 0x65, 0xd2, 0xb0, 0xfe, 0x9d } }
+
 #define EFI_IMAGE_SECURITY_DATABASE_GUID \
 	{ 0xd719b2cb, 0x3d3a, 0x4596, \
 	{ 0xa3, 0xbc, 0xda, 0xd0, 0x0e, 0x67, 0x65, 0x6f } }
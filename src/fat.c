@@ -0,0 +1,684 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <ccan/talloc/talloc.h>
+
+#include "fat.h"
+
+/*
+ * A read-only FAT12/16/32 reader, for finding files on an EFI system
+ * partition within a disk image. The partition may be the whole image,
+ * or found through a GPT or MBR partition table.
+ */
+
+#define SECTOR_SIZE		512
+#define FAT_DIRENT_SIZE		32
+#define FAT_MAX_DEPTH		32
+
+#define FAT_ATTR_VOLUME_ID	0x08
+#define FAT_ATTR_DIRECTORY	0x10
+#define FAT_ATTR_LFN		0x0f
+
+/* short-name case flags (set by Windows NT and later) */
+#define FAT_CASE_LOWER_BASE	0x08
+#define FAT_CASE_LOWER_EXT	0x10
+
+#define MBR_TYPE_GPT		0xee
+#define MBR_TYPE_ESP		0xef
+
+enum fat_type {
+	FAT12,
+	FAT16,
+	FAT32,
+};
+
+struct fat_volume {
+	int		fd;
+	const char	*filename;
+	uint64_t	size;		/* of the disk image */
+	enum fat_type	type;
+	uint64_t	offset;		/* of the volume within the image */
+	uint32_t	sector_size;
+	uint32_t	cluster_size;
+	uint32_t	n_clusters;
+	uint64_t	root_offset;	/* FAT12/16 fixed root directory */
+	uint32_t	root_size;
+	uint32_t	root_cluster;	/* FAT32 */
+	uint64_t	data_offset;	/* of cluster 2 */
+	uint8_t		*fat;
+	size_t		fat_size;
+};
+
+/* a run of contiguous clusters */
+struct fat_extent {
+	uint64_t	offset;
+	uint64_t	len;
+};
+
+static const uint8_t esp_guid[] = {
+	0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11,
+	0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b,
+};
+
+static uint16_t get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+	return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static int read_at(struct fat_volume *vol, uint64_t offset, void *buf,
+		size_t len)
+{
+	ssize_t rc;
+
+	if (offset > vol->size || len > vol->size - offset) {
+		fprintf(stderr, "Offset %llu is beyond the end of %s\n",
+				(unsigned long long)offset, vol->filename);
+		return -1;
+	}
+
+	while (len) {
+		rc = pread(vol->fd, buf, len, offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			fprintf(stderr, "Can't read %s at offset %llu\n",
+					vol->filename,
+					(unsigned long long)offset);
+			return -1;
+		}
+		buf += rc;
+		offset += rc;
+		len -= rc;
+	}
+
+	return 0;
+}
+
+static bool is_power_of_2(uint32_t x)
+{
+	return x && !(x & (x - 1));
+}
+
+/* parse a FAT boot sector at offset; returns 0 if it's a valid volume */
+static int fat_parse_bpb(struct fat_volume *vol, uint64_t offset)
+{
+	uint32_t bps, spc, reserved, n_fats, root_entries, fat_sectors;
+	uint32_t total_sectors, root_sectors, data_sectors;
+	uint8_t bpb[SECTOR_SIZE];
+
+	if (read_at(vol, offset, bpb, sizeof(bpb)))
+		return -1;
+
+	if ((bpb[0] != 0xeb && bpb[0] != 0xe9) ||
+			bpb[510] != 0x55 || bpb[511] != 0xaa)
+		return -1;
+
+	bps = get16(bpb + 11);
+	spc = bpb[13];
+	reserved = get16(bpb + 14);
+	n_fats = bpb[16];
+	root_entries = get16(bpb + 17);
+	total_sectors = get16(bpb + 19) ? : get32(bpb + 32);
+	fat_sectors = get16(bpb + 22) ? : get32(bpb + 36);
+
+	if (bps < 512 || bps > 4096 || !is_power_of_2(bps) ||
+			!is_power_of_2(spc) || !reserved || !n_fats ||
+			!fat_sectors)
+		return -1;
+
+	root_sectors = (root_entries * FAT_DIRENT_SIZE + bps - 1) / bps;
+	if ((uint64_t)reserved + n_fats * fat_sectors + root_sectors >=
+			total_sectors)
+		return -1;
+
+	data_sectors = total_sectors -
+		(reserved + n_fats * fat_sectors + root_sectors);
+
+	vol->offset = offset;
+	vol->sector_size = bps;
+	vol->cluster_size = bps * spc;
+	vol->n_clusters = data_sectors / spc;
+
+	if (vol->n_clusters < 4085)
+		vol->type = FAT12;
+	else if (vol->n_clusters < 65525)
+		vol->type = FAT16;
+	else
+		vol->type = FAT32;
+
+	vol->root_offset = offset +
+		(uint64_t)(reserved + n_fats * fat_sectors) * bps;
+	vol->root_size = root_entries * FAT_DIRENT_SIZE;
+	vol->root_cluster = vol->type == FAT32 ? get32(bpb + 44) : 0;
+	vol->data_offset = vol->root_offset + (uint64_t)root_sectors * bps;
+
+	/* we only need the first copy of the FAT */
+	vol->fat_size = (size_t)fat_sectors * bps;
+	vol->fat = talloc_array(vol, uint8_t, vol->fat_size);
+	posix_fadvise(vol->fd, offset + (uint64_t)reserved * bps,
+			vol->fat_size, POSIX_FADV_WILLNEED);
+	if (read_at(vol, offset + (uint64_t)reserved * bps, vol->fat,
+				vol->fat_size))
+		return -1;
+
+	return 0;
+}
+
+/* find the ESP through a GPT, with either 512- or 4096-byte sectors */
+static int find_gpt_esp(struct fat_volume *vol, uint64_t *offset)
+{
+	static const uint32_t sector_sizes[] = { 512, 4096 };
+	uint8_t hdr[92], entry[128];
+	uint32_t n_entries, entry_size, i, j;
+	uint64_t entries_lba, lba;
+
+	for (i = 0; i < sizeof(sector_sizes) / sizeof(sector_sizes[0]); i++) {
+		if (sector_sizes[i] + sizeof(hdr) > vol->size)
+			break;
+		if (read_at(vol, sector_sizes[i], hdr, sizeof(hdr)))
+			return -1;
+		if (memcmp(hdr, "EFI PART", 8))
+			continue;
+
+		entries_lba = get64(hdr + 72);
+		n_entries = get32(hdr + 80);
+		entry_size = get32(hdr + 84);
+		if (entry_size < sizeof(entry))
+			return -1;
+
+		for (j = 0; j < n_entries; j++) {
+			if (read_at(vol, entries_lba * sector_sizes[i] +
+						(uint64_t)j * entry_size,
+						entry, sizeof(entry)))
+				return -1;
+
+			if (memcmp(entry, esp_guid, sizeof(esp_guid)))
+				continue;
+
+			lba = get64(entry + 32);
+			*offset = lba * sector_sizes[i];
+			return 0;
+		}
+
+		return -1;
+	}
+
+	return -1;
+}
+
+static int find_mbr_esp(struct fat_volume *vol, const uint8_t *mbr,
+		uint64_t *offset)
+{
+	const uint8_t *part;
+	int i;
+
+	if (mbr[510] != 0x55 || mbr[511] != 0xaa)
+		return -1;
+
+	for (i = 0; i < 4; i++) {
+		part = mbr + 446 + i * 16;
+		if (part[4] == MBR_TYPE_GPT)
+			return find_gpt_esp(vol, offset);
+	}
+
+	for (i = 0; i < 4; i++) {
+		part = mbr + 446 + i * 16;
+		if (part[4] == MBR_TYPE_ESP) {
+			*offset = (uint64_t)get32(part + 8) * SECTOR_SIZE;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int fat_volume_destroy(struct fat_volume *vol)
+{
+	close(vol->fd);
+	return 0;
+}
+
+/**
+ * Open the EFI system partition in a disk image. This may be a
+ * partitioned (GPT or MBR) disk image, or a bare FAT filesystem.
+ */
+struct fat_volume *fat_open_disk(void *ctx, const char *filename)
+{
+	uint8_t mbr[SECTOR_SIZE];
+	struct fat_volume *vol;
+	struct stat statbuf;
+	uint64_t offset;
+
+	vol = talloc_zero(ctx, struct fat_volume);
+	vol->filename = talloc_strdup(vol, filename);
+	vol->fd = open(filename, O_RDONLY);
+	if (vol->fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", filename,
+				strerror(errno));
+		talloc_free(vol);
+		return NULL;
+	}
+	talloc_set_destructor(vol, fat_volume_destroy);
+
+	if (fstat(vol->fd, &statbuf)) {
+		perror("fstat");
+		goto err;
+	}
+	vol->size = statbuf.st_size;
+
+	if (vol->size < sizeof(mbr)) {
+		fprintf(stderr, "%s is too small for a disk image\n",
+				filename);
+		goto err;
+	}
+
+	if (read_at(vol, 0, mbr, sizeof(mbr)))
+		goto err;
+
+	/* a boot sector is also a valid MBR, so try it as a filesystem
+	 * first */
+	if (!fat_parse_bpb(vol, 0))
+		return vol;
+
+	if (find_mbr_esp(vol, mbr, &offset) && find_gpt_esp(vol, &offset)) {
+		fprintf(stderr, "No EFI system partition found in %s\n",
+				filename);
+		goto err;
+	}
+
+	if (fat_parse_bpb(vol, offset)) {
+		fprintf(stderr, "Invalid FAT filesystem on the EFI system "
+				"partition of %s\n", filename);
+		goto err;
+	}
+
+	return vol;
+
+err:
+	talloc_free(vol);
+	return NULL;
+}
+
+static uint32_t fat_next_cluster(struct fat_volume *vol, uint32_t cluster)
+{
+	size_t off;
+	uint32_t val;
+
+	switch (vol->type) {
+	case FAT12:
+		off = cluster + cluster / 2;
+		if (off + 2 > vol->fat_size)
+			return 0;
+		val = get16(vol->fat + off);
+		val = cluster & 1 ? val >> 4 : val & 0xfff;
+		return val >= 0xff8 ? 0 : val;
+	case FAT16:
+		off = (size_t)cluster * 2;
+		if (off + 2 > vol->fat_size)
+			return 0;
+		val = get16(vol->fat + off);
+		return val >= 0xfff8 ? 0 : val;
+	case FAT32:
+	default:
+		off = (size_t)cluster * 4;
+		if (off + 4 > vol->fat_size)
+			return 0;
+		val = get32(vol->fat + off) & 0x0fffffff;
+		return val >= 0x0ffffff8 ? 0 : val;
+	}
+}
+
+static bool valid_cluster(struct fat_volume *vol, uint32_t cluster)
+{
+	return cluster >= 2 && cluster < vol->n_clusters + 2;
+}
+
+/*
+ * Map a cluster chain to a list of extents, merging contiguous clusters.
+ * A chain of more clusters than the volume has must contain a loop.
+ */
+static int fat_chain_extents(struct fat_volume *vol, uint32_t cluster,
+		struct fat_extent **extents, unsigned int *n_extents)
+{
+	struct fat_extent *ext;
+	uint32_t n, prev;
+
+	*extents = NULL;
+	*n_extents = 0;
+	prev = 0;
+
+	for (n = 0; cluster; n++, cluster = fat_next_cluster(vol, cluster)) {
+		if (!valid_cluster(vol, cluster) || n > vol->n_clusters) {
+			fprintf(stderr, "Invalid cluster chain in %s\n",
+					vol->filename);
+			talloc_free(*extents);
+			return -1;
+		}
+
+		if (*n_extents && cluster == prev + 1) {
+			(*extents)[*n_extents - 1].len += vol->cluster_size;
+		} else {
+			*extents = talloc_realloc(vol, *extents,
+					struct fat_extent, *n_extents + 1);
+			ext = &(*extents)[(*n_extents)++];
+			ext->offset = vol->data_offset +
+				(uint64_t)(cluster - 2) * vol->cluster_size;
+			ext->len = vol->cluster_size;
+		}
+		prev = cluster;
+	}
+
+	return 0;
+}
+
+/*
+ * Read up to size bytes of a cluster chain, or the whole chain if size
+ * is zero. We know the extents before reading any data, so tell the
+ * kernel about all of them up-front, rather than relying on sequential
+ * readahead, which a fragmented chain defeats.
+ */
+static uint8_t *fat_read_chain(struct fat_volume *vol, uint32_t cluster,
+		size_t size, size_t *len)
+{
+	struct fat_extent *extents;
+	unsigned int i, n_extents;
+	uint64_t total, n;
+	uint8_t *buf;
+
+	if (fat_chain_extents(vol, cluster, &extents, &n_extents))
+		return NULL;
+
+	total = 0;
+	for (i = 0; i < n_extents; i++)
+		total += extents[i].len;
+
+	if (!size)
+		size = total;
+	else if (size > total) {
+		fprintf(stderr, "File is larger than its cluster chain in %s\n",
+				vol->filename);
+		talloc_free(extents);
+		return NULL;
+	}
+
+	for (i = 0, total = 0; i < n_extents && total < size; i++) {
+		posix_fadvise(vol->fd, extents[i].offset, extents[i].len,
+				POSIX_FADV_WILLNEED);
+		total += extents[i].len;
+	}
+
+	buf = talloc_array(NULL, uint8_t, size ? : 1);
+
+	for (i = 0, total = 0; i < n_extents && total < size; i++) {
+		n = extents[i].len;
+		if (n > size - total)
+			n = size - total;
+		if (read_at(vol, extents[i].offset, buf + total, n)) {
+			talloc_free(buf);
+			talloc_free(extents);
+			return NULL;
+		}
+		total += n;
+	}
+
+	talloc_free(extents);
+	*len = size;
+	return buf;
+}
+
+/* append a UCS-2 character to a UTF-8 string */
+static size_t put_utf8(char *s, uint16_t c)
+{
+	if (c < 0x80) {
+		s[0] = c;
+		return 1;
+	} else if (c < 0x800) {
+		s[0] = 0xc0 | c >> 6;
+		s[1] = 0x80 | (c & 0x3f);
+		return 2;
+	}
+	s[0] = 0xe0 | c >> 12;
+	s[1] = 0x80 | ((c >> 6) & 0x3f);
+	s[2] = 0x80 | (c & 0x3f);
+	return 3;
+}
+
+static uint8_t lfn_checksum(const uint8_t *short_name)
+{
+	uint8_t sum = 0;
+	int i;
+
+	for (i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+
+	return sum;
+}
+
+/* long file name state, accumulated over the LFN entries preceding a
+ * short entry */
+struct lfn {
+	uint16_t	name[260];
+	int		seq;
+	uint8_t		checksum;
+};
+
+static void lfn_add(struct lfn *lfn, const uint8_t *ent)
+{
+	static const int offsets[] = {
+		1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30,
+	};
+	int seq = ent[0] & 0x1f, i;
+
+	/* entries are stored last-first, counting down to 1 */
+	if (ent[0] & 0x40) {
+		memset(lfn->name, 0, sizeof(lfn->name));
+		lfn->checksum = ent[13];
+	} else if (seq != lfn->seq - 1 || ent[13] != lfn->checksum) {
+		lfn->seq = 0;
+		return;
+	}
+
+	if (!seq || seq > 20) {
+		lfn->seq = 0;
+		return;
+	}
+
+	lfn->seq = seq;
+	for (i = 0; i < 13; i++)
+		lfn->name[(seq - 1) * 13 + i] = get16(ent + offsets[i]);
+}
+
+static char *dirent_name(void *ctx, const uint8_t *ent, struct lfn *lfn)
+{
+	char name[260 * 3 + 1];
+	size_t len;
+	int i, j;
+
+	len = 0;
+
+	if (lfn->seq == 1 && lfn->checksum == lfn_checksum(ent)) {
+		for (i = 0; i < 260 && lfn->name[i] &&
+				lfn->name[i] != 0xffff; i++)
+			len += put_utf8(name + len, lfn->name[i]);
+	} else {
+		for (i = 0; i < 8 && ent[i] != ' '; i++)
+			name[len++] = ent[12] & FAT_CASE_LOWER_BASE ?
+				tolower(ent[i]) : ent[i];
+		/* 0x05 is an escaped 0xe5 */
+		if (len && (uint8_t)name[0] == 0x05)
+			name[0] = (char)0xe5;
+		for (j = 8; j < 11 && ent[j] != ' '; j++) {
+			if (j == 8)
+				name[len++] = '.';
+			name[len++] = ent[12] & FAT_CASE_LOWER_EXT ?
+				tolower(ent[j]) : ent[j];
+		}
+	}
+
+	lfn->seq = 0;
+	name[len] = '\0';
+
+	return talloc_strdup(ctx, name);
+}
+
+static int fat_walk_dir(struct fat_volume *vol, const char *dir,
+		const uint8_t *buf, size_t len, int depth,
+		fat_filter_fn filter, fat_file_fn fn, void *arg)
+{
+	const uint8_t *ent;
+	struct lfn lfn;
+	uint32_t cluster, size;
+	size_t data_len;
+	uint8_t *data;
+	char *name, *path;
+	size_t i;
+	int rc;
+
+	if (depth > FAT_MAX_DEPTH) {
+		fprintf(stderr, "Directories nested too deeply in %s\n",
+				vol->filename);
+		return -1;
+	}
+
+	lfn.seq = 0;
+	rc = 0;
+
+	for (i = 0; i + FAT_DIRENT_SIZE <= len; i += FAT_DIRENT_SIZE) {
+		ent = buf + i;
+
+		if (ent[0] == 0x00)
+			break;
+		if (ent[0] == 0xe5) {
+			lfn.seq = 0;
+			continue;
+		}
+
+		if ((ent[11] & 0x3f) == FAT_ATTR_LFN) {
+			lfn_add(&lfn, ent);
+			continue;
+		}
+
+		if (ent[11] & FAT_ATTR_VOLUME_ID) {
+			lfn.seq = 0;
+			continue;
+		}
+
+		name = dirent_name(NULL, ent, &lfn);
+		if (!strcmp(name, ".") || !strcmp(name, "..")) {
+			talloc_free(name);
+			continue;
+		}
+
+		path = talloc_asprintf(name, "%s/%s", dir, name);
+		cluster = get16(ent + 26) |
+			(vol->type == FAT32 ? (uint32_t)get16(ent + 20) << 16 : 0);
+		size = get32(ent + 28);
+
+		if (ent[11] & FAT_ATTR_DIRECTORY) {
+			data = fat_read_chain(vol, cluster, 0, &data_len);
+			if (data) {
+				rc = fat_walk_dir(vol, path, data, data_len,
+						depth + 1, filter, fn, arg);
+				talloc_free(data);
+			} else
+				rc = -1;
+
+		} else if (filter(name)) {
+			if (size) {
+				data = fat_read_chain(vol, cluster, size,
+						&data_len);
+			} else {
+				data = talloc_array(NULL, uint8_t, 1);
+				data_len = 0;
+			}
+
+			rc = data ? fn(path, data, data_len, arg) : -1;
+		}
+
+		talloc_free(name);
+		if (rc)
+			break;
+	}
+
+	return rc;
+}
+
+/**
+ * Call fn for each file on the volume whose name passes filter, with the
+ * file's path (from the root, separated by '/') and contents.
+ */
+int fat_walk(struct fat_volume *vol, fat_filter_fn filter,
+		fat_file_fn fn, void *arg)
+{
+	size_t len;
+	uint8_t *buf;
+	int rc;
+
+	if (vol->type == FAT32) {
+		buf = fat_read_chain(vol, vol->root_cluster, 0, &len);
+		if (!buf)
+			return -1;
+	} else {
+		len = vol->root_size;
+		buf = talloc_array(NULL, uint8_t, len ? : 1);
+		if (read_at(vol, vol->root_offset, buf, len)) {
+			talloc_free(buf);
+			return -1;
+		}
+	}
+
+	rc = fat_walk_dir(vol, "", buf, len, 0, filter, fn, arg);
+	talloc_free(buf);
+
+	return rc;
+}
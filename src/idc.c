@@ -29,6 +29,8 @@
  * this exception statement from all source files in the program, then
  * also delete it here.
  */
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <string.h>
 #include <openssl/asn1t.h>
@@ -137,6 +139,7 @@ static int type_set_sequence(void *ctx, ASN1_TYPE *type,
 
 	ASN1_STRING_set(os, seq_data, len);
 	ASN1_TYPE_set(type, V_ASN1_SEQUENCE, os);
+	talloc_free(seq_data);
 	return 0;
 }
 
@@ -157,25 +160,39 @@ const char *sha256_str(const uint8_t *hash)
 	return s;
 }
 
-int IDC_set(PKCS7 *p7, PKCS7_SIGNER_INFO *si, struct image *image)
+/* Look up our Authenticode OIDs, only creating them on first use:
+ * repeated OBJ_create() calls either grow the object table, or fail
+ * with newer OpenSSL versions, when signing many images in one process */
+static int idc_obj_nid(const char *oid, const char *sn, const char *ln)
+{
+	int nid;
+
+	nid = OBJ_txt2nid(oid);
+	if (nid == NID_undef)
+		nid = OBJ_create(oid, sn, ln);
+
+	return nid;
+}
+
+static int idc_set_digest(PKCS7 *p7, PKCS7_SIGNER_INFO *si, void *ctx,
+		const uint8_t *sha)
 {
-	uint8_t *buf, *tmp, sha[SHA256_DIGEST_LENGTH];
 	int idc_nid, peid_nid, len, rc;
+	uint8_t *buf, *tmp;
 	IDC_PEID *peid;
+	PKCS7 *content;
 	ASN1_STRING *s;
 	ASN1_TYPE *t;
 	BIO *sigbio;
 	IDC *idc;
 
-	idc_nid = OBJ_create("1.3.6.1.4.1.311.2.1.4",
+	idc_nid = idc_obj_nid("1.3.6.1.4.1.311.2.1.4",
 			"spcIndirectDataContext",
 			"Indirect Data Context");
-	peid_nid = OBJ_create("1.3.6.1.4.1.311.2.1.15",
+	peid_nid = idc_obj_nid("1.3.6.1.4.1.311.2.1.15",
 			"spcPEImageData",
 			"PE Image Data");
 
-	image_hash_sha256(image, sha);
-
 	idc = IDC_new();
 	peid = IDC_PEID_new();
 
@@ -189,17 +206,21 @@ int IDC_set(PKCS7 *p7, PKCS7_SIGNER_INFO *si, struct image *image)
 
 	idc->data->type = OBJ_nid2obj(peid_nid);
 	idc->data->value = ASN1_TYPE_new();
-	type_set_sequence(image, idc->data->value, peid, &IDC_PEID_it);
+	type_set_sequence(ctx, idc->data->value, peid,
+			ASN1_ITEM_rptr(IDC_PEID));
 
         idc->digest->alg->parameter = ASN1_TYPE_new();
         idc->digest->alg->algorithm = OBJ_nid2obj(NID_sha256);
         idc->digest->alg->parameter->type = V_ASN1_NULL;
-        ASN1_OCTET_STRING_set(idc->digest->digest, sha, sizeof(sha));
+        ASN1_OCTET_STRING_set(idc->digest->digest, sha, SHA256_DIGEST_LENGTH);
 
 	len = i2d_IDC(idc, NULL);
-	tmp = buf = talloc_array(image, uint8_t, len);
+	tmp = buf = talloc_array(ctx, uint8_t, len);
 	i2d_IDC(idc, &tmp);
 
+	IDC_PEID_free(peid);
+	IDC_free(idc);
+
 	/* Add the contentType authenticated attribute */
 	PKCS7_add_signed_attribute(si, NID_pkcs9_contentType, V_ASN1_OBJECT,
 						OBJ_nid2obj(idc_nid));
@@ -214,9 +235,11 @@ int IDC_set(PKCS7 *p7, PKCS7_SIGNER_INFO *si, struct image *image)
 	/* ... then we finalise the p7 content, which does the actual
 	 * signing ... */
 	rc = PKCS7_dataFinal(p7, sigbio);
+	BIO_free_all(sigbio);
 	if (!rc) {
 		fprintf(stderr, "dataFinal failed\n");
 		ERR_print_errors_fp(stderr);
+		talloc_free(buf);
 		return -1;
 	}
 
@@ -225,9 +248,236 @@ int IDC_set(PKCS7 *p7, PKCS7_SIGNER_INFO *si, struct image *image)
 	s = ASN1_STRING_new();
 	ASN1_STRING_set(s, buf, len);
 	ASN1_TYPE_set(t, V_ASN1_SEQUENCE, s);
-	PKCS7_set0_type_other(p7->d.sign->contents, idc_nid, t);
+	content = PKCS7_new();
+	PKCS7_set0_type_other(content, idc_nid, t);
+	PKCS7_set_content(p7, content);
+
+	talloc_free(buf);
+
+	return 0;
+}
+
+int IDC_set(PKCS7 *p7, PKCS7_SIGNER_INFO *si, struct image *image)
+{
+	uint8_t sha[SHA256_DIGEST_LENGTH];
+
+	if (image_hash_sha256(image, sha))
+		return -1;
+
+	return idc_set_digest(p7, si, image, sha);
+}
+
+/*
+ * A pre-encoded signature for one signer. Apart from the image digest, the
+ * messageDigest attribute and the signature value, the DER encoding of
+ * the PKCS7 SignedData is the same for every image signed by a given key
+ * and certificate. So we build and encode it once, record where the
+ * variable parts are, and then just patch those for each image.
+ */
+struct idc_skeleton {
+	uint8_t		*der;
+	size_t		len;
+
+	/* image digest, within the IDC */
+	size_t		digest_off;
+	/* the encoded IDC content */
+	size_t		content_off;
+	size_t		content_len;
+	/* value of the messageDigest signed attribute */
+	size_t		md_off;
+	size_t		md_len;
+	/* the signed attributes, as encoded with their [0] tag */
+	size_t		attrs_off;
+	size_t		attrs_len;
+	/* signature value */
+	size_t		sig_off;
+	size_t		sig_len;
+
+	const EVP_MD	*md;
+	EVP_PKEY	*pkey;
+};
+
+/* find needle in buf, and ensure that it only appears once */
+static int find_unique(const uint8_t *buf, size_t len,
+		const void *needle, size_t needle_len, size_t *off)
+{
+	const uint8_t *p;
+
+	p = memmem(buf, len, needle, needle_len);
+	if (!p)
+		return -1;
+
+	*off = p - buf;
+
+	if (memmem(p + 1, len - *off - 1, needle, needle_len))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Create a signature skeleton for cert and pkey, allocated on ctx, carrying
+ * the (optional) extra certificates in certs. The key must remain valid for
+ * the lifetime of the skeleton. Returns NULL if the signature can't be
+ * represented as a skeleton.
+ */
+struct idc_skeleton *IDC_skeleton_new(void *ctx, X509 *cert,
+		STACK_OF(X509) *certs, EVP_PKEY *pkey, const EVP_MD *md)
+{
+	uint8_t sha[SHA256_DIGEST_LENGTH], *tmp, *attrs = NULL;
+	struct idc_skeleton *skel;
+	PKCS7_SIGNER_INFO *si;
+	ASN1_OCTET_STRING *os;
+	ASN1_STRING *content;
+	int i, attrs_len, len;
+	PKCS7 *p7;
+
+	skel = talloc_zero(ctx, struct idc_skeleton);
+	skel->md = md;
+	skel->pkey = pkey;
+
+	p7 = PKCS7_new();
+	PKCS7_set_type(p7, NID_pkcs7_signed);
+
+	si = PKCS7_sign_add_signer(p7, cert, pkey, md, PKCS7_BINARY);
+	if (!si)
+		goto err;
+
+	for (i = 0; i < sk_X509_num(certs); i++)
+		PKCS7_add_certificate(p7, sk_X509_value(certs, i));
+
+	PKCS7_content_new(p7, NID_pkcs7_data);
+
+	/* sign a placeholder digest, which we can then locate */
+	memset(sha, 0x5a, sizeof(sha));
+	if (idc_set_digest(p7, si, skel, sha))
+		goto err;
+
+	len = i2d_PKCS7(p7, NULL);
+	if (len <= 0)
+		goto err;
+	tmp = skel->der = talloc_array(skel, uint8_t, len);
+	i2d_PKCS7(p7, &tmp);
+	skel->len = len;
+
+	if (find_unique(skel->der, skel->len, sha, sizeof(sha),
+				&skel->digest_off))
+		goto err;
+
+	content = p7->d.sign->contents->d.other->value.sequence;
+	skel->content_len = ASN1_STRING_length(content);
+	if (skel->content_len < 2 ||
+			find_unique(skel->der, skel->len,
+				ASN1_STRING_data(content), skel->content_len,
+				&skel->content_off))
+		goto err;
+
+	os = PKCS7_digest_from_attributes(si->auth_attr);
+	if (!os)
+		goto err;
+	skel->md_len = ASN1_STRING_length(os);
+	if (find_unique(skel->der, skel->len, ASN1_STRING_data(os),
+				skel->md_len, &skel->md_off))
+		goto err;
+
+	/* the signature covers the attributes encoded as a SET; in the
+	 * SignerInfo they're encoded with an implicit [0] tag instead */
+	attrs_len = ASN1_item_i2d((ASN1_VALUE *)si->auth_attr, &attrs,
+			ASN1_ITEM_rptr(PKCS7_ATTR_SIGN));
+	if (attrs_len <= 1 ||
+			find_unique(skel->der, skel->len, attrs + 1,
+				attrs_len - 1, &skel->attrs_off) ||
+			skel->attrs_off == 0)
+		goto err;
+	skel->attrs_off--;
+	skel->attrs_len = attrs_len;
+	if (skel->der[skel->attrs_off] != 0xa0)
+		goto err;
+
+	skel->sig_len = ASN1_STRING_length(si->enc_digest);
+	if (find_unique(skel->der, skel->len,
+				ASN1_STRING_data(si->enc_digest),
+				skel->sig_len, &skel->sig_off))
+		goto err;
+
+	OPENSSL_free(attrs);
+	PKCS7_free(p7);
+	return skel;
+
+err:
+	OPENSSL_free(attrs);
+	PKCS7_free(p7);
+	talloc_free(skel);
+	return NULL;
+}
+
+/**
+ * Sign image using a skeleton, returning the encoded PKCS7 signature
+ * (allocated on the image) in sig and len. Returns 0 on success, or
+ * non-zero if the image could not be signed with the skeleton, in which
+ * case the caller should fall back to building the signature with
+ * IDC_set().
+ */
+int IDC_skeleton_sign(struct idc_skeleton *skel, struct image *image,
+		uint8_t **sig, size_t *len)
+{
+	uint8_t sha[SHA256_DIGEST_LENGTH], md[EVP_MAX_MD_SIZE];
+	uint8_t *buf, *attrs, *sigbuf;
+	unsigned int md_len;
+	EVP_MD_CTX *mctx;
+	size_t sig_len;
+	int rc;
+
+	if (image_hash_sha256(image, sha))
+		return -1;
+
+	buf = talloc_memdup(image, skel->der, skel->len);
+
+	memcpy(buf + skel->digest_off, sha, sizeof(sha));
+
+	/* as in IDC_set(), the signed data is the IDC content, without its
+	 * tag and length */
+	if (!EVP_Digest(buf + skel->content_off + 2, skel->content_len - 2,
+				md, &md_len, skel->md, NULL) ||
+			md_len != skel->md_len)
+		goto err;
+
+	memcpy(buf + skel->md_off, md, md_len);
+
+	attrs = talloc_memdup(buf, buf + skel->attrs_off, skel->attrs_len);
+	attrs[0] = V_ASN1_SET | V_ASN1_CONSTRUCTED;
+
+	mctx = EVP_MD_CTX_create();
+	if (!mctx)
+		goto err;
+
+	rc = EVP_DigestSignInit(mctx, NULL, skel->md, NULL, skel->pkey) > 0 &&
+		EVP_DigestSignUpdate(mctx, attrs, skel->attrs_len) > 0 &&
+		EVP_DigestSignFinal(mctx, NULL, &sig_len) > 0;
+
+	sigbuf = NULL;
+	if (rc) {
+		sigbuf = talloc_array(buf, uint8_t, sig_len);
+		rc = EVP_DigestSignFinal(mctx, sigbuf, &sig_len) > 0;
+	}
+	EVP_MD_CTX_destroy(mctx);
+
+	/* variable-length signatures (eg, ECDSA) may not fit the skeleton */
+	if (!rc || sig_len != skel->sig_len)
+		goto err;
 
+	memcpy(buf + skel->sig_off, sigbuf, sig_len);
+	talloc_free(attrs);
+	talloc_free(sigbuf);
+
+	*sig = buf;
+	*len = skel->len;
 	return 0;
+
+err:
+	ERR_clear_error();
+	talloc_free(buf);
+	return -1;
 }
 
 struct idc *IDC_get(PKCS7 *p7, BIO *bio)
@@ -259,6 +509,7 @@ struct idc *IDC_get(PKCS7 *p7, BIO *bio)
 		} else {
 			fprintf(stderr, "Invalid ASN.1 data in "
 					"IndirectDataContext?\n");
+			IDC_free(idc);
 			return NULL;
 		}
 
@@ -268,34 +519,52 @@ struct idc *IDC_get(PKCS7 *p7, BIO *bio)
 	return idc;
 }
 
-int IDC_check_hash(struct idc *idc, struct image *image)
+static int idc_check_digest(struct idc *idc, const uint8_t *sha,
+		bool report)
 {
-	unsigned char sha[SHA256_DIGEST_LENGTH];
 	const unsigned char *buf;
 	ASN1_STRING *str;
 
-	image_hash_sha256(image, sha);
-
 	/* check hash algorithm sanity */
 	if (OBJ_cmp(idc->digest->alg->algorithm, OBJ_nid2obj(NID_sha256))) {
-		fprintf(stderr, "Invalid algorithm type\n");
+		if (report)
+			fprintf(stderr, "Invalid algorithm type\n");
 		return -1;
 	}
 
 	str = idc->digest->digest;
-	if (ASN1_STRING_length(str) != sizeof(sha)) {
-		fprintf(stderr, "Invalid algorithm length\n");
+	if (ASN1_STRING_length(str) != SHA256_DIGEST_LENGTH) {
+		if (report)
+			fprintf(stderr, "Invalid algorithm length\n");
 		return -1;
 	}
 
 	/* check hash against the one we calculated from the image */
 	buf = ASN1_STRING_data(str);
-	if (memcmp(buf, sha, sizeof(sha))) {
-		fprintf(stderr, "Hash doesn't match image\n");
-		fprintf(stderr, " got:       %s\n", sha256_str(buf));
-		fprintf(stderr, " expecting: %s\n", sha256_str(sha));
+	if (memcmp(buf, sha, SHA256_DIGEST_LENGTH)) {
+		if (report) {
+			fprintf(stderr, "Hash doesn't match image\n");
+			fprintf(stderr, " got:       %s\n", sha256_str(buf));
+			fprintf(stderr, " expecting: %s\n", sha256_str(sha));
+		}
 		return -1;
 	}
 
 	return 0;
 }
+
+/* Quietly compare the IDC digest against a precomputed image hash, so
+ * callers checking several signatures only need to hash the image once */
+int IDC_check_digest(struct idc *idc, const uint8_t *sha)
+{
+	return idc_check_digest(idc, sha, false);
+}
+
+int IDC_check_hash(struct idc *idc, struct image *image)
+{
+	unsigned char sha[SHA256_DIGEST_LENGTH];
+
+	image_hash_sha256(image, sha);
+
+	return idc_check_digest(idc, sha, true);
+}
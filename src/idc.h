@@ -37,10 +37,18 @@
 #include <openssl/pkcs7.h>
 
 struct idc;
+struct idc_skeleton;
 
 int IDC_set(PKCS7 *p7, PKCS7_SIGNER_INFO *si, struct image *image);
 struct idc *IDC_get(PKCS7 *p7, BIO *bio);
 int IDC_check_hash(struct idc *idc, struct image *image);
+int IDC_check_digest(struct idc *idc, const uint8_t *sha);
+void IDC_free(struct idc *idc);
+
+struct idc_skeleton *IDC_skeleton_new(void *ctx, X509 *cert,
+		STACK_OF(X509) *certs, EVP_PKEY *pkey, const EVP_MD *md);
+int IDC_skeleton_sign(struct idc_skeleton *skel, struct image *image,
+		uint8_t **sig, size_t *len);
 
 #endif /* IDC_H */
 
@@ -32,8 +32,12 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
 #include <bfd.h>
 #define DO_NOT_DEFINE_LINENO
 
@@ -86,6 +90,12 @@ struct image {
 	struct region	*checksum_regions;
 	int		n_checksum_regions;
 
+	/* SHA-256 image hash, cached on first use. The hash doesn't
+	 * cover the signature table, so it's unaffected by adding or
+	 * removing signatures */
+	uint8_t		sha256[SHA256_DIGEST_LENGTH];
+	bool		sha256_valid;
+
 	/* Generated signature */
 	void		*sigbuf;
 	size_t		sigsize;
@@ -104,12 +114,16 @@ struct cert_table_header {
 } __attribute__((packed));
 
 struct image *image_load(const char *filename);
+struct image *image_load_buf(uint8_t *buf, size_t size);
 
 int image_hash_sha256(struct image *image, uint8_t digest[]);
+void image_hash_sha256_multi(struct image **images, unsigned int n);
+int image_hash(struct image *image, const EVP_MD *md, uint8_t digest[]);
 int image_add_signature(struct image *, void *sig, int size);
 int image_get_signature(struct image *image, int signum,
 			uint8_t **buf, size_t *size);
 int image_remove_signature(struct image *image, int signum);
+int image_select_signatures(struct image *image, const int *signums, int n);
 int image_write(struct image *image, const char *filename);
 int image_write_detached(struct image *image, int signum, const char *filename);
 
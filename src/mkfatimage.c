@@ -0,0 +1,661 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ccan/talloc/talloc.h>
+
+#include "fileio.h"
+
+/*
+ * Build FAT12/16/32 disk images for the sbverify --disk-image tests,
+ * without mtools or root: a bare volume, or an EFI system partition
+ * within an MBR or GPT partition table. Names are 8.3 only.
+ *
+ * On FAT32, clusters are allocated above 65535, so that reading any
+ * file or directory depends on the high word of its cluster number.
+ */
+
+#define SECTOR_SIZE	512
+#define DIRENT_SIZE	32
+#define ESP_LBA		2048
+
+#define ATTR_DIRECTORY	0x10
+#define ATTR_ARCHIVE	0x20
+
+enum table {
+	TABLE_NONE,
+	TABLE_MBR,
+	TABLE_GPT,
+};
+
+struct node {
+	char		name[11];	/* space-padded 8.3 */
+	bool		dir;
+	uint8_t		*data;
+	size_t		size;
+	uint32_t	cluster;
+	uint32_t	n_clusters;
+	struct node	*parent;
+	struct node	**children;
+	unsigned int	n_children;
+	struct node	*loop;		/* extra entry pointing at this dir */
+};
+
+struct volume {
+	int		fat_bits;
+	uint32_t	reserved;
+	uint32_t	root_entries;
+	uint32_t	fat_sectors;
+	uint32_t	n_clusters;
+	uint32_t	total_sectors;
+	uint32_t	next_cluster;
+	uint8_t		*fat;
+	uint64_t	offset;		/* of the volume within the image */
+	int		fd;
+};
+
+static const uint8_t esp_guid[] = {
+	0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11,
+	0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b,
+};
+
+/* Linux filesystem data, for a partition ahead of the ESP */
+static const uint8_t linux_guid[] = {
+	0xaf, 0x3d, 0xc6, 0x0f, 0x83, 0x84, 0x72, 0x47,
+	0x8e, 0x79, 0x3d, 0x69, 0xd8, 0x47, 0x7d, 0xe4,
+};
+
+static void put16(uint8_t *p, uint16_t x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t x)
+{
+	put16(p, x);
+	put16(p + 2, x >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t x)
+{
+	put32(p, x);
+	put32(p + 4, x >> 32);
+}
+
+static int short_name(const char *name, size_t len, char *out)
+{
+	const char *dot;
+	size_t base_len, ext_len, i;
+
+	dot = memchr(name, '.', len);
+	base_len = dot ? (size_t)(dot - name) : len;
+	ext_len = dot ? len - base_len - 1 : 0;
+
+	if (!base_len || base_len > 8 || ext_len > 3)
+		return -1;
+
+	memset(out, ' ', 11);
+	for (i = 0; i < base_len; i++)
+		out[i] = toupper(name[i]);
+	for (i = 0; i < ext_len; i++)
+		out[8 + i] = toupper(dot[1 + i]);
+
+	return 0;
+}
+
+static struct node *find_child(struct node *dir, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < dir->n_children; i++)
+		if (!memcmp(dir->children[i]->name, name, 11))
+			return dir->children[i];
+
+	return NULL;
+}
+
+static struct node *add_child(struct node *dir, const char *name, bool is_dir)
+{
+	struct node *node;
+
+	node = talloc_zero(dir, struct node);
+	memcpy(node->name, name, 11);
+	node->dir = is_dir;
+	node->parent = dir;
+
+	dir->children = talloc_realloc(dir, dir->children, struct node *,
+			dir->n_children + 1);
+	dir->children[dir->n_children++] = node;
+
+	return node;
+}
+
+/* find or create the node at path, creating its parent directories */
+static struct node *lookup_path(struct node *root, const char *path,
+		bool is_dir)
+{
+	struct node *node, *child;
+	const char *p, *end;
+	char name[11];
+
+	node = root;
+
+	for (p = path; *p; p = end) {
+		while (*p == '/')
+			p++;
+		if (!*p)
+			break;
+
+		end = strchrnul(p, '/');
+		if (short_name(p, end - p, name)) {
+			fprintf(stderr, "Invalid 8.3 name in %s\n", path);
+			return NULL;
+		}
+
+		child = find_child(node, name);
+		if (!child)
+			child = add_child(node, name, *end || is_dir);
+		else if (!child->dir && (*end || is_dir)) {
+			fprintf(stderr, "%s: not a directory\n", path);
+			return NULL;
+		}
+		node = child;
+	}
+
+	return node;
+}
+
+static uint32_t fat_eoc(struct volume *vol)
+{
+	return vol->fat_bits == 12 ? 0xfff :
+		vol->fat_bits == 16 ? 0xffff : 0x0fffffff;
+}
+
+static void fat_set(struct volume *vol, uint32_t cluster, uint32_t val)
+{
+	uint8_t *p;
+
+	switch (vol->fat_bits) {
+	case 12:
+		p = vol->fat + cluster + cluster / 2;
+		if (cluster & 1) {
+			p[0] = (p[0] & 0x0f) | (val << 4 & 0xf0);
+			p[1] = val >> 4;
+		} else {
+			p[0] = val;
+			p[1] = (p[1] & 0xf0) | (val >> 8 & 0x0f);
+		}
+		break;
+	case 16:
+		put16(vol->fat + cluster * 2, val);
+		break;
+	default:
+		put32(vol->fat + cluster * 4, val);
+		break;
+	}
+}
+
+static size_t dir_size(struct node *dir, bool is_root)
+{
+	unsigned int n;
+
+	/* ".", ".." and the loop entry */
+	n = dir->n_children + (is_root ? 0 : 2) + (dir->loop ? 1 : 0);
+
+	return (size_t)n * DIRENT_SIZE;
+}
+
+static int alloc_chain(struct volume *vol, struct node *node, size_t size)
+{
+	uint32_t i;
+
+	node->n_clusters = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	if (!node->n_clusters) {
+		node->cluster = 0;
+		return 0;
+	}
+
+	if (vol->next_cluster + node->n_clusters > vol->n_clusters + 2) {
+		fprintf(stderr, "Volume is full\n");
+		return -1;
+	}
+
+	node->cluster = vol->next_cluster;
+	vol->next_cluster += node->n_clusters;
+
+	for (i = 0; i < node->n_clusters - 1; i++)
+		fat_set(vol, node->cluster + i, node->cluster + i + 1);
+	fat_set(vol, node->cluster + i, fat_eoc(vol));
+
+	return 0;
+}
+
+static int alloc_tree(struct volume *vol, struct node *node, bool is_root)
+{
+	unsigned int i;
+
+	/* FAT12/16 have a fixed root directory, outside the clusters */
+	if (!is_root || vol->fat_bits == 32)
+		if (alloc_chain(vol, node, node->dir ?
+					dir_size(node, is_root) : node->size))
+			return -1;
+
+	for (i = 0; i < node->n_children; i++)
+		if (alloc_tree(vol, node->children[i], false))
+			return -1;
+
+	return 0;
+}
+
+static void put_dirent(uint8_t *ent, const char *name, uint8_t attr,
+		uint32_t cluster, uint32_t size)
+{
+	memcpy(ent, name, 11);
+	ent[11] = attr;
+	put16(ent + 20, cluster >> 16);
+	put16(ent + 26, cluster);
+	put32(ent + 28, size);
+}
+
+static int write_at(struct volume *vol, uint64_t offset, const void *buf,
+		size_t len)
+{
+	if (pwrite(vol->fd, buf, len, vol->offset + offset) != (ssize_t)len) {
+		perror("pwrite");
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t cluster_offset(struct volume *vol, uint32_t cluster)
+{
+	uint32_t root_sectors = vol->root_entries * DIRENT_SIZE / SECTOR_SIZE;
+
+	return ((uint64_t)vol->reserved + 2 * vol->fat_sectors +
+			root_sectors + cluster - 2) * SECTOR_SIZE;
+}
+
+static int write_tree(struct volume *vol, struct node *node, bool is_root)
+{
+	static const char dot[11] = ".          ";
+	static const char dotdot[11] = "..         ";
+	uint8_t *buf, *ent;
+	unsigned int i;
+	uint32_t parent;
+	size_t len;
+	int rc;
+
+	if (!node->dir)
+		return node->size ? write_at(vol,
+				cluster_offset(vol, node->cluster),
+				node->data, node->size) : 0;
+
+	len = dir_size(node, is_root);
+	buf = talloc_zero_array(node, uint8_t, len ? : 1);
+	ent = buf;
+
+	if (!is_root) {
+		parent = node->parent->parent ? node->parent->cluster : 0;
+		put_dirent(ent, dot, ATTR_DIRECTORY, node->cluster, 0);
+		put_dirent(ent + DIRENT_SIZE, dotdot, ATTR_DIRECTORY,
+				parent, 0);
+		ent += 2 * DIRENT_SIZE;
+	}
+
+	for (i = 0; i < node->n_children; i++, ent += DIRENT_SIZE) {
+		struct node *child = node->children[i];
+
+		put_dirent(ent, child->name,
+				child->dir ? ATTR_DIRECTORY : ATTR_ARCHIVE,
+				child->cluster, child->dir ? 0 : child->size);
+	}
+
+	if (node->loop)
+		put_dirent(ent, node->loop->name, ATTR_DIRECTORY,
+				node->cluster, 0);
+
+	if (is_root && vol->fat_bits != 32)
+		rc = write_at(vol, ((uint64_t)vol->reserved +
+					2 * vol->fat_sectors) * SECTOR_SIZE,
+				buf, len);
+	else
+		rc = write_at(vol, cluster_offset(vol, node->cluster),
+				buf, len);
+	talloc_free(buf);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < node->n_children; i++)
+		if (write_tree(vol, node->children[i], false))
+			return -1;
+
+	return 0;
+}
+
+static int write_boot_sector(struct volume *vol, struct node *root)
+{
+	uint8_t bs[SECTOR_SIZE], fsinfo[SECTOR_SIZE];
+	bool fat32 = vol->fat_bits == 32;
+
+	memset(bs, 0, sizeof(bs));
+	memcpy(bs, fat32 ? "\xeb\x58\x90" : "\xeb\x3c\x90", 3);
+	memcpy(bs + 3, "MSWIN4.1", 8);
+	put16(bs + 11, SECTOR_SIZE);
+	bs[13] = 1;				/* sectors per cluster */
+	put16(bs + 14, vol->reserved);
+	bs[16] = 2;				/* FATs */
+	put16(bs + 17, vol->root_entries);
+	if (vol->total_sectors < 0x10000)
+		put16(bs + 19, vol->total_sectors);
+	else
+		put32(bs + 32, vol->total_sectors);
+	bs[21] = 0xf8;				/* media */
+	put16(bs + 24, 32);			/* sectors per track */
+	put16(bs + 26, 64);			/* heads */
+	put32(bs + 28, vol->offset / SECTOR_SIZE);
+
+	if (fat32) {
+		put32(bs + 36, vol->fat_sectors);
+		put32(bs + 44, root->cluster);
+		put16(bs + 48, 1);		/* FSInfo sector */
+		put16(bs + 50, 6);		/* backup boot sector */
+		bs[64] = 0x80;
+		bs[66] = 0x29;
+		memcpy(bs + 71, "NO NAME    FAT32   ", 19);
+	} else {
+		put16(bs + 22, vol->fat_sectors);
+		bs[36] = 0x80;
+		bs[38] = 0x29;
+		memcpy(bs + 43, vol->fat_bits == 12 ?
+				"NO NAME    FAT12   " :
+				"NO NAME    FAT16   ", 19);
+	}
+	bs[510] = 0x55;
+	bs[511] = 0xaa;
+
+	if (write_at(vol, 0, bs, sizeof(bs)))
+		return -1;
+
+	if (!fat32)
+		return 0;
+
+	memset(fsinfo, 0, sizeof(fsinfo));
+	memcpy(fsinfo, "RRaA", 4);
+	memcpy(fsinfo + 484, "rrAa", 4);
+	put32(fsinfo + 488, 0xffffffff);	/* free count unknown */
+	put32(fsinfo + 492, 0xffffffff);
+	put32(fsinfo + 508, 0xaa550000);
+
+	return write_at(vol, SECTOR_SIZE, fsinfo, sizeof(fsinfo)) ||
+		write_at(vol, 6 * SECTOR_SIZE, bs, sizeof(bs));
+}
+
+/* an MBR with a Linux partition ahead of the ESP, or a protective MBR */
+static int write_mbr(int fd, enum table table, uint64_t disk_sectors)
+{
+	uint8_t mbr[SECTOR_SIZE], *part;
+
+	memset(mbr, 0, sizeof(mbr));
+	part = mbr + 446;
+
+	if (table == TABLE_GPT) {
+		part[4] = 0xee;
+		put32(part + 8, 1);
+		put32(part + 12, disk_sectors - 1 > 0xffffffff ?
+				0xffffffff : disk_sectors - 1);
+	} else {
+		part[4] = 0x83;
+		put32(part + 8, 64);
+		put32(part + 12, ESP_LBA - 64);
+		part += 16;
+		part[4] = 0xef;
+		put32(part + 8, ESP_LBA);
+		put32(part + 12, disk_sectors - ESP_LBA);
+	}
+
+	mbr[510] = 0x55;
+	mbr[511] = 0xaa;
+
+	return pwrite(fd, mbr, sizeof(mbr), 0) == sizeof(mbr) ? 0 : -1;
+}
+
+/* a GPT with a Linux partition ahead of the ESP. Only what sbverify
+ * reads is filled in; there is no backup header, nor CRCs */
+static int write_gpt(int fd, uint64_t disk_sectors)
+{
+	uint8_t hdr[SECTOR_SIZE], entries[4 * 128];
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, "EFI PART", 8);
+	put32(hdr + 8, 0x00010000);		/* revision */
+	put32(hdr + 12, 92);			/* header size */
+	put64(hdr + 24, 1);			/* this header */
+	put64(hdr + 40, 34);			/* first usable LBA */
+	put64(hdr + 48, disk_sectors - 34);	/* last usable LBA */
+	put64(hdr + 72, 2);			/* entries LBA */
+	put32(hdr + 80, 4);			/* number of entries */
+	put32(hdr + 84, 128);			/* entry size */
+
+	memset(entries, 0, sizeof(entries));
+	memcpy(entries, linux_guid, sizeof(linux_guid));
+	put64(entries + 32, 64);
+	put64(entries + 40, ESP_LBA - 1);
+	memcpy(entries + 128, esp_guid, sizeof(esp_guid));
+	put64(entries + 128 + 32, ESP_LBA);
+	put64(entries + 128 + 40, disk_sectors - 34);
+
+	if (pwrite(fd, hdr, sizeof(hdr), SECTOR_SIZE) != sizeof(hdr) ||
+			pwrite(fd, entries, sizeof(entries),
+				2 * SECTOR_SIZE) != sizeof(entries))
+		return -1;
+
+	return 0;
+}
+
+static void volume_init(void *ctx, struct volume *vol, int fat_bits)
+{
+	uint32_t fat_bytes;
+
+	vol->fat_bits = fat_bits;
+
+	/* cluster counts well within each type's range */
+	switch (fat_bits) {
+	case 12:
+		vol->n_clusters = 2000;
+		break;
+	case 16:
+		vol->n_clusters = 20000;
+		break;
+	default:
+		vol->n_clusters = 80000;
+		break;
+	}
+
+	vol->reserved = fat_bits == 32 ? 32 : 1;
+	vol->root_entries = fat_bits == 32 ? 0 : 512;
+
+	fat_bytes = (vol->n_clusters + 2) * fat_bits / 8 + 1;
+	vol->fat_sectors = (fat_bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	vol->fat = talloc_zero_array(ctx, uint8_t,
+			vol->fat_sectors * SECTOR_SIZE);
+
+	vol->total_sectors = vol->reserved + 2 * vol->fat_sectors +
+		vol->root_entries * DIRENT_SIZE / SECTOR_SIZE +
+		vol->n_clusters;
+
+	vol->next_cluster = fat_bits == 32 ? 0x10010 : 2;
+
+	fat_set(vol, 0, 0x0ffffff8);
+	fat_set(vol, 1, fat_eoc(vol));
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-f 12|16|32] [-t none|mbr|gpt] [-l <dir>] "
+			"<image> [<path>=<file>...]\n"
+			"  -l <dir>  add a LOOP directory to <dir>, "
+			"pointing back at <dir>\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t disk_sectors;
+	struct volume vol;
+	struct node *root, *node;
+	enum table table;
+	const char *loop;
+	char *path, *sep;
+	int c, i, fat_bits, rc;
+
+	fat_bits = 16;
+	table = TABLE_NONE;
+	loop = NULL;
+
+	while ((c = getopt(argc, argv, "f:t:l:h")) != -1) {
+		switch (c) {
+		case 'f':
+			fat_bits = atoi(optarg);
+			if (fat_bits != 12 && fat_bits != 16 &&
+					fat_bits != 32) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			if (!strcmp(optarg, "none"))
+				table = TABLE_NONE;
+			else if (!strcmp(optarg, "mbr"))
+				table = TABLE_MBR;
+			else if (!strcmp(optarg, "gpt"))
+				table = TABLE_GPT;
+			else {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'l':
+			loop = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	root = talloc_zero(NULL, struct node);
+	root->dir = true;
+
+	for (i = optind + 1; i < argc; i++) {
+		path = talloc_strdup(root, argv[i]);
+		sep = strchr(path, '=');
+		if (!sep) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		*sep = '\0';
+
+		node = lookup_path(root, path, false);
+		if (!node || node == root || node->dir)
+			return EXIT_FAILURE;
+
+		if (fileio_read_file(node, sep + 1, &node->data, &node->size))
+			return EXIT_FAILURE;
+	}
+
+	if (loop) {
+		node = lookup_path(root, loop, true);
+		if (!node || node == root) {
+			fprintf(stderr, "Can't loop the root directory\n");
+			return EXIT_FAILURE;
+		}
+		node->loop = talloc_zero(node, struct node);
+		memcpy(node->loop->name, "LOOP       ", 11);
+	}
+
+	memset(&vol, 0, sizeof(vol));
+	volume_init(root, &vol, fat_bits);
+
+	if (alloc_tree(&vol, root, true))
+		return EXIT_FAILURE;
+
+	vol.offset = table == TABLE_NONE ? 0 : ESP_LBA * SECTOR_SIZE;
+	disk_sectors = vol.offset / SECTOR_SIZE + vol.total_sectors;
+	if (table == TABLE_GPT)
+		disk_sectors += 34;
+
+	vol.fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (vol.fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", argv[optind],
+				strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* the image is sparse: only the metadata and files are written */
+	rc = ftruncate(vol.fd, disk_sectors * SECTOR_SIZE) ||
+		(table != TABLE_NONE && write_mbr(vol.fd, table, disk_sectors)) ||
+		(table == TABLE_GPT && write_gpt(vol.fd, disk_sectors)) ||
+		write_boot_sector(&vol, root) ||
+		write_at(&vol, (uint64_t)vol.reserved * SECTOR_SIZE, vol.fat,
+			vol.fat_sectors * SECTOR_SIZE) ||
+		write_at(&vol, ((uint64_t)vol.reserved + vol.fat_sectors) *
+			SECTOR_SIZE, vol.fat, vol.fat_sectors * SECTOR_SIZE) ||
+		write_tree(&vol, root, true);
+
+	close(vol.fd);
+	talloc_free(root);
+
+	if (rc) {
+		fprintf(stderr, "Can't write %s\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
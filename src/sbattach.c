@@ -48,6 +48,7 @@
 #include <openssl/pkcs7.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/x509.h>
 
 #include <ccan/talloc/talloc.h>
 #include <ccan/read_write_all/read_write_all.h>
@@ -55,7 +56,10 @@
 #include "config.h"
 
 #include "image.h"
+#include "idc.h"
 #include "fileio.h"
+#include "siglist.h"
+#include "authenticode.h"
 
 static const char *toolname = "sbattach";
 
@@ -66,6 +70,9 @@ static struct option options[] = {
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
 	{ "signum", required_argument, NULL, 's' },
+	{ "prune", no_argument, NULL, 'p' },
+	{ "cert", required_argument, NULL, 'c' },
+	{ "dbx", required_argument, NULL, 'x' },
 	{ NULL, 0, NULL, 0 },
 };
 
@@ -74,6 +81,8 @@ static void usage(void)
 	printf("Usage: %s --attach <sigfile> <efi-boot-image>\n"
 		"   or: %s --detach <sigfile> [--remove] <efi-boot-image>\n"
 		"   or: %s --remove <efi-boot-image>\n"
+		"   or: %s --prune [--cert <certfile>] [--dbx <dbxfile>] "
+			"<efi-boot-image>\n"
 		"Attach or detach a signature file to/from a boot image\n"
 		"\n"
 		"Options:\n"
@@ -84,8 +93,18 @@ static void usage(void)
 		"\t--remove            remove the boot image's signature\n"
 		"\t                     table from the original file\n"
 	        "\t--signum            signature to operate on (defaults to\n"
-	        "\t                     first)\n",
-		toolname, toolname, toolname);
+	        "\t                     first)\n"
+		"\t--prune             remove stale and duplicate signatures,\n"
+		"\t                     and order the remaining signatures so\n"
+		"\t                     the most likely to verify is first\n"
+		"\t--cert <certfile>   with --prune, remove signatures not made\n"
+		"\t                     by (or issued by) <certfile>. May be\n"
+		"\t                     specified multiple times\n"
+		"\t--dbx <dbxfile>     with --prune, remove signatures by\n"
+		"\t                     certificates (or certificate hashes)\n"
+		"\t                     in the EFI_SIGNATURE_LIST data in\n"
+		"\t                     <dbxfile>\n",
+		toolname, toolname, toolname, toolname);
 }
 
 static void version(void)
@@ -124,6 +143,7 @@ static int attach_sig(struct image *image, const char *image_filename,
 	}
 	rc = PKCS7_verify(p7, NULL, NULL, NULL, NULL,
 				PKCS7_BINARY | PKCS7_NOVERIFY | PKCS7_NOSIGS);
+	PKCS7_free(p7);
 	if (!rc) {
 		fprintf(stderr, "PKCS7 verification failed for file %s\n",
 				sig_filename);
@@ -162,27 +182,222 @@ static int remove_sig(struct image *image, int signum,
 	return rc;
 }
 
+struct prune_context {
+	STACK_OF(X509)	*trusted;
+	struct authenticode_verifier *verifier;
+	uint8_t		*dbx;
+	size_t		dbx_len;
+};
+
+/* ranks for ordering pruned signatures: lower ranks go first */
+enum sig_rank {
+	RANK_DIRECT,	/* signer is in the trust store */
+	RANK_ISSUED,	/* signer chains to a cert in the trust store */
+	RANK_UNKNOWN,	/* no trust store given */
+	RANK_REMOVE,
+};
+
+struct sig_entry {
+	int			signum;
+	enum sig_rank		rank;
+	PKCS7			*p7;
+	PKCS7_SIGNER_INFO	*si;
+	X509			*signer;
+};
+
+/* The signer's chain is built as sbverify does, through any intermediates
+ * carried in the signature */
+static enum sig_rank trust_rank(struct prune_context *ctx, X509 *signer,
+		STACK_OF(X509) *certs)
+{
+	int i;
+
+	if (!ctx->trusted)
+		return RANK_UNKNOWN;
+
+	for (i = 0; i < sk_X509_num(ctx->trusted); i++)
+		if (!X509_cmp(sk_X509_value(ctx->trusted, i), signer))
+			return RANK_DIRECT;
+
+	if (authenticode_verify_chain(ctx->verifier, signer, certs,
+				PKCS7_BINARY))
+		return RANK_ISSUED;
+
+	return RANK_REMOVE;
+}
+
+static bool same_signer(PKCS7_SIGNER_INFO *a, PKCS7_SIGNER_INFO *b)
+{
+	return !X509_NAME_cmp(a->issuer_and_serial->issuer,
+				b->issuer_and_serial->issuer) &&
+		!ASN1_INTEGER_cmp(a->issuer_and_serial->serial,
+				b->issuer_and_serial->serial);
+}
+
+/* Parse a signature, and decide whether it is worth keeping. Signatures
+ * are removed if they don't cover the current image, if the signature
+ * itself doesn't verify, or if their signer (or any certificate they
+ * carry) is untrusted or revoked. */
+static void prune_classify(struct prune_context *ctx, struct image *image,
+		const uint8_t *sha, struct sig_entry *entry)
+{
+	const uint8_t *tmp;
+	STACK_OF(X509) *certs;
+	struct idc *idc;
+	uint8_t *buf;
+	size_t len;
+	int i, rc;
+
+	entry->rank = RANK_REMOVE;
+
+	if (image_get_signature(image, entry->signum, &buf, &len))
+		return;
+
+	tmp = buf;
+	entry->p7 = d2i_PKCS7(NULL, &tmp, len);
+	if (!entry->p7 || !PKCS7_type_is_signed(entry->p7))
+		return;
+
+	if (sk_PKCS7_SIGNER_INFO_num(entry->p7->d.sign->signer_info) != 1)
+		return;
+
+	entry->si = sk_PKCS7_SIGNER_INFO_value(
+			entry->p7->d.sign->signer_info, 0);
+
+	idc = IDC_get(entry->p7, NULL);
+	if (!idc)
+		return;
+
+	rc = IDC_check_digest(idc, sha);
+	IDC_free(idc);
+	if (rc)
+		return;
+
+	certs = entry->p7->d.sign->cert;
+	entry->signer = X509_find_by_issuer_and_serial(certs,
+			entry->si->issuer_and_serial->issuer,
+			entry->si->issuer_and_serial->serial);
+	if (!entry->signer)
+		return;
+
+	if (ctx->dbx)
+		for (i = 0; i < sk_X509_num(certs); i++)
+			if (siglist_cert_revoked(ctx->dbx, ctx->dbx_len,
+						sk_X509_value(certs, i)))
+				return;
+
+	/* the first signature kept by a signer stands for any others, so
+	 * it must be one that verifies */
+	if (!authenticode_check_signer(entry->p7, entry->si, entry->signer))
+		return;
+
+	entry->rank = trust_rank(ctx, entry->signer, certs);
+}
+
+static int prune_sigs(struct prune_context *ctx, struct image *image,
+		const char *image_filename)
+{
+	uint8_t sha[SHA256_DIGEST_LENGTH], *buf;
+	struct sig_entry *entries;
+	int i, j, n, n_keep, *keep;
+	enum sig_rank rank;
+	size_t len;
+	int rc;
+
+	if (!image->sigbuf) {
+		fprintf(stderr, "Image has no signatures to prune\n");
+		return 0;
+	}
+
+	for (n = 0; !image_get_signature(image, n, &buf, &len); n++)
+		;
+
+	if (image_hash_sha256(image, sha))
+		return -1;
+
+	entries = talloc_zero_array(image, struct sig_entry, n);
+	keep = talloc_array(entries, int, n);
+
+	for (i = 0; i < n; i++) {
+		entries[i].signum = i;
+		prune_classify(ctx, image, sha, &entries[i]);
+
+		if (entries[i].rank == RANK_REMOVE)
+			continue;
+
+		/* drop duplicates: every kept signature covers the same
+		 * digest, so a matching signer makes it redundant */
+		for (j = 0; j < i; j++) {
+			if (entries[j].rank != RANK_REMOVE &&
+					same_signer(entries[i].si,
+						entries[j].si)) {
+				entries[i].rank = RANK_REMOVE;
+				break;
+			}
+		}
+	}
+
+	/* stable ordering by rank, preserving the original order within
+	 * each rank */
+	n_keep = 0;
+	for (rank = RANK_DIRECT; rank < RANK_REMOVE; rank++)
+		for (i = 0; i < n; i++)
+			if (entries[i].rank == rank)
+				keep[n_keep++] = entries[i].signum;
+
+	for (i = 0; i < n; i++)
+		PKCS7_free(entries[i].p7);
+
+	for (i = 0; i < n_keep && keep[i] == i; i++)
+		;
+
+	if (i == n_keep && n_keep == n) {
+		printf("No signatures pruned\n");
+		talloc_free(entries);
+		return 0;
+	}
+
+	rc = image_select_signatures(image, keep, n_keep);
+	talloc_free(entries);
+	if (rc)
+		return rc;
+
+	printf("Pruned %d of %d signatures\n", n - n_keep, n);
+
+	rc = image_write(image, image_filename);
+	if (rc)
+		fprintf(stderr, "Error writing %s: %s\n", image_filename,
+				strerror(errno));
+
+	return rc;
+}
+
 enum action {
 	ACTION_NONE,
 	ACTION_ATTACH,
 	ACTION_DETACH,
+	ACTION_PRUNE,
 };
 
 int main(int argc, char **argv)
 {
-	const char *image_filename, *sig_filename;
+	const char *image_filename, *sig_filename, *dbx_filename;
+	struct prune_context prune_ctx;
 	struct image *image;
 	enum action action;
 	bool remove;
 	int c, rc, signum = 0;
+	X509 *cert;
 
 	action = ACTION_NONE;
 	sig_filename = NULL;
+	dbx_filename = NULL;
 	remove = false;
+	memset(&prune_ctx, 0, sizeof(prune_ctx));
 
 	for (;;) {
 		int idx;
-		c = getopt_long(argc, argv, "a:d:s:rhV", options, &idx);
+		c = getopt_long(argc, argv, "a:d:s:pc:x:rhV", options, &idx);
 		if (c == -1)
 			break;
 
@@ -197,6 +412,30 @@ int main(int argc, char **argv)
 			action = (c == 'a') ? ACTION_ATTACH : ACTION_DETACH;
 			sig_filename = optarg;
 			break;
+		case 'p':
+			if (action != ACTION_NONE) {
+				fprintf(stderr, "Multiple actions specified\n");
+				usage();
+				return EXIT_FAILURE;
+			}
+			action = ACTION_PRUNE;
+			break;
+		case 'c':
+			if (!prune_ctx.trusted) {
+				prune_ctx.trusted = sk_X509_new_null();
+				prune_ctx.verifier =
+					authenticode_verifier_new(NULL);
+			}
+			cert = fileio_read_cert(optarg);
+			if (!cert)
+				return EXIT_FAILURE;
+			sk_X509_push(prune_ctx.trusted, cert);
+			authenticode_verifier_add_cert(prune_ctx.verifier,
+					cert);
+			break;
+		case 'x':
+			dbx_filename = optarg;
+			break;
 		case 's':
 			/* humans count from 1 not zero */
 			signum = atoi(optarg) - 1;
@@ -225,8 +464,20 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (action == ACTION_PRUNE && remove) {
+		fprintf(stderr, "Can't use --remove with --prune\n");
+		return EXIT_FAILURE;
+	}
+
+	if (action != ACTION_PRUNE && (prune_ctx.trusted || dbx_filename)) {
+		fprintf(stderr, "--cert and --dbx are only valid with "
+				"--prune\n");
+		return EXIT_FAILURE;
+	}
+
 	if (action == ACTION_NONE && !remove) {
-		fprintf(stderr, "No action (attach/detach/remove) specified\n");
+		fprintf(stderr, "No action (attach/detach/remove/prune) "
+				"specified\n");
 		usage();
 		return EXIT_FAILURE;
 	}
@@ -248,12 +499,22 @@ int main(int argc, char **argv)
 
 	rc = 0;
 
+	if (dbx_filename) {
+		rc = fileio_read_file(image, dbx_filename,
+				&prune_ctx.dbx, &prune_ctx.dbx_len);
+		if (rc)
+			goto out;
+	}
+
 	if (action == ACTION_ATTACH)
 		rc = attach_sig(image, image_filename, sig_filename);
 
 	else if (action == ACTION_DETACH)
 		rc = detach_sig(image, signum, sig_filename);
 
+	else if (action == ACTION_PRUNE)
+		rc = prune_sigs(&prune_ctx, image, image_filename);
+
 	if (rc)
 		goto out;
 
@@ -261,6 +522,9 @@ int main(int argc, char **argv)
 		rc = remove_sig(image, signum, image_filename);
 
 out:
+	if (prune_ctx.trusted)
+		sk_X509_pop_free(prune_ctx.trusted, X509_free);
+	talloc_free(prune_ctx.verifier);
 	talloc_free(image);
 	return (rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,1175 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <getopt.h>
+
+#include <ccan/list/list.h>
+#include <ccan/talloc/talloc.h>
+#include <ccan/read_write_all/read_write_all.h>
+
+#include <openssl/conf.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pkcs7.h>
+
+#include "image.h"
+#include "fileio.h"
+#include "authenticode.h"
+
+static const char *toolname = "sbbatch";
+
+/*
+ * sbbatch runs a signing or verification manifest over a set of worker
+ * processes. The coordinator splits the manifest into chunks of
+ * consecutive items, and hands them out to workers as they ask for
+ * work. Once no unassigned chunks remain, an idle worker steals the
+ * unstarted tail of the largest in-progress chunk. If a worker
+ * disconnects part-way through a chunk, the items it hadn't completed
+ * are queued again, up to the retry limit.
+ *
+ * Workers connect to the coordinator over a UNIX socket. Local workers
+ * are forked by the coordinator; workers on other hosts can be started
+ * with --worker, given a socket forwarded to the coordinator's.
+ *
+ * The protocol is line-based, with tab-separated fields:
+ *
+ *  worker -> coordinator:
+ *    HELLO <name>
+ *    GET
+ *    RESULT <index> <OK|FAIL> <message>
+ *
+ *  coordinator -> worker:
+ *    CONFIG <sign|verify> <cert> <key>
+ *    CHUNK <n>, followed by n lines of: ITEM <index> <image> <output>
+ *    CONT / STOP	(after each RESULT: whether to continue the chunk)
+ *    EXIT
+ *
+ * After a CHUNK, the coordinator may truncate the chunk (when its tail is
+ * stolen) by answering a RESULT with STOP.
+ */
+
+#define BATCH_LINE_MAX		8192
+#define DEFAULT_CHUNK_SIZE	8
+#define DEFAULT_RETRIES		2
+
+enum batch_mode {
+	BATCH_SIGN,
+	BATCH_VERIFY,
+};
+
+static const char *mode_names[] = {
+	[BATCH_SIGN] = "sign",
+	[BATCH_VERIFY] = "verify",
+};
+
+struct batch_item {
+	const char	*image;
+	const char	*output;
+	bool		done;
+	bool		ok;
+	const char	*message;
+};
+
+/* a range of items: [next, end) remain to be completed */
+struct batch_chunk {
+	unsigned int		next;
+	unsigned int		end;
+	int			attempts;
+	struct list_node	list;
+};
+
+struct batch_worker {
+	int			fd;
+	const char		*name;
+	char			buf[BATCH_LINE_MAX];
+	size_t			buf_len;
+	bool			idle;
+	struct batch_chunk	*chunk;
+	struct list_node	list;
+};
+
+struct coordinator {
+	enum batch_mode		mode;
+	const char		*certfilename;
+	const char		*keyfilename;
+	struct batch_item	*items;
+	unsigned int		n_items;
+	unsigned int		n_done;
+	unsigned int		chunk_size;
+	int			retries;
+	int			verbose;
+	int			listen_fd;
+	/* only our own workers can connect to a private socket */
+	bool			private_socket;
+	unsigned int		n_local_workers;
+	struct list_head	queue;
+	struct list_head	workers;
+};
+
+struct worker_context {
+	enum batch_mode			mode;
+	struct authenticode_signer	*signer;
+	struct authenticode_verifier	*verifier;
+	const char			*certfilename;
+	const char			*keyfilename;
+	FILE				*in;
+	int				fd;
+};
+
+static struct option options[] = {
+	{ "sign", no_argument, NULL, 's' },
+	{ "verify", no_argument, NULL, 'y' },
+	{ "cert", required_argument, NULL, 'c' },
+	{ "key", required_argument, NULL, 'k' },
+	{ "workers", required_argument, NULL, 'j' },
+	{ "chunk-size", required_argument, NULL, 'n' },
+	{ "retries", required_argument, NULL, 'r' },
+	{ "socket", required_argument, NULL, 'S' },
+	{ "worker", no_argument, NULL, 'w' },
+	{ "report", required_argument, NULL, 'o' },
+	{ "verbose", no_argument, NULL, 'v' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+	{ NULL, 0, NULL, 0 },
+};
+
+static void usage(void)
+{
+	printf("Usage: %s [options] --sign|--verify --cert <certfile> "
+			"<manifest>\n"
+		"       %s --worker --socket <socket> [--cert <certfile>] "
+			"[--key <keyfile>]\n"
+		"Sign or verify a manifest of EFI boot images in parallel.\n\n"
+		"Each line of the manifest names an image, optionally followed\n"
+		"by a tab and the output file for the signed image (default\n"
+		"<image>.signed).\n\n"
+		"Options:\n"
+		"\t--sign                sign the images in the manifest\n"
+		"\t--verify              verify the images in the manifest\n"
+		"\t--cert <certfile>     certificate to sign with or verify\n"
+		"\t                       against\n"
+		"\t--key <keyfile>       signing key (for --sign)\n"
+		"\t--workers <n>         number of local worker processes\n"
+		"\t                       (default: number of CPUs)\n"
+		"\t--chunk-size <n>      images per chunk of work (default %d)\n"
+		"\t--retries <n>         times to retry a chunk whose worker\n"
+		"\t                       failed (default %d)\n"
+		"\t--socket <socket>     listen on <socket>, for workers on\n"
+		"\t                       other hosts; with --worker, the\n"
+		"\t                       coordinator socket to connect to\n"
+		"\t--worker              run as a worker; --cert and --key\n"
+		"\t                       override the coordinator's paths\n"
+		"\t--report <file>       write the report to <file>, rather\n"
+		"\t                       than stdout\n",
+		toolname, toolname, DEFAULT_CHUNK_SIZE, DEFAULT_RETRIES);
+}
+
+static void version(void)
+{
+	printf("%s %s\n", toolname, VERSION);
+}
+
+/* split a line into tab-separated fields, in place */
+static int split_fields(char *line, char **fields, int max_fields)
+{
+	int n;
+
+	for (n = 0; n < max_fields; n++) {
+		fields[n] = line;
+		line = strchr(line, '\t');
+		if (!line)
+			return n + 1;
+		*line++ = '\0';
+	}
+
+	return n;
+}
+
+static int send_line(int fd, const char *fmt, ...)
+{
+	va_list ap;
+	char *line;
+	bool rc;
+
+	va_start(ap, fmt);
+	line = talloc_vasprintf(NULL, fmt, ap);
+	va_end(ap);
+
+	rc = write_all(fd, line, strlen(line));
+	talloc_free(line);
+
+	return rc ? 0 : -1;
+}
+
+static bool valid_field(const char *str)
+{
+	return !strpbrk(str, "\t\n");
+}
+
+/* parse a count given as an option argument: returns the count, or -1
+ * if str isn't an integer of at least min */
+static int parse_count(const char *str, int min)
+{
+	char *end;
+	long n;
+
+	if (!isdigit((unsigned char)*str))
+		return -1;
+
+	errno = 0;
+	n = strtol(str, &end, 10);
+	if (errno || *end || n < min || n > INT_MAX)
+		return -1;
+
+	return n;
+}
+
+/* worker side */
+
+static int worker_configure(struct worker_context *ctx, char **fields,
+		int n_fields)
+{
+	const char *certfilename, *keyfilename;
+	EVP_PKEY *pkey;
+	X509 *cert;
+	int rc;
+
+	if (n_fields != 4 || strcmp(fields[0], "CONFIG")) {
+		fprintf(stderr, "Invalid configuration from coordinator\n");
+		return -1;
+	}
+
+	if (!strcmp(fields[1], mode_names[BATCH_SIGN]))
+		ctx->mode = BATCH_SIGN;
+	else if (!strcmp(fields[1], mode_names[BATCH_VERIFY]))
+		ctx->mode = BATCH_VERIFY;
+	else {
+		fprintf(stderr, "Invalid mode '%s'\n", fields[1]);
+		return -1;
+	}
+
+	/* paths given on our command line take precedence, as the
+	 * coordinator's may not be valid on this host */
+	certfilename = ctx->certfilename ? : fields[2];
+	keyfilename = ctx->keyfilename ? : fields[3];
+
+	cert = fileio_read_cert(certfilename);
+	if (!cert)
+		return -1;
+
+	rc = -1;
+
+	if (ctx->mode == BATCH_SIGN) {
+		pkey = fileio_read_pkey(keyfilename);
+		if (pkey) {
+			/* a worker signs many images with the one key */
+			ctx->signer = authenticode_signer_new(ctx, cert, pkey,
+					EVP_get_digestbyname("SHA256"), true);
+			EVP_PKEY_free(pkey);
+			rc = 0;
+		}
+	} else {
+		ctx->verifier = authenticode_verifier_new(ctx);
+		if (ctx->verifier)
+			rc = authenticode_verifier_add_cert(ctx->verifier,
+					cert);
+	}
+
+	X509_free(cert);
+	return rc;
+}
+
+static bool worker_sign(struct worker_context *ctx, struct image *image,
+		const char *output, const char **message)
+{
+	uint8_t *buf;
+	size_t len;
+
+	if (authenticode_sign(ctx->signer, image, &buf, &len)) {
+		*message = "can't create signature";
+		return false;
+	}
+
+	image_add_signature(image, buf, len);
+	talloc_free(buf);
+
+	if (image_write(image, output)) {
+		*message = "can't write signed image";
+		return false;
+	}
+
+	*message = "signed";
+	return true;
+}
+
+static bool worker_verify(struct worker_context *ctx, struct image *image,
+		const char **message)
+{
+	enum authenticode_status status;
+
+	status = authenticode_verify_image(ctx->verifier, image, NULL, 0,
+			NULL, NULL, message);
+	ERR_clear_error();
+
+	if (status != AUTHENTICODE_OK)
+		return false;
+
+	*message = "signature verification OK";
+	return true;
+}
+
+static bool worker_process(struct worker_context *ctx, const char *filename,
+		const char *output, const char **message)
+{
+	struct image *image;
+	bool ok;
+
+	image = image_load(filename);
+	if (!image) {
+		*message = "can't load image";
+		return false;
+	}
+
+	if (ctx->mode == BATCH_SIGN)
+		ok = worker_sign(ctx, image, output, message);
+	else
+		ok = worker_verify(ctx, image, message);
+
+	talloc_free(image);
+	return ok;
+}
+
+/* read a line from the coordinator, splitting it into fields */
+static int worker_read(struct worker_context *ctx, char *line,
+		char **fields, int max_fields)
+{
+	size_t len;
+
+	if (!fgets(line, BATCH_LINE_MAX, ctx->in))
+		return -1;
+
+	len = strlen(line);
+	if (!len || line[len - 1] != '\n')
+		return -1;
+	line[len - 1] = '\0';
+
+	return split_fields(line, fields, max_fields);
+}
+
+static int worker_run_chunk(struct worker_context *ctx, unsigned int n)
+{
+	char line[BATCH_LINE_MAX], *fields[4];
+	struct batch_item *items;
+	const char *message;
+	unsigned int i;
+	int *indices;
+	bool ok;
+
+	items = talloc_zero_array(NULL, struct batch_item, n);
+	indices = talloc_array(items, int, n);
+
+	for (i = 0; i < n; i++) {
+		if (worker_read(ctx, line, fields, 4) != 4 ||
+				strcmp(fields[0], "ITEM"))
+			goto err;
+		indices[i] = atoi(fields[1]);
+		items[i].image = talloc_strdup(items, fields[2]);
+		items[i].output = talloc_strdup(items, fields[3]);
+	}
+
+	for (i = 0; i < n; i++) {
+		ok = worker_process(ctx, items[i].image, items[i].output,
+				&message);
+
+		if (send_line(ctx->fd, "RESULT\t%d\t%s\t%s\n", indices[i],
+					ok ? "OK" : "FAIL", message))
+			goto err;
+
+		if (worker_read(ctx, line, fields, 1) != 1)
+			goto err;
+
+		/* the rest of the chunk has been given to another worker */
+		if (!strcmp(fields[0], "STOP"))
+			break;
+		if (strcmp(fields[0], "CONT"))
+			goto err;
+	}
+
+	talloc_free(items);
+	return 0;
+
+err:
+	talloc_free(items);
+	return -1;
+}
+
+static int worker_connect(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", socket_path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "Can't connect to %s: %s\n", socket_path,
+				strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int worker_main(const char *socket_path, const char *certfilename,
+		const char *keyfilename)
+{
+	char line[BATCH_LINE_MAX], host[64], *fields[4];
+	struct worker_context *ctx;
+	int n, rc;
+
+	ctx = talloc_zero(NULL, struct worker_context);
+	ctx->certfilename = certfilename;
+	ctx->keyfilename = keyfilename;
+	rc = -1;
+
+	ctx->fd = worker_connect(socket_path);
+	if (ctx->fd < 0)
+		goto out;
+
+	ctx->in = fdopen(ctx->fd, "r");
+	if (!ctx->in) {
+		close(ctx->fd);
+		goto out;
+	}
+
+	if (gethostname(host, sizeof(host)))
+		strcpy(host, "unknown");
+	host[sizeof(host) - 1] = '\0';
+
+	if (send_line(ctx->fd, "HELLO\t%s:%d\n", host, getpid()))
+		goto out;
+
+	n = worker_read(ctx, line, fields, 4);
+	if (n < 0 || worker_configure(ctx, fields, n))
+		goto out;
+
+	for (;;) {
+		if (send_line(ctx->fd, "GET\n"))
+			goto out;
+
+		n = worker_read(ctx, line, fields, 2);
+		if (n == 1 && !strcmp(fields[0], "EXIT"))
+			break;
+
+		if (n != 2 || strcmp(fields[0], "CHUNK")) {
+			fprintf(stderr, "Invalid request from coordinator\n");
+			goto out;
+		}
+
+		if (worker_run_chunk(ctx, atoi(fields[1])))
+			goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (ctx->in)
+		fclose(ctx->in);
+	talloc_free(ctx);
+	return rc;
+}
+
+/* coordinator side */
+
+static int read_manifest(struct coordinator *coord, const char *filename)
+{
+	char *buf, *line, *next, *fields[2];
+	struct batch_item *item;
+	size_t len;
+	int n;
+
+	if (fileio_read_file(coord, filename, (uint8_t **)&buf, &len))
+		return -1;
+
+	/* make the buffer a string */
+	buf = talloc_realloc(coord, buf, char, len + 1);
+	buf[len] = '\0';
+
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		if (!*line || *line == '#')
+			continue;
+
+		n = split_fields(line, fields, 2);
+		if (n == 2 && strchr(fields[1], '\t')) {
+			fprintf(stderr, "Invalid manifest entry: %s\n", line);
+			return -1;
+		}
+
+		coord->items = talloc_realloc(coord, coord->items,
+				struct batch_item, coord->n_items + 1);
+		item = &coord->items[coord->n_items++];
+		memset(item, 0, sizeof(*item));
+		item->image = fields[0];
+		item->output = n == 2 ? fields[1] :
+			talloc_asprintf(coord, "%s.signed", fields[0]);
+	}
+
+	return 0;
+}
+
+static void queue_chunks(struct coordinator *coord)
+{
+	struct batch_chunk *chunk;
+	unsigned int i;
+
+	for (i = 0; i < coord->n_items; i += coord->chunk_size) {
+		chunk = talloc_zero(coord, struct batch_chunk);
+		chunk->next = i;
+		chunk->end = i + coord->chunk_size;
+		if (chunk->end > coord->n_items)
+			chunk->end = coord->n_items;
+		list_add_tail(&coord->queue, &chunk->list);
+	}
+}
+
+static void complete_item(struct coordinator *coord, unsigned int i,
+		bool ok, const char *message)
+{
+	struct batch_item *item = &coord->items[i];
+
+	if (item->done)
+		return;
+
+	item->done = true;
+	item->ok = ok;
+	item->message = talloc_strdup(coord->items, message);
+	coord->n_done++;
+}
+
+/* take the unstarted tail of the in-progress chunk with the most work
+ * remaining. The item at chunk->next is in progress, so isn't
+ * stealable. */
+static struct batch_chunk *steal_chunk(struct coordinator *coord)
+{
+	struct batch_chunk *victim, *chunk;
+	struct batch_worker *worker;
+	unsigned int remaining, n;
+
+	victim = NULL;
+	remaining = 0;
+
+	list_for_each(&coord->workers, worker, list) {
+		if (!worker->chunk)
+			continue;
+		n = worker->chunk->end - worker->chunk->next - 1;
+		if (n > remaining) {
+			victim = worker->chunk;
+			remaining = n;
+		}
+	}
+
+	if (!victim)
+		return NULL;
+
+	n = (remaining + 1) / 2;
+
+	chunk = talloc_zero(coord, struct batch_chunk);
+	chunk->end = victim->end;
+	chunk->next = victim->end - n;
+	chunk->attempts = victim->attempts;
+	victim->end = chunk->next;
+
+	if (coord->verbose)
+		fprintf(stderr, "stealing items %d-%d\n",
+				chunk->next + 1, chunk->end);
+
+	return chunk;
+}
+
+static int assign_chunk(struct coordinator *coord,
+		struct batch_worker *worker, struct batch_chunk *chunk)
+{
+	struct batch_item *item;
+	unsigned int i;
+
+	worker->chunk = chunk;
+	worker->idle = false;
+
+	if (coord->verbose)
+		fprintf(stderr, "%s: items %d-%d\n", worker->name,
+				chunk->next + 1, chunk->end);
+
+	if (send_line(worker->fd, "CHUNK\t%d\n", chunk->end - chunk->next))
+		return -1;
+
+	for (i = chunk->next; i < chunk->end; i++) {
+		item = &coord->items[i];
+		if (send_line(worker->fd, "ITEM\t%d\t%s\t%s\n", i,
+					item->image, item->output))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void drop_worker(struct coordinator *coord,
+		struct batch_worker *worker)
+{
+	struct batch_chunk *chunk = worker->chunk;
+	unsigned int i;
+
+	if (coord->verbose)
+		fprintf(stderr, "%s: disconnected\n", worker->name);
+
+	/* requeue the incomplete part of the worker's chunk */
+	if (chunk) {
+		if (++chunk->attempts > coord->retries) {
+			for (i = chunk->next; i < chunk->end; i++)
+				complete_item(coord, i, false,
+						"worker failed");
+			talloc_free(chunk);
+		} else
+			list_add(&coord->queue, &chunk->list);
+	}
+
+	list_del(&worker->list);
+	close(worker->fd);
+	talloc_free(worker);
+}
+
+/* hand out work to any idle workers, and tell them to exit once the
+ * manifest is complete */
+static void dispatch(struct coordinator *coord)
+{
+	struct batch_worker *worker, *tmp;
+	struct batch_chunk *chunk;
+
+	list_for_each_safe(&coord->workers, worker, tmp, list) {
+		if (!worker->idle)
+			continue;
+
+		if (coord->n_done == coord->n_items) {
+			send_line(worker->fd, "EXIT\n");
+			worker->idle = false;
+			continue;
+		}
+
+		chunk = list_top(&coord->queue, struct batch_chunk, list);
+		if (chunk)
+			list_del(&chunk->list);
+		else
+			chunk = steal_chunk(coord);
+
+		if (!chunk)
+			continue;
+
+		if (assign_chunk(coord, worker, chunk))
+			drop_worker(coord, worker);
+	}
+}
+
+static int handle_line(struct coordinator *coord,
+		struct batch_worker *worker, char *line)
+{
+	struct batch_chunk *chunk = worker->chunk;
+	char *fields[4];
+	unsigned int i;
+	int n;
+
+	n = split_fields(line, fields, 4);
+
+	if (n == 2 && !strcmp(fields[0], "HELLO")) {
+		worker->name = talloc_strdup(worker, fields[1]);
+		return send_line(worker->fd, "CONFIG\t%s\t%s\t%s\n",
+				mode_names[coord->mode],
+				coord->certfilename,
+				coord->keyfilename ? : "-");
+	}
+
+	if (n == 1 && !strcmp(fields[0], "GET")) {
+		if (chunk)
+			return -1;
+		worker->idle = true;
+		return 0;
+	}
+
+	if (n == 4 && !strcmp(fields[0], "RESULT")) {
+		i = atoi(fields[1]);
+		if (!chunk || i != chunk->next)
+			return -1;
+
+		complete_item(coord, i, !strcmp(fields[2], "OK"), fields[3]);
+
+		if (++chunk->next < chunk->end)
+			return send_line(worker->fd, "CONT\n");
+
+		worker->chunk = NULL;
+		talloc_free(chunk);
+		return send_line(worker->fd, "STOP\n");
+	}
+
+	return -1;
+}
+
+static int handle_input(struct coordinator *coord,
+		struct batch_worker *worker)
+{
+	char *line, *end;
+	ssize_t len;
+
+	len = read(worker->fd, worker->buf + worker->buf_len,
+			sizeof(worker->buf) - worker->buf_len);
+	if (len <= 0)
+		return -1;
+
+	worker->buf_len += len;
+
+	for (;;) {
+		line = worker->buf;
+		end = memchr(line, '\n', worker->buf_len);
+		if (!end)
+			break;
+		*end = '\0';
+
+		if (handle_line(coord, worker, line))
+			return -1;
+
+		worker->buf_len -= end + 1 - line;
+		memmove(worker->buf, end + 1, worker->buf_len);
+	}
+
+	/* no room left for a complete line */
+	if (worker->buf_len == sizeof(worker->buf))
+		return -1;
+
+	return 0;
+}
+
+static void accept_worker(struct coordinator *coord)
+{
+	struct batch_worker *worker;
+	int fd;
+
+	fd = accept(coord->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	worker = talloc_zero(coord, struct batch_worker);
+	worker->fd = fd;
+	worker->name = "worker";
+	list_add_tail(&coord->workers, &worker->list);
+}
+
+static void reap_local_workers(struct coordinator *coord)
+{
+	while (coord->n_local_workers && waitpid(-1, NULL, WNOHANG) > 0)
+		coord->n_local_workers--;
+}
+
+static int coordinator_run(struct coordinator *coord)
+{
+	struct batch_worker *worker, *tmp;
+	struct pollfd *pollfds;
+	unsigned int i, n;
+
+	for (;;) {
+		dispatch(coord);
+
+		reap_local_workers(coord);
+
+		if (list_empty(&coord->workers)) {
+			if (coord->n_done == coord->n_items)
+				break;
+
+			/* nobody left who could do the remaining work */
+			if (coord->private_socket && !coord->n_local_workers) {
+				for (i = 0; i < coord->n_items; i++)
+					complete_item(coord, i, false,
+							"no workers available");
+				break;
+			}
+		}
+
+		n = 1;
+		list_for_each(&coord->workers, worker, list)
+			n++;
+
+		pollfds = talloc_array(coord, struct pollfd, n);
+		pollfds[0].fd = coord->listen_fd;
+		pollfds[0].events = POLLIN;
+		i = 1;
+		list_for_each(&coord->workers, worker, list) {
+			pollfds[i].fd = worker->fd;
+			pollfds[i].events = POLLIN;
+			i++;
+		}
+
+		/* time out periodically, to notice local workers that exit
+		 * before connecting */
+		if (poll(pollfds, n, 1000) < 0 && errno != EINTR) {
+			perror("poll");
+			talloc_free(pollfds);
+			return -1;
+		}
+
+		i = 1;
+		list_for_each_safe(&coord->workers, worker, tmp, list) {
+			if (pollfds[i++].revents &&
+					handle_input(coord, worker))
+				drop_worker(coord, worker);
+		}
+
+		if (pollfds[0].revents & POLLIN)
+			accept_worker(coord);
+
+		talloc_free(pollfds);
+	}
+
+	return 0;
+}
+
+static int coordinator_listen(struct coordinator *coord,
+		const char *socket_path)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", socket_path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	coord->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (coord->listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (bind(coord->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(coord->listen_fd, 16)) {
+		fprintf(stderr, "Can't listen on %s: %s\n", socket_path,
+				strerror(errno));
+		close(coord->listen_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int start_local_workers(struct coordinator *coord,
+		const char *socket_path, unsigned int n)
+{
+	unsigned int i;
+	pid_t pid;
+	int rc;
+
+	for (i = 0; i < n; i++) {
+		fflush(NULL);
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return -1;
+		}
+
+		if (!pid) {
+			close(coord->listen_fd);
+			rc = worker_main(socket_path, NULL, NULL);
+			exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+
+		coord->n_local_workers++;
+	}
+
+	return 0;
+}
+
+static int write_report(struct coordinator *coord, const char *filename)
+{
+	struct batch_item *item;
+	unsigned int i, failed;
+	FILE *fp;
+
+	fp = filename ? fopen(filename, "w") : stdout;
+	if (!fp) {
+		fprintf(stderr, "Can't open %s: %s\n", filename,
+				strerror(errno));
+		return -1;
+	}
+
+	failed = 0;
+	for (i = 0; i < coord->n_items; i++) {
+		item = &coord->items[i];
+		fprintf(fp, "%d\t%s\t%s\t%s\n", i + 1, item->image,
+				item->ok ? "OK" : "FAIL", item->message);
+		if (!item->ok)
+			failed++;
+	}
+
+	if (filename)
+		fclose(fp);
+
+	if (failed)
+		fprintf(stderr, "%d of %d images failed\n", failed,
+				coord->n_items);
+
+	return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *socket_path, *report_filename;
+	struct coordinator *coord;
+	unsigned int i, n_workers;
+	char *tmpdir;
+	bool worker;
+	int c, n, rc;
+
+	coord = talloc_zero(NULL, struct coordinator);
+	coord->mode = -1;
+	coord->chunk_size = DEFAULT_CHUNK_SIZE;
+	coord->retries = DEFAULT_RETRIES;
+	coord->listen_fd = -1;
+	list_head_init(&coord->queue);
+	list_head_init(&coord->workers);
+
+	/* sysconf() may fail */
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	n_workers = n > 0 ? n : 1;
+	report_filename = NULL;
+	socket_path = NULL;
+	tmpdir = NULL;
+	worker = false;
+
+	for (;;) {
+		int idx;
+		c = getopt_long(argc, argv, "syc:k:j:n:r:S:wo:vhV",
+				options, &idx);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 's':
+			coord->mode = BATCH_SIGN;
+			break;
+		case 'y':
+			coord->mode = BATCH_VERIFY;
+			break;
+		case 'c':
+			coord->certfilename = optarg;
+			break;
+		case 'k':
+			coord->keyfilename = optarg;
+			break;
+		case 'j':
+			n = parse_count(optarg, 0);
+			if (n < 0) {
+				fprintf(stderr, "error: Invalid number of "
+						"workers: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			n_workers = n;
+			break;
+		case 'n':
+			n = parse_count(optarg, 1);
+			if (n < 0) {
+				fprintf(stderr, "error: Invalid chunk "
+						"size: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			coord->chunk_size = n;
+			break;
+		case 'r':
+			n = parse_count(optarg, 0);
+			if (n < 0) {
+				fprintf(stderr, "error: Invalid retry "
+						"count: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			coord->retries = n;
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 'w':
+			worker = true;
+			break;
+		case 'o':
+			report_filename = optarg;
+			break;
+		case 'v':
+			coord->verbose = 1;
+			break;
+		case 'V':
+			version();
+			return EXIT_SUCCESS;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		}
+	}
+
+	ERR_load_crypto_strings();
+	OpenSSL_add_all_digests();
+	OPENSSL_config(NULL);
+	/* here we may get highly unlikely failures or we'll get a
+	 * complaint about FIPS signatures (usually becuase the FIPS
+	 * module isn't present).  In either case ignore the errors
+	 * (malloc will cause other failures out lower down */
+	ERR_clear_error();
+
+	if (worker) {
+		if (!socket_path) {
+			fprintf(stderr, "error: --worker requires --socket\n");
+			usage();
+			return EXIT_FAILURE;
+		}
+		rc = worker_main(socket_path, coord->certfilename,
+				coord->keyfilename);
+		talloc_free(coord);
+		return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (argc != optind + 1 || (int)coord->mode < 0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if (!coord->certfilename) {
+		fprintf(stderr,
+			"error: No certificate specified (with --cert)\n");
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if (coord->mode == BATCH_SIGN && !coord->keyfilename) {
+		fprintf(stderr, "error: No key specified (with --key)\n");
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if (!n_workers && !socket_path) {
+		fprintf(stderr, "error: No local workers, and no --socket "
+				"for remote workers\n");
+		return EXIT_FAILURE;
+	}
+
+	/* the protocol is tab- and line-delimited */
+	if (!valid_field(coord->certfilename) ||
+			(coord->keyfilename &&
+			 !valid_field(coord->keyfilename))) {
+		fprintf(stderr, "error: Invalid certificate or key path\n");
+		return EXIT_FAILURE;
+	}
+
+	if (read_manifest(coord, argv[optind]))
+		return EXIT_FAILURE;
+
+	queue_chunks(coord);
+
+	if (!socket_path) {
+		tmpdir = talloc_strdup(coord, "/tmp/sbbatch.XXXXXX");
+		if (!mkdtemp(tmpdir)) {
+			perror("mkdtemp");
+			return EXIT_FAILURE;
+		}
+		socket_path = talloc_asprintf(coord, "%s/socket", tmpdir);
+		coord->private_socket = true;
+	}
+
+	/* workers may disconnect while we're writing to them */
+	signal(SIGPIPE, SIG_IGN);
+
+	rc = coordinator_listen(coord, socket_path);
+	if (!rc && coord->n_items)
+		rc = start_local_workers(coord, socket_path, n_workers);
+	if (!rc)
+		rc = coordinator_run(coord);
+
+	if (coord->listen_fd >= 0) {
+		close(coord->listen_fd);
+		unlink(socket_path);
+	}
+	if (tmpdir)
+		rmdir(tmpdir);
+
+	while (coord->n_local_workers && wait(NULL) > 0)
+		coord->n_local_workers--;
+
+	if (!rc) {
+		/* any items not completed above have failed */
+		for (i = 0; i < coord->n_items; i++)
+			if (!coord->items[i].done)
+				complete_item(coord, i, false, "not run");
+		rc = write_report(coord, report_filename);
+	}
+
+	talloc_free(coord);
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1205 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <getopt.h>
+
+#include <ccan/array_size/array_size.h>
+#include <ccan/endian/endian.h>
+#include <ccan/talloc/talloc.h>
+#include <ccan/read_write_all/read_write_all.h>
+
+#include <openssl/bn.h>
+#include <openssl/conf.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pkcs7.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+
+#include "image.h"
+#include "fileio.h"
+#include "workpool.h"
+
+static const char *toolname = "sbindex";
+static const int cert_name_len = 160;
+
+/*
+ * The index is a single file, laid out in columns so that a query only
+ * needs to touch the columns it uses. All integers are little-endian, and
+ * each column starts on an 8-byte boundary.
+ *
+ *   header
+ *   image columns (n_images entries each, signer_start has n_images + 1)
+ *   signer columns (n_signers entries each)
+ *   string table (NUL-terminated strings, referenced by offset)
+ *
+ * The signers of image i are entries [signer_start[i], signer_start[i+1])
+ * of the signer columns.
+ */
+enum index_column {
+	COL_DEV,		/* uint64_t */
+	COL_INO,		/* uint64_t */
+	COL_SIZE,		/* uint64_t */
+	COL_MTIME,		/* uint64_t, nanoseconds */
+	COL_PATH,		/* uint32_t string offset */
+	COL_FLAGS,		/* uint32_t */
+	COL_NSIGS,		/* uint32_t */
+	COL_DIGEST,		/* uint8_t[SHA256_DIGEST_LENGTH] */
+	COL_SIGNER_START,	/* uint32_t */
+	COL_SIGNER_SIGNUM,	/* uint32_t */
+	COL_SIGNER_ISSUER,	/* uint32_t string offset */
+	COL_SIGNER_SERIAL,	/* uint32_t string offset */
+	COL_SIGNER_FP,		/* uint8_t[SHA256_DIGEST_LENGTH] */
+	COL_STRTAB,
+	N_COLS,
+};
+
+#define INDEX_MAGIC	"SBINDEX"
+#define INDEX_VERSION	1
+
+struct index_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	n_images;
+	uint32_t	n_signers;
+	uint32_t	strtab_size;
+	uint64_t	cols[N_COLS];
+};
+
+/* image is not a valid PE/COFF file; no digest or signatures */
+#define IMAGE_INVALID	0x1
+
+struct index_signer {
+	uint32_t	signum;
+	const char	*issuer;
+	const char	*serial;
+	uint8_t		fingerprint[SHA256_DIGEST_LENGTH];
+};
+
+struct index_entry {
+	const char		*path;
+	uint64_t		dev;
+	uint64_t		ino;
+	uint64_t		size;
+	uint64_t		mtime;
+	uint32_t		flags;
+	uint32_t		n_sigs;
+	uint8_t			digest[SHA256_DIGEST_LENGTH];
+	struct index_signer	*signers;
+	uint32_t		n_signers;
+	bool			stale;
+};
+
+/* a mapped index file */
+struct index {
+	const uint8_t		*map;
+	size_t			size;
+	const struct index_header *hdr;
+	uint32_t		n_images;
+	uint32_t		n_signers;
+};
+
+struct index_context {
+	struct index_entry	*entries;
+	unsigned int		n_entries;
+	struct index		*old;
+	/* indices into old, sorted by (dev, ino) */
+	uint32_t		*old_sorted;
+	int			verbose;
+};
+
+static struct option options[] = {
+	{ "update", no_argument, NULL, 'u' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "signed-by", required_argument, NULL, 's' },
+	{ "not-signed-by", required_argument, NULL, 'n' },
+	{ "unsigned", no_argument, NULL, 'U' },
+	{ "digest", required_argument, NULL, 'd' },
+	{ "list", no_argument, NULL, 'l' },
+	{ "verbose", no_argument, NULL, 'v' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+	{ NULL, 0, NULL, 0 },
+};
+
+static void usage(void)
+{
+	printf("Usage: %s --update [--jobs <n>] <index> <path>...\n"
+		"       %s [query options] <index>\n"
+		"Maintain and query an index of EFI boot image signatures.\n\n"
+		"Update options:\n"
+		"\t--update              (re)build <index> from the files in\n"
+		"\t                       <path>s (files or directories).\n"
+		"\t                       Files that are unchanged since the\n"
+		"\t                       last update are not re-read\n"
+		"\t--jobs <n>            number of parallel readers (default:\n"
+		"\t                       number of CPUs)\n"
+		"Query options (combined with 'and'):\n"
+		"\t--signed-by <cert>    images with a signature by <cert>\n"
+		"\t--not-signed-by <cert>\n"
+		"\t                      images with no signature by <cert>\n"
+		"\t--unsigned            images with no signatures\n"
+		"\t--digest <sha256>     images with this Authenticode digest\n"
+		"\t--list                print the indexed data for each image\n",
+		toolname, toolname);
+}
+
+static void version(void)
+{
+	printf("%s %s\n", toolname, VERSION);
+}
+
+/* index file access */
+
+static const void *index_col(struct index *index, enum index_column col)
+{
+	return index->map + le64_to_cpu(index->hdr->cols[col]);
+}
+
+static uint32_t index_u32(struct index *index, enum index_column col,
+		uint32_t i)
+{
+	const uint32_t *p = index_col(index, col);
+	return le32_to_cpu(p[i]);
+}
+
+static uint64_t index_u64(struct index *index, enum index_column col,
+		uint32_t i)
+{
+	const uint64_t *p = index_col(index, col);
+	return le64_to_cpu(p[i]);
+}
+
+static const uint8_t *index_digest(struct index *index,
+		enum index_column col, uint32_t i)
+{
+	const uint8_t *p = index_col(index, col);
+	return p + (size_t)i * SHA256_DIGEST_LENGTH;
+}
+
+static const char *index_str(struct index *index, enum index_column col,
+		uint32_t i)
+{
+	return (const char *)index_col(index, COL_STRTAB) +
+		index_u32(index, col, i);
+}
+
+static int index_destroy(struct index *index)
+{
+	munmap((void *)index->map, index->size);
+	return 0;
+}
+
+static size_t col_size(enum index_column col, uint32_t n_images,
+		uint32_t n_signers)
+{
+	switch (col) {
+	case COL_DEV:
+	case COL_INO:
+	case COL_SIZE:
+	case COL_MTIME:
+		return (size_t)n_images * sizeof(uint64_t);
+	case COL_PATH:
+	case COL_FLAGS:
+	case COL_NSIGS:
+		return (size_t)n_images * sizeof(uint32_t);
+	case COL_DIGEST:
+		return (size_t)n_images * SHA256_DIGEST_LENGTH;
+	case COL_SIGNER_START:
+		return ((size_t)n_images + 1) * sizeof(uint32_t);
+	case COL_SIGNER_SIGNUM:
+	case COL_SIGNER_ISSUER:
+	case COL_SIGNER_SERIAL:
+		return (size_t)n_signers * sizeof(uint32_t);
+	case COL_SIGNER_FP:
+		return (size_t)n_signers * SHA256_DIGEST_LENGTH;
+	default:
+		return 0;
+	}
+}
+
+/* Check the column contents that lookups rely on, so that they don't
+ * need their own bounds checks: string offsets must lie within the
+ * string table, and each image's signers must be a range of the signer
+ * columns */
+static bool index_check_contents(struct index *index)
+{
+	static const enum index_column str_cols[] = {
+		COL_PATH, COL_SIGNER_ISSUER, COL_SIGNER_SERIAL,
+	};
+	uint32_t strtab_size, start, prev, n, i;
+	const char *strtab;
+	unsigned int c;
+
+	/* with a terminating NUL, every offset into the table starts a
+	 * NUL-terminated string */
+	strtab = index_col(index, COL_STRTAB);
+	strtab_size = le32_to_cpu(index->hdr->strtab_size);
+	if (strtab_size && strtab[strtab_size - 1] != '\0')
+		return false;
+
+	for (c = 0; c < ARRAY_SIZE(str_cols); c++) {
+		n = str_cols[c] == COL_PATH ? index->n_images :
+			index->n_signers;
+		for (i = 0; i < n; i++)
+			if (index_u32(index, str_cols[c], i) >= strtab_size)
+				return false;
+	}
+
+	prev = 0;
+	for (i = 0; i <= index->n_images; i++) {
+		start = index_u32(index, COL_SIGNER_START, i);
+		if (start < prev || start > index->n_signers)
+			return false;
+		prev = start;
+	}
+
+	return index_u32(index, COL_SIGNER_START, 0) == 0 &&
+		prev == index->n_signers;
+}
+
+static struct index *index_open(void *ctx, const char *filename,
+		bool missing_ok)
+{
+	const struct index_header *hdr;
+	struct index *index;
+	struct stat statbuf;
+	uint64_t off, size;
+	void *map;
+	int fd, i;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		if (missing_ok && errno == ENOENT)
+			return NULL;
+		fprintf(stderr, "Can't open index %s: %s\n", filename,
+				strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &statbuf) ||
+			(size_t)statbuf.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "Invalid index %s\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	index = talloc_zero(ctx, struct index);
+	index->map = map;
+	index->size = statbuf.st_size;
+	index->hdr = hdr = map;
+	talloc_set_destructor(index, index_destroy);
+
+	if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) ||
+			le32_to_cpu(hdr->version) != INDEX_VERSION)
+		goto err;
+
+	index->n_images = le32_to_cpu(hdr->n_images);
+	index->n_signers = le32_to_cpu(hdr->n_signers);
+
+	/* check that every column lies within the file */
+	for (i = 0; i < N_COLS; i++) {
+		off = le64_to_cpu(hdr->cols[i]);
+		size = i == COL_STRTAB ? le32_to_cpu(hdr->strtab_size) :
+			col_size(i, index->n_images, index->n_signers);
+		if (off % 8 || off > index->size || size > index->size - off)
+			goto err;
+	}
+
+	if (!index_check_contents(index))
+		goto err;
+
+	return index;
+
+err:
+	fprintf(stderr, "Invalid index %s\n", filename);
+	talloc_free(index);
+	return NULL;
+}
+
+/* writing */
+
+struct index_writer {
+	uint8_t		*buf;
+	size_t		size;
+	char		*strtab;
+	size_t		strtab_size;
+};
+
+static uint32_t add_string(struct index_writer *w, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	uint32_t off = w->strtab_size;
+
+	w->strtab = talloc_realloc(w, w->strtab, char, off + len);
+	memcpy(w->strtab + off, str, len);
+	w->strtab_size += len;
+
+	return off;
+}
+
+static int index_write(struct index_context *ctx, const char *filename)
+{
+	uint64_t *u64[COL_MTIME + 1], off;
+	uint32_t *u32[N_COLS], n_signers, s;
+	struct index_entry *entry;
+	struct index_header *hdr;
+	struct index_signer *sig;
+	struct index_writer *w;
+	uint8_t *digests, *fps;
+	unsigned int i, j;
+	char *tmpname;
+	int rc;
+
+	n_signers = 0;
+	for (i = 0; i < ctx->n_entries; i++)
+		n_signers += ctx->entries[i].n_signers;
+
+	w = talloc_zero(ctx, struct index_writer);
+
+	/* lay out the columns; the string table is appended once it's
+	 * complete */
+	off = (sizeof(*hdr) + 7) & ~7ull;
+	w->size = off;
+	for (i = 0; i < COL_STRTAB; i++)
+		w->size += (col_size(i, ctx->n_entries, n_signers) + 7) & ~7ull;
+
+	w->buf = talloc_zero_array(w, uint8_t, w->size);
+	hdr = (struct index_header *)w->buf;
+
+	for (i = 0; i < COL_STRTAB; i++) {
+		hdr->cols[i] = cpu_to_le64(off);
+		if (i <= COL_MTIME)
+			u64[i] = (uint64_t *)(w->buf + off);
+		else
+			u32[i] = (uint32_t *)(w->buf + off);
+		off += (col_size(i, ctx->n_entries, n_signers) + 7) & ~7ull;
+	}
+
+	digests = (uint8_t *)u32[COL_DIGEST];
+	fps = (uint8_t *)u32[COL_SIGNER_FP];
+
+	s = 0;
+	for (i = 0; i < ctx->n_entries; i++) {
+		entry = &ctx->entries[i];
+
+		u64[COL_DEV][i] = cpu_to_le64(entry->dev);
+		u64[COL_INO][i] = cpu_to_le64(entry->ino);
+		u64[COL_SIZE][i] = cpu_to_le64(entry->size);
+		u64[COL_MTIME][i] = cpu_to_le64(entry->mtime);
+		u32[COL_PATH][i] = cpu_to_le32(add_string(w, entry->path));
+		u32[COL_FLAGS][i] = cpu_to_le32(entry->flags);
+		u32[COL_NSIGS][i] = cpu_to_le32(entry->n_sigs);
+		u32[COL_SIGNER_START][i] = cpu_to_le32(s);
+		memcpy(digests + (size_t)i * SHA256_DIGEST_LENGTH,
+				entry->digest, SHA256_DIGEST_LENGTH);
+
+		for (j = 0; j < entry->n_signers; j++, s++) {
+			sig = &entry->signers[j];
+			u32[COL_SIGNER_SIGNUM][s] = cpu_to_le32(sig->signum);
+			u32[COL_SIGNER_ISSUER][s] =
+				cpu_to_le32(add_string(w, sig->issuer));
+			u32[COL_SIGNER_SERIAL][s] =
+				cpu_to_le32(add_string(w, sig->serial));
+			memcpy(fps + (size_t)s * SHA256_DIGEST_LENGTH,
+					sig->fingerprint,
+					SHA256_DIGEST_LENGTH);
+		}
+	}
+	u32[COL_SIGNER_START][i] = cpu_to_le32(s);
+
+	memcpy(hdr->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	hdr->version = cpu_to_le32(INDEX_VERSION);
+	hdr->n_images = cpu_to_le32(ctx->n_entries);
+	hdr->n_signers = cpu_to_le32(n_signers);
+	hdr->strtab_size = cpu_to_le32(w->strtab_size);
+	hdr->cols[COL_STRTAB] = cpu_to_le64(w->size);
+
+	/* replace the index atomically, as queries may have it mapped */
+	tmpname = talloc_asprintf(w, "%s.tmp", filename);
+	rc = fileio_write_file(tmpname, w->buf, w->size);
+	if (!rc) {
+		int fd = open(tmpname, O_WRONLY | O_APPEND);
+		rc = fd < 0 || !write_all(fd, w->strtab, w->strtab_size);
+		if (fd >= 0)
+			close(fd);
+	}
+	if (!rc && rename(tmpname, filename)) {
+		fprintf(stderr, "Can't rename %s: %s\n", tmpname,
+				strerror(errno));
+		rc = -1;
+	}
+	if (rc)
+		unlink(tmpname);
+
+	talloc_free(w);
+	return rc;
+}
+
+/* extraction */
+
+static char *serial_string(void *ctx, ASN1_INTEGER *serial)
+{
+	char *hex, *str;
+	BIGNUM *bn;
+
+	bn = ASN1_INTEGER_to_BN(serial, NULL);
+	if (!bn)
+		return talloc_strdup(ctx, "");
+
+	hex = BN_bn2hex(bn);
+	str = talloc_strdup(ctx, hex ? : "");
+	OPENSSL_free(hex);
+	BN_free(bn);
+
+	return str;
+}
+
+static void add_signers(struct index_entry *entry, PKCS7 *p7, int signum)
+{
+	char issuer_name[cert_name_len + 1];
+	PKCS7_ISSUER_AND_SERIAL *ias;
+	struct index_signer *sig;
+	PKCS7_SIGNER_INFO *si;
+	X509 *cert;
+	int i;
+
+	for (i = 0; i < sk_PKCS7_SIGNER_INFO_num(p7->d.sign->signer_info);
+			i++) {
+		si = sk_PKCS7_SIGNER_INFO_value(p7->d.sign->signer_info, i);
+		ias = si->issuer_and_serial;
+
+		entry->signers = talloc_realloc(NULL, entry->signers,
+				struct index_signer,
+				entry->n_signers + 1);
+		sig = &entry->signers[entry->n_signers++];
+		memset(sig, 0, sizeof(*sig));
+
+		sig->signum = signum;
+
+		X509_NAME_oneline(ias->issuer, issuer_name, cert_name_len);
+		sig->issuer = talloc_strdup(entry->signers, issuer_name);
+		sig->serial = serial_string(entry->signers, ias->serial);
+
+		/* the signer's certificate, if the signature carries it */
+		cert = X509_find_by_issuer_and_serial(p7->d.sign->cert,
+				ias->issuer, ias->serial);
+		if (cert)
+			X509_digest(cert, EVP_sha256(), sig->fingerprint,
+					NULL);
+	}
+}
+
+static bool is_pecoff(const char *filename)
+{
+	uint8_t magic[2];
+	bool rc;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	rc = read_all(fd, magic, sizeof(magic)) &&
+		magic[0] == 'M' && magic[1] == 'Z';
+	close(fd);
+
+	return rc;
+}
+
+static void extract_entry(struct index_entry *entry)
+{
+	const uint8_t *tmp;
+	struct image *image;
+	uint8_t *buf;
+	size_t len;
+	PKCS7 *p7;
+	int i;
+
+	/* skip non-PE files without image_load()'s diagnostics, as an
+	 * artifact tree will have plenty of them */
+	image = is_pecoff(entry->path) ? image_load(entry->path) : NULL;
+	if (!image || image_hash_sha256(image, entry->digest)) {
+		entry->flags |= IMAGE_INVALID;
+		talloc_free(image);
+		return;
+	}
+
+	for (i = 0; !image_get_signature(image, i, &buf, &len); i++) {
+		entry->n_sigs++;
+
+		tmp = buf;
+		p7 = d2i_PKCS7(NULL, &tmp, len);
+		if (!p7)
+			continue;
+
+		if (PKCS7_type_is_signed(p7))
+			add_signers(entry, p7, i);
+
+		PKCS7_free(p7);
+	}
+
+	ERR_clear_error();
+	talloc_free(image);
+}
+
+/*
+ * Extracted entries are passed back from the reader processes as
+ * records in a temporary file:
+ *
+ *   uint32_t index, flags, n_sigs, n_signers
+ *   uint8_t digest[32]
+ *   n_signers * { uint32_t signum; uint8_t fingerprint[32];
+ *                 uint32_t issuer_len; issuer; uint32_t serial_len; serial }
+ */
+static void write_record(FILE *fp, uint32_t i, struct index_entry *entry)
+{
+	struct index_signer *sig;
+	uint32_t hdr[4], len;
+	unsigned int j;
+
+	hdr[0] = i;
+	hdr[1] = entry->flags;
+	hdr[2] = entry->n_sigs;
+	hdr[3] = entry->n_signers;
+	fwrite(hdr, sizeof(hdr), 1, fp);
+	fwrite(entry->digest, sizeof(entry->digest), 1, fp);
+
+	for (j = 0; j < entry->n_signers; j++) {
+		sig = &entry->signers[j];
+		fwrite(&sig->signum, sizeof(sig->signum), 1, fp);
+		fwrite(sig->fingerprint, sizeof(sig->fingerprint), 1, fp);
+		len = strlen(sig->issuer);
+		fwrite(&len, sizeof(len), 1, fp);
+		fwrite(sig->issuer, len, 1, fp);
+		len = strlen(sig->serial);
+		fwrite(&len, sizeof(len), 1, fp);
+		fwrite(sig->serial, len, 1, fp);
+	}
+}
+
+static char *read_string(void *ctx, FILE *fp)
+{
+	uint32_t len;
+	char *str;
+
+	if (fread(&len, sizeof(len), 1, fp) != 1 || len > 65536)
+		return NULL;
+
+	str = talloc_array(ctx, char, len + 1);
+	if (len && fread(str, len, 1, fp) != 1)
+		return NULL;
+	str[len] = '\0';
+
+	return str;
+}
+
+static int read_records(struct index_context *ctx, FILE *fp)
+{
+	struct index_entry *entry;
+	struct index_signer *sig;
+	uint32_t hdr[4];
+	unsigned int j;
+
+	rewind(fp);
+
+	while (fread(hdr, sizeof(hdr), 1, fp) == 1) {
+		if (hdr[0] >= ctx->n_entries)
+			return -1;
+
+		entry = &ctx->entries[hdr[0]];
+		entry->flags = hdr[1];
+		entry->n_sigs = hdr[2];
+		entry->n_signers = hdr[3];
+		entry->stale = false;
+		entry->signers = talloc_zero_array(ctx->entries,
+				struct index_signer, entry->n_signers);
+
+		if (fread(entry->digest, sizeof(entry->digest), 1, fp) != 1)
+			return -1;
+
+		for (j = 0; j < entry->n_signers; j++) {
+			sig = &entry->signers[j];
+			if (fread(&sig->signum, sizeof(sig->signum), 1, fp) != 1 ||
+					fread(sig->fingerprint,
+						sizeof(sig->fingerprint),
+						1, fp) != 1)
+				return -1;
+			sig->issuer = read_string(entry->signers, fp);
+			sig->serial = read_string(entry->signers, fp);
+			if (!sig->issuer || !sig->serial)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int extract_entry_item(void *arg, unsigned int i)
+{
+	struct index_context *ctx = arg;
+
+	if (!ctx->entries[i].stale)
+		return 0;
+
+	extract_entry(&ctx->entries[i]);
+	write_record(stdout, i, &ctx->entries[i]);
+	return 0;
+}
+
+/* read the stale entries using n_jobs processes, which pass the results
+ * back as records on their output */
+static int extract_entries(struct index_context *ctx, unsigned int n_jobs)
+{
+	struct workpool *pool;
+	unsigned int i;
+	FILE *records;
+	int rc;
+
+	records = tmpfile();
+	if (!records) {
+		perror("tmpfile");
+		return -1;
+	}
+
+	pool = workpool_run(ctx, ctx->n_entries, n_jobs, extract_entry_item,
+			ctx);
+	rc = pool ? 0 : -1;
+
+	for (i = 0; pool && i < ctx->n_entries; i++) {
+		if (workpool_status(pool, i) == WORKPOOL_NOT_RUN) {
+			rc = -1;
+			break;
+		}
+		workpool_copy_output(pool, i, records);
+	}
+
+	if (!rc && (fflush(records) || read_records(ctx, records))) {
+		fprintf(stderr, "Invalid results from reader\n");
+		rc = -1;
+	}
+
+	talloc_free(pool);
+	fclose(records);
+
+	return rc;
+}
+
+/* incremental updates */
+
+static int old_cmp(const void *a, const void *b, void *arg)
+{
+	struct index *old = arg;
+	uint32_t i = *(const uint32_t *)a, j = *(const uint32_t *)b;
+	uint64_t x, y;
+
+	x = index_u64(old, COL_DEV, i);
+	y = index_u64(old, COL_DEV, j);
+	if (x == y) {
+		x = index_u64(old, COL_INO, i);
+		y = index_u64(old, COL_INO, j);
+	}
+
+	return x < y ? -1 : x > y;
+}
+
+static void sort_old_entries(struct index_context *ctx)
+{
+	uint32_t i;
+
+	ctx->old_sorted = talloc_array(ctx, uint32_t, ctx->old->n_images);
+	for (i = 0; i < ctx->old->n_images; i++)
+		ctx->old_sorted[i] = i;
+
+	qsort_r(ctx->old_sorted, ctx->old->n_images, sizeof(uint32_t),
+			old_cmp, ctx->old);
+}
+
+/* find the previous entry for this file: same device and inode, and
+ * unchanged size and modification time */
+static int find_old_entry(struct index_context *ctx,
+		struct index_entry *entry)
+{
+	struct index *old = ctx->old;
+	uint32_t lo, hi, mid, i;
+	uint64_t dev, ino;
+
+	if (!old)
+		return -1;
+
+	lo = 0;
+	hi = old->n_images;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		i = ctx->old_sorted[mid];
+		dev = index_u64(old, COL_DEV, i);
+		ino = index_u64(old, COL_INO, i);
+
+		if (dev < entry->dev ||
+				(dev == entry->dev && ino < entry->ino))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == old->n_images)
+		return -1;
+
+	i = ctx->old_sorted[lo];
+	if (index_u64(old, COL_DEV, i) != entry->dev ||
+			index_u64(old, COL_INO, i) != entry->ino ||
+			index_u64(old, COL_SIZE, i) != entry->size ||
+			index_u64(old, COL_MTIME, i) != entry->mtime)
+		return -1;
+
+	return i;
+}
+
+static void copy_old_entry(struct index_context *ctx,
+		struct index_entry *entry, uint32_t i)
+{
+	struct index *old = ctx->old;
+	struct index_signer *sig;
+	uint32_t start, s;
+
+	entry->flags = index_u32(old, COL_FLAGS, i);
+	entry->n_sigs = index_u32(old, COL_NSIGS, i);
+	memcpy(entry->digest, index_digest(old, COL_DIGEST, i),
+			SHA256_DIGEST_LENGTH);
+
+	start = index_u32(old, COL_SIGNER_START, i);
+	entry->n_signers = index_u32(old, COL_SIGNER_START, i + 1) - start;
+	entry->signers = talloc_array(ctx->entries, struct index_signer,
+			entry->n_signers);
+
+	for (s = 0; s < entry->n_signers; s++) {
+		sig = &entry->signers[s];
+		sig->signum = index_u32(old, COL_SIGNER_SIGNUM, start + s);
+		sig->issuer = index_str(old, COL_SIGNER_ISSUER, start + s);
+		sig->serial = index_str(old, COL_SIGNER_SERIAL, start + s);
+		memcpy(sig->fingerprint,
+				index_digest(old, COL_SIGNER_FP, start + s),
+				SHA256_DIGEST_LENGTH);
+	}
+}
+
+/* nftw() doesn't take a context pointer */
+static struct index_context *walk_ctx;
+
+static int add_file(const char *path, const struct stat *statbuf,
+		int type, struct FTW *ftw)
+{
+	struct index_context *ctx = walk_ctx;
+	struct index_entry *entry;
+	char *abspath;
+
+	(void)ftw;
+
+	if (type != FTW_F || !S_ISREG(statbuf->st_mode))
+		return 0;
+
+	abspath = realpath(path, NULL);
+	if (!abspath)
+		return 0;
+
+	ctx->entries = talloc_realloc(ctx, ctx->entries, struct index_entry,
+			ctx->n_entries + 1);
+	entry = &ctx->entries[ctx->n_entries++];
+	memset(entry, 0, sizeof(*entry));
+
+	entry->path = talloc_strdup(ctx->entries, abspath);
+	free(abspath);
+	entry->dev = statbuf->st_dev;
+	entry->ino = statbuf->st_ino;
+	entry->size = statbuf->st_size;
+	entry->mtime = (uint64_t)statbuf->st_mtim.tv_sec * 1000000000ull +
+		statbuf->st_mtim.tv_nsec;
+	entry->stale = true;
+
+	return 0;
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+	const struct index_entry *x = a, *y = b;
+	return strcmp(x->path, y->path);
+}
+
+static int update_index(struct index_context *ctx, const char *filename,
+		char **paths, int n_paths, unsigned int n_jobs)
+{
+	unsigned int i, n_stale, n_kept;
+	int old_i, rc;
+
+	ctx->old = index_open(ctx, filename, true);
+	if (ctx->old)
+		sort_old_entries(ctx);
+
+	walk_ctx = ctx;
+	for (i = 0; i < (unsigned int)n_paths; i++) {
+		if (nftw(paths[i], add_file, 16, FTW_PHYS)) {
+			fprintf(stderr, "Can't read %s: %s\n", paths[i],
+					strerror(errno));
+			return -1;
+		}
+	}
+
+	/* keep the index in path order, and drop duplicates from
+	 * overlapping paths */
+	qsort(ctx->entries, ctx->n_entries, sizeof(*ctx->entries), path_cmp);
+	for (i = n_kept = 0; i < ctx->n_entries; i++) {
+		if (n_kept && !strcmp(ctx->entries[n_kept - 1].path,
+					ctx->entries[i].path))
+			continue;
+		ctx->entries[n_kept++] = ctx->entries[i];
+	}
+	ctx->n_entries = n_kept;
+
+	n_stale = 0;
+	for (i = 0; i < ctx->n_entries; i++) {
+		old_i = find_old_entry(ctx, &ctx->entries[i]);
+		if (old_i >= 0) {
+			copy_old_entry(ctx, &ctx->entries[i], old_i);
+			ctx->entries[i].stale = false;
+		} else
+			n_stale++;
+	}
+
+	if (n_jobs > n_stale)
+		n_jobs = n_stale;
+
+	rc = 0;
+	if (n_stale)
+		rc = extract_entries(ctx, n_jobs);
+
+	if (!rc)
+		rc = index_write(ctx, filename);
+
+	if (!rc && ctx->verbose)
+		fprintf(stderr, "Indexed %d files, %d read, %d unchanged\n",
+				ctx->n_entries, n_stale,
+				ctx->n_entries - n_stale);
+
+	return rc;
+}
+
+/* queries */
+
+/* A certificate to match signers against. Signers whose signature
+ * carried their certificate are matched on its fingerprint; others only
+ * on their issuer and serial. */
+struct query_cert {
+	uint8_t		fingerprint[SHA256_DIGEST_LENGTH];
+	const char	*issuer;
+	const char	*serial;
+};
+
+struct query {
+	bool			have_signed_by;
+	struct query_cert	signed_by;
+	bool			have_not_signed_by;
+	struct query_cert	not_signed_by;
+	bool		unsigned_only;
+	bool		have_digest;
+	uint8_t		digest[SHA256_DIGEST_LENGTH];
+	bool		list;
+};
+
+static int load_query_cert(void *ctx, const char *filename,
+		struct query_cert *qc)
+{
+	char issuer_name[cert_name_len + 1];
+	X509 *cert;
+	int rc;
+
+	cert = fileio_read_cert(filename);
+	if (!cert)
+		return -1;
+
+	rc = X509_digest(cert, EVP_sha256(), qc->fingerprint, NULL) ? 0 : -1;
+
+	X509_NAME_oneline(X509_get_issuer_name(cert), issuer_name,
+			cert_name_len);
+	qc->issuer = talloc_strdup(ctx, issuer_name);
+	qc->serial = serial_string(ctx, X509_get_serialNumber(cert));
+
+	X509_free(cert);
+	return rc;
+}
+
+static int parse_digest(const char *str, uint8_t *digest)
+{
+	unsigned int i;
+
+	if (strlen(str) != SHA256_DIGEST_LENGTH * 2)
+		return -1;
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		if (sscanf(str + i * 2, "%2hhx", &digest[i]) != 1)
+			return -1;
+
+	return 0;
+}
+
+/* signers whose certificate wasn't in the signature have no fingerprint */
+static bool has_fingerprint(const uint8_t *fp)
+{
+	unsigned int i;
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		if (fp[i])
+			return true;
+
+	return false;
+}
+
+static bool image_has_signer(struct index *index, uint32_t i,
+		const struct query_cert *qc)
+{
+	const uint8_t *fp;
+	uint32_t s, end;
+
+	end = index_u32(index, COL_SIGNER_START, i + 1);
+	for (s = index_u32(index, COL_SIGNER_START, i); s < end; s++) {
+		fp = index_digest(index, COL_SIGNER_FP, s);
+
+		if (has_fingerprint(fp)) {
+			if (!memcmp(fp, qc->fingerprint,
+						SHA256_DIGEST_LENGTH))
+				return true;
+
+		} else if (!strcmp(index_str(index, COL_SIGNER_ISSUER, s),
+					qc->issuer) &&
+				!strcmp(index_str(index, COL_SIGNER_SERIAL, s),
+					qc->serial))
+			return true;
+	}
+
+	return false;
+}
+
+static void print_digest(const uint8_t *digest)
+{
+	unsigned int i;
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		printf("%02x", digest[i]);
+}
+
+static void print_entry(struct index *index, uint32_t i)
+{
+	uint32_t s, end;
+
+	printf("%s\n", index_str(index, COL_PATH, i));
+
+	if (index_u32(index, COL_FLAGS, i) & IMAGE_INVALID) {
+		printf(" not a PE/COFF image\n");
+		return;
+	}
+
+	printf(" digest: ");
+	print_digest(index_digest(index, COL_DIGEST, i));
+	printf("\n signatures: %d\n", index_u32(index, COL_NSIGS, i));
+
+	end = index_u32(index, COL_SIGNER_START, i + 1);
+	for (s = index_u32(index, COL_SIGNER_START, i); s < end; s++) {
+		printf(" - signature %d\n",
+				index_u32(index, COL_SIGNER_SIGNUM, s) + 1);
+		printf("   issuer:      %s\n",
+				index_str(index, COL_SIGNER_ISSUER, s));
+		printf("   serial:      %s\n",
+				index_str(index, COL_SIGNER_SERIAL, s));
+		printf("   fingerprint: ");
+		if (has_fingerprint(index_digest(index, COL_SIGNER_FP, s)))
+			print_digest(index_digest(index, COL_SIGNER_FP, s));
+		else
+			printf("(certificate not in signature)");
+		printf("\n");
+	}
+}
+
+static int query_index(void *ctx, const char *filename, struct query *query)
+{
+	struct index *index;
+	uint32_t i, flags;
+
+	index = index_open(ctx, filename, false);
+	if (!index)
+		return -1;
+
+	for (i = 0; i < index->n_images; i++) {
+		flags = index_u32(index, COL_FLAGS, i);
+
+		if (flags & IMAGE_INVALID)
+			continue;
+
+		if (query->unsigned_only && index_u32(index, COL_NSIGS, i))
+			continue;
+
+		if (query->have_digest &&
+				memcmp(index_digest(index, COL_DIGEST, i),
+					query->digest, SHA256_DIGEST_LENGTH))
+			continue;
+
+		if (query->have_signed_by &&
+				!image_has_signer(index, i, &query->signed_by))
+			continue;
+
+		if (query->have_not_signed_by &&
+				image_has_signer(index, i,
+					&query->not_signed_by))
+			continue;
+
+		if (query->list)
+			print_entry(index, i);
+		else
+			printf("%s\n", index_str(index, COL_PATH, i));
+	}
+
+	talloc_free(index);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct index_context *ctx;
+	struct query query;
+	bool update;
+	int c, rc, n_jobs;
+
+	ctx = talloc_zero(NULL, struct index_context);
+	memset(&query, 0, sizeof(query));
+	n_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	update = false;
+
+	for (;;) {
+		int idx;
+		c = getopt_long(argc, argv, "uj:s:n:Ud:lvhV", options, &idx);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'u':
+			update = true;
+			break;
+		case 'j':
+			n_jobs = workpool_parse_jobs(optarg);
+			if (n_jobs < 1) {
+				fprintf(stderr, "Invalid number of jobs: %s\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			if (load_query_cert(ctx, optarg, &query.signed_by))
+				return EXIT_FAILURE;
+			query.have_signed_by = true;
+			break;
+		case 'n':
+			if (load_query_cert(ctx, optarg,
+						&query.not_signed_by))
+				return EXIT_FAILURE;
+			query.have_not_signed_by = true;
+			break;
+		case 'U':
+			query.unsigned_only = true;
+			break;
+		case 'd':
+			if (parse_digest(optarg, query.digest)) {
+				fprintf(stderr, "Invalid digest %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			query.have_digest = true;
+			break;
+		case 'l':
+			query.list = true;
+			break;
+		case 'v':
+			ctx->verbose = 1;
+			break;
+		case 'V':
+			version();
+			return EXIT_SUCCESS;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		}
+	}
+
+	if (update ? argc < optind + 2 : argc != optind + 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	/* sysconf() may fail */
+	if (n_jobs < 1)
+		n_jobs = 1;
+
+	ERR_load_crypto_strings();
+	OpenSSL_add_all_digests();
+	OPENSSL_config(NULL);
+	/* here we may get highly unlikely failures or we'll get a
+	 * complaint about FIPS signatures (usually becuase the FIPS
+	 * module isn't present).  In either case ignore the errors
+	 * (malloc will cause other failures out lower down */
+	ERR_clear_error();
+
+	if (update)
+		rc = update_index(ctx, argv[optind], argv + optind + 1,
+				argc - optind - 1, n_jobs);
+	else
+		rc = query_index(ctx, argv[optind], &query);
+
+	talloc_free(ctx);
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -53,6 +53,8 @@
 
 #include "fileio.h"
 #include "efivars.h"
+#include "varstore.h"
+#include "workpool.h"
 
 #define EFIVARS_MOUNTPOINT	"/sys/firmware/efi/efivars"
 #define PSTORE_FSTYPE		0x6165676C
@@ -143,6 +145,7 @@ struct fs_keystore {
 
 struct sync_context {
 	const char		*efivars_dir;
+	struct varstore		*varstore;
 	struct keyset		*filesystem_keys;
 	struct keyset		*firmware_keys;
 	struct fs_keystore	*fs_keystore;
@@ -167,25 +170,59 @@ static void guid_to_str(const EFI_GUID *guid, char *str)
 			guid->Data4[6], guid->Data4[7]);
 }
 
-static int sha256_key_parse(struct key *key, uint8_t *data, size_t len)
+/* Parse a hash-based key: the hash (of id_size bytes) is used as the key
+ * ID, followed by extra_size bytes of data that don't form part of the ID */
+static int hash_key_parse(struct key *key, uint8_t *data, size_t len,
+		unsigned int id_size, unsigned int extra_size)
 {
-	const unsigned int sha256_id_size = 256 / 8;
 	unsigned int i;
 
-	if (len != sha256_id_size)
+	if (len != id_size + extra_size)
 		return -1;
 
-	key->id = talloc_memdup(key, data, sha256_id_size);
-	key->id_len = sha256_id_size;
+	key->id = talloc_memdup(key, data, id_size);
+	key->id_len = id_size;
 
-	key->description = talloc_array(key, char, len * 2 + 1);
-	for (i = 0; i < len; i++)
+	key->description = talloc_array(key, char, id_size * 2 + 1);
+	for (i = 0; i < id_size; i++)
 		snprintf(&key->description[i*2], 3, "%02x", data[i]);
-	key->description[len*2] = '\0';
+	key->description[id_size*2] = '\0';
 
 	return 0;
 }
 
+static int sha256_key_parse(struct key *key, uint8_t *data, size_t len)
+{
+	return hash_key_parse(key, data, len, 256 / 8, 0);
+}
+
+static int sha384_key_parse(struct key *key, uint8_t *data, size_t len)
+{
+	return hash_key_parse(key, data, len, 384 / 8, 0);
+}
+
+static int sha512_key_parse(struct key *key, uint8_t *data, size_t len)
+{
+	return hash_key_parse(key, data, len, 512 / 8, 0);
+}
+
+/* EFI_CERT_X509_SHA* entries are the TBSCertificate hash, followed by the
+ * time of revocation */
+static int x509_sha256_key_parse(struct key *key, uint8_t *data, size_t len)
+{
+	return hash_key_parse(key, data, len, 256 / 8, sizeof(EFI_TIME));
+}
+
+static int x509_sha384_key_parse(struct key *key, uint8_t *data, size_t len)
+{
+	return hash_key_parse(key, data, len, 384 / 8, sizeof(EFI_TIME));
+}
+
+static int x509_sha512_key_parse(struct key *key, uint8_t *data, size_t len)
+{
+	return hash_key_parse(key, data, len, 512 / 8, sizeof(EFI_TIME));
+}
+
 static int x509_key_parse(struct key *key, uint8_t *data, size_t len)
 {
 	const int description_len = 160;
@@ -223,7 +260,12 @@ out:
 
 struct cert_type cert_types[] = {
 	{ EFI_CERT_SHA256_GUID, sha256_key_parse },
+	{ EFI_CERT_SHA384_GUID, sha384_key_parse },
+	{ EFI_CERT_SHA512_GUID, sha512_key_parse },
 	{ EFI_CERT_X509_GUID, x509_key_parse },
+	{ EFI_CERT_X509_SHA256_GUID, x509_sha256_key_parse },
+	{ EFI_CERT_X509_SHA384_GUID, x509_sha384_key_parse },
+	{ EFI_CERT_X509_SHA512_GUID, x509_sha512_key_parse },
 };
 
 static int guidcmp(const EFI_GUID *a, const EFI_GUID *b)
@@ -359,6 +401,14 @@ static int read_firmware_keydb(struct sync_context *ctx,
 	add_ctx.kdb = kdb;
 	add_ctx.ke = NULL;
 
+	if (ctx->varstore) {
+		rc = varstore_get_variable(ctx->varstore, ctx->firmware_keys,
+				kdb->type->name, &kdb->type->guid, &buf, &len);
+		if (!rc)
+			sigdb_iterate(buf, len, keydb_add_key, &add_ctx);
+		return rc;
+	}
+
 	guid_to_str(&kdb->type->guid, guid_str);
 
 	filename = talloc_asprintf(ctx->firmware_keys, "%s/%s-%s",
@@ -403,11 +453,54 @@ static void __attribute__((format(printf, 2, 3))) print_keystore_key_error(
 	va_end(ap);
 }
 
-static int read_filesystem_keydb(struct sync_context *ctx,
-		struct key_database *kdb)
+/**
+ * Finds the EFI_SIGNATURE_LIST data in a keystore entry, following its
+ * EFI_VARIABLE_AUTHENTICATION_2 descriptor.
+ */
+static int keystore_entry_sigdb(struct fs_keystore_entry *ke,
+		void **bufp, unsigned int *lenp)
 {
 	EFI_GUID cert_type_pkcs7 = EFI_CERT_TYPE_PKCS7_GUID;
 	EFI_VARIABLE_AUTHENTICATION_2 *auth;
+	unsigned int len;
+	void *buf;
+
+	buf = ke->data;
+	len = ke->len;
+
+	if (len < sizeof(*auth)) {
+		print_keystore_key_error(ke, "does not contain an "
+			"EFI_VARIABLE_AUTHENTICATION_2 descriptor");
+		return -1;
+	}
+
+	auth = buf;
+
+	if (guidcmp(&auth->AuthInfo.CertType, &cert_type_pkcs7)) {
+		print_keystore_key_error(ke, "unknown cert type");
+		return -1;
+	}
+
+	if (auth->AuthInfo.Hdr.dwLength > len - sizeof(auth->TimeStamp)) {
+		print_keystore_key_error(ke,
+				"invalid WIN_CERTIFICATE length");
+		return -1;
+	}
+
+	/* the dwLength field includes the size of the WIN_CERTIFICATE,
+	 * but not the other data in the EFI_VARIABLE_AUTHENTICATION_2
+	 * descriptor */
+	*bufp = buf + sizeof(*auth) - sizeof(auth->AuthInfo) +
+		auth->AuthInfo.Hdr.dwLength;
+	*lenp = len - (sizeof(*auth) - sizeof(auth->AuthInfo) +
+		auth->AuthInfo.Hdr.dwLength);
+
+	return 0;
+}
+
+static int read_filesystem_keydb(struct sync_context *ctx,
+		struct key_database *kdb)
+{
 	struct keydb_add_ctx add_ctx;
 	struct fs_keystore_entry *ke;
 	int rc;
@@ -431,36 +524,8 @@ static int read_filesystem_keydb(struct sync_context *ctx,
 		 *  EFI_SIGNATURE_DATA
 		 * ensuring that we have enough data for each
 		 */
-
-		buf = ke->data;
-		len = ke->len;
-
-		if (len < sizeof(*auth)) {
-			print_keystore_key_error(ke, "does not contain an "
-				"EFI_VARIABLE_AUTHENTICATION_2 descriptor");
+		if (keystore_entry_sigdb(ke, &buf, &len))
 			continue;
-		}
-
-		auth = buf;
-
-		if (guidcmp(&auth->AuthInfo.CertType, &cert_type_pkcs7)) {
-			print_keystore_key_error(ke, "unknown cert type");
-			continue;
-		}
-
-		if (auth->AuthInfo.Hdr.dwLength > len) {
-			print_keystore_key_error(ke,
-					"invalid WIN_CERTIFICATE length");
-			continue;
-		}
-
-		/* the dwLength field includes the size of the WIN_CERTIFICATE,
-		 * but not the other data in the EFI_VARIABLE_AUTHENTICATION_2
-		 * descriptor */
-		buf += sizeof(*auth) - sizeof(auth->AuthInfo) +
-			auth->AuthInfo.Hdr.dwLength;
-		len -= sizeof(*auth) - sizeof(auth->AuthInfo) +
-			auth->AuthInfo.Hdr.dwLength;
 
 		add_ctx.ke = ke;
 		rc = sigdb_iterate(buf, len, keydb_add_key, &add_ctx);
@@ -475,13 +540,18 @@ static int read_filesystem_keydb(struct sync_context *ctx,
 	return 0;
 }
 
-static int read_keysets(struct sync_context *ctx)
+static int read_firmware_keysets(struct sync_context *ctx)
 {
 	read_firmware_keydb(ctx, &ctx->firmware_keys->pk);
 	read_firmware_keydb(ctx, &ctx->firmware_keys->kek);
 	read_firmware_keydb(ctx, &ctx->firmware_keys->db);
 	read_firmware_keydb(ctx, &ctx->firmware_keys->dbx);
 
+	return 0;
+}
+
+static int read_filesystem_keysets(struct sync_context *ctx)
+{
 	read_filesystem_keydb(ctx, &ctx->filesystem_keys->pk);
 	read_filesystem_keydb(ctx, &ctx->filesystem_keys->kek);
 	read_filesystem_keydb(ctx, &ctx->filesystem_keys->db);
@@ -713,6 +783,39 @@ static void print_new_keys(struct sync_context *ctx)
 		printf(" %s/%s\n", ke->root, ke->name);
 }
 
+/**
+ * Without firmware to process the update, we write the variable contents
+ * directly: the EFI_SIGNATURE_LISTs, and the timestamp from the
+ * authentication descriptor. The descriptor's signature isn't checked.
+ */
+static int insert_key_varstore(struct sync_context *ctx,
+		struct fs_keystore_entry *ke)
+{
+	EFI_VARIABLE_AUTHENTICATION_2 *auth;
+	uint32_t attrs;
+	unsigned int len;
+	void *buf;
+	int rc;
+
+	if (keystore_entry_sigdb(ke, &buf, &len))
+		return -1;
+
+	auth = (EFI_VARIABLE_AUTHENTICATION_2 *)ke->data;
+
+	/* a new PK replaces the old one, rather than adding to it */
+	attrs = sigdb_attrs;
+	if (ke->type == &keydb_types[KEYDB_PK])
+		attrs &= ~EFI_VARIABLE_APPEND_WRITE;
+
+	rc = varstore_set_variable(ctx->varstore, ke->type->name,
+			&ke->type->guid, attrs, &auth->TimeStamp, buf, len);
+	if (rc)
+		fprintf(stderr, "Error syncing keystore file %s/%s\n",
+				ke->root, ke->name);
+
+	return rc;
+}
+
 static int insert_key(struct sync_context *ctx, struct fs_keystore_entry *ke)
 {
 	char guid_str[GUID_STRLEN];
@@ -728,6 +831,9 @@ static int insert_key(struct sync_context *ctx, struct fs_keystore_entry *ke)
 		printf("Inserting key update %s/%s into %s\n",
 				ke->root, ke->name, ke->type->name);
 
+	if (ctx->varstore)
+		return insert_key_varstore(ctx, ke);
+
 	/* we create a contiguous buffer of attributes & key data, so that
 	 * we write to the efivars file in a single syscall */
 	buf_len = sizeof(sigdb_attrs) + ke->len;
@@ -833,6 +939,146 @@ static struct keyset *init_keyset(struct sync_context *ctx)
 	return keyset;
 }
 
+static int sync_keys(struct sync_context *ctx)
+{
+	read_firmware_keysets(ctx);
+	if (ctx->verbose) {
+		print_keyset(ctx->firmware_keys, "firmware");
+		print_keyset(ctx->filesystem_keys, "filesystem");
+	}
+
+	find_new_keys(ctx);
+
+	if (ctx->verbose)
+		print_new_keys(ctx);
+
+	if (ctx->dry_run)
+		return 0;
+
+	return insert_new_keys(ctx);
+}
+
+/* update a single variable store file; the store is only written if all
+ * of the new keys could be added */
+static int sync_varstore(struct sync_context *ctx, const char *filename)
+{
+	int rc;
+
+	ctx->varstore = varstore_open(ctx, filename);
+	if (!ctx->varstore)
+		return -1;
+
+	ctx->firmware_keys = init_keyset(ctx);
+	list_head_init(&ctx->new_keys);
+
+	if (ctx->verbose)
+		printf("Variable store %s:\n", filename);
+
+	rc = sync_keys(ctx);
+	if (!rc && !ctx->dry_run)
+		rc = varstore_write(ctx->varstore);
+
+	talloc_free(ctx->firmware_keys);
+	talloc_free(ctx->varstore);
+	ctx->firmware_keys = NULL;
+	ctx->varstore = NULL;
+
+	return rc;
+}
+
+struct varstore_args {
+	struct sync_context	*ctx;
+	char			**filenames;
+};
+
+static int sync_varstore_item(void *arg, unsigned int i)
+{
+	struct varstore_args *args = arg;
+
+	return sync_varstore(args->ctx, args->filenames[i]);
+}
+
+/*
+ * Update variable stores using n_jobs processes, all sharing the keystore
+ * we've already read. As with sbverify --disk-image, the output for each
+ * store is printed in argument order.
+ */
+static int sync_varstores(struct sync_context *ctx, char **filenames,
+		int n_stores, int n_jobs)
+{
+	struct varstore_args args = { ctx, filenames };
+	struct workpool *pool = NULL;
+	int i, rc, result;
+
+	if (n_jobs > 1 && n_stores > 1) {
+		pool = workpool_run(ctx, n_stores, n_jobs,
+				sync_varstore_item, &args);
+		if (!pool)
+			return -1;
+	}
+
+	rc = 0;
+
+	for (i = 0; i < n_stores; i++) {
+		if (pool) {
+			workpool_copy_output(pool, i, stdout);
+			result = workpool_status(pool, i);
+		} else
+			result = sync_varstore(ctx, filenames[i]);
+
+		if (result) {
+			fprintf(stderr, "Error updating variable store %s\n",
+					filenames[i]);
+			rc = -1;
+		}
+	}
+
+	talloc_free(pool);
+	return rc;
+}
+
+/*
+ * Reject a variable store given more than once, under any name: with
+ * --jobs, two processes would update it at the same time, and even
+ * without, the second update would be based on a stale read. Stores that
+ * can't be accessed are left for sync_varstore() to report.
+ */
+static int check_duplicate_varstores(void *ctx, char **filenames,
+		int n_stores)
+{
+	struct stat *st;
+	bool *valid, same;
+	int i, j, rc;
+
+	st = talloc_array(ctx, struct stat, n_stores);
+	valid = talloc_array(ctx, bool, n_stores);
+	rc = 0;
+
+	for (i = 0; i < n_stores; i++) {
+		valid[i] = !stat(filenames[i], &st[i]);
+
+		for (j = 0; j < i; j++) {
+			if (valid[i] && valid[j])
+				same = st[i].st_dev == st[j].st_dev &&
+					st[i].st_ino == st[j].st_ino;
+			else
+				same = !strcmp(filenames[i], filenames[j]);
+
+			if (same) {
+				fprintf(stderr, "Variable store %s is the "
+						"same as %s\n", filenames[i],
+						filenames[j]);
+				rc = -1;
+				break;
+			}
+		}
+	}
+
+	talloc_free(valid);
+	talloc_free(st);
+	return rc;
+}
+
 static struct option options[] = {
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
@@ -842,6 +1088,8 @@ static struct option options[] = {
 	{ "pk", no_argument, NULL, 'p' },
 	{ "no-default-keystores", no_argument, NULL, 'd' },
 	{ "keystore", required_argument, NULL, 'k' },
+	{ "varstore", required_argument, NULL, 's' },
+	{ "jobs", required_argument, NULL, 'j' },
 	{ NULL, 0, NULL, 0 },
 };
 
@@ -861,7 +1109,13 @@ static void usage(void)
 		"\t                       first dir takes precedence)\n"
 		"\t--no-default-keystores\n"
 		"\t                      Don't read keys from the default\n"
-		"\t                       keystore dirs\n",
+		"\t                       keystore dirs\n"
+		"\t--varstore <file>     Update the edk2 variable store file\n"
+		"\t                       <file> (eg. OVMF_VARS.fd), rather\n"
+		"\t                       than firmware (can be specified\n"
+		"\t                       multiple times)\n"
+		"\t--jobs <n>            Update up to <n> variable stores\n"
+		"\t                       in parallel\n",
 		toolname);
 }
 
@@ -883,14 +1137,19 @@ int main(int argc, char **argv)
 {
 	bool use_default_keystore_dirs;
 	struct sync_context *ctx;
+	char **varstores;
+	int n_varstores, n_jobs, rc;
 
 	use_default_keystore_dirs = true;
+	varstores = NULL;
+	n_varstores = 0;
+	n_jobs = 1;
 	ctx = talloc_zero(NULL, struct sync_context);
 	list_head_init(&ctx->new_keys);
 
 	for (;;) {
 		int idx, c;
-		c = getopt_long(argc, argv, "e:dpkvhV", options, &idx);
+		c = getopt_long(argc, argv, "e:dpkvs:j:hV", options, &idx);
 		if (c == -1)
 			break;
 
@@ -913,6 +1172,19 @@ int main(int argc, char **argv)
 		case 'n':
 			ctx->dry_run = true;
 			break;
+		case 's':
+			varstores = talloc_realloc(ctx, varstores, char *,
+					n_varstores + 1);
+			varstores[n_varstores++] = optarg;
+			break;
+		case 'j':
+			n_jobs = workpool_parse_jobs(optarg);
+			if (n_jobs < 1) {
+				fprintf(stderr, "Invalid number of jobs: %s\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'V':
 			version();
 			return EXIT_SUCCESS;
@@ -940,7 +1212,16 @@ int main(int argc, char **argv)
 	ctx->filesystem_keys = init_keyset(ctx);
 	ctx->firmware_keys = init_keyset(ctx);
 
-	if (!ctx->efivars_dir) {
+	if (n_varstores && ctx->efivars_dir) {
+		fprintf(stderr, "--efivars-path and --varstore can't be "
+				"used together\n");
+		return EXIT_FAILURE;
+	}
+
+	if (check_duplicate_varstores(ctx, varstores, n_varstores))
+		return EXIT_FAILURE;
+
+	if (!ctx->efivars_dir && !n_varstores) {
 		ctx->efivars_dir = EFIVARS_MOUNTPOINT;
 		if (check_efivars_mount(ctx->efivars_dir)) {
 			fprintf(stderr, "Can't access efivars filesystem "
@@ -961,24 +1242,21 @@ int main(int argc, char **argv)
 	if (ctx->verbose)
 		print_keystore(ctx->fs_keystore);
 
-	read_keysets(ctx);
-	if (ctx->verbose) {
-		print_keyset(ctx->firmware_keys, "firmware");
-		print_keyset(ctx->filesystem_keys, "filesystem");
-	}
+	read_filesystem_keysets(ctx);
 
 	if (check_pk(ctx))
 		fprintf(stderr, "WARNING: multiple PKs found in filesystem\n");
 
-	find_new_keys(ctx);
-
-	if (ctx->verbose)
-		print_new_keys(ctx);
+	rc = EXIT_SUCCESS;
 
-	if (!ctx->dry_run)
-		insert_new_keys(ctx);
+	if (n_varstores) {
+		if (sync_varstores(ctx, varstores, n_varstores, n_jobs))
+			rc = EXIT_FAILURE;
+	} else {
+		sync_keys(ctx);
+	}
 
 	talloc_free(ctx);
 
-	return EXIT_SUCCESS;
+	return rc;
 }
@@ -56,6 +56,7 @@
 
 #include "efivars.h"
 #include "fileio.h"
+#include "siglist.h"
 
 static const char *toolname = "sbsiglist";
 
@@ -73,11 +74,22 @@ struct cert_type {
 	const char	*name;
 	const EFI_GUID	guid;
 	unsigned int	sigsize;
+	/* for certificate-hash types, the input is a DER-encoded certificate,
+	 * to be hashed with this digest */
+	int		cert_hash_nid;
 };
 
 struct cert_type cert_types[] = {
-	{ "x509",   EFI_CERT_X509_GUID,   0 },
-	{ "sha256", EFI_CERT_SHA256_GUID, 32 },
+	{ "x509",        EFI_CERT_X509_GUID,        0,  NID_undef },
+	{ "sha256",      EFI_CERT_SHA256_GUID,      32, NID_undef },
+	{ "sha384",      EFI_CERT_SHA384_GUID,      48, NID_undef },
+	{ "sha512",      EFI_CERT_SHA512_GUID,      64, NID_undef },
+	{ "x509-sha256", EFI_CERT_X509_SHA256_GUID,
+				32 + sizeof(EFI_TIME), NID_sha256 },
+	{ "x509-sha384", EFI_CERT_X509_SHA384_GUID,
+				48 + sizeof(EFI_TIME), NID_sha384 },
+	{ "x509-sha512", EFI_CERT_X509_SHA512_GUID,
+				64 + sizeof(EFI_TIME), NID_sha512 },
 };
 
 struct siglist_context {
@@ -110,7 +122,10 @@ void usage(void)
 		printf("\t                     %s\n", cert_types[i].name);
 
 	printf("\t--output <file>  write signed data to <file>\n"
-		"\t                  (default <sig-file>.siglist)\n");
+		"\t                  (default <sig-file>.siglist)\n"
+		"For the x509-sha* types, <sig-file> is a DER-encoded certificate,\n"
+		"which is stored as a hash of its TBSCertificate, with a zero\n"
+		"(unconditional) revocation time.\n");
 }
 
 static void version(void)
@@ -118,12 +133,57 @@ static void version(void)
 	printf("%s %s\n", toolname, VERSION);
 }
 
+/* Replace the certificate in ctx->data with the
+ * EFI_CERT_X509_SHA{256,384,512} structure: the TBSCertificate hash,
+ * followed by the EFI_TIME of revocation. */
+static int siglist_hash_cert(struct siglist_context *ctx)
+{
+	const uint8_t *tmp;
+	const EVP_MD *md;
+	uint8_t *data;
+	size_t len;
+	X509 *cert;
+	int rc;
+
+	tmp = ctx->data;
+	cert = d2i_X509(NULL, &tmp, ctx->data_len);
+	if (!cert) {
+		fprintf(stderr, "Error: signature lists of type '%s' expect "
+				"a DER-encoded certificate\n",
+				ctx->type->name);
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+
+	md = EVP_get_digestbynid(ctx->type->cert_hash_nid);
+	len = EVP_MD_size(md) + sizeof(EFI_TIME);
+	data = talloc_zero_array(ctx, uint8_t, len);
+
+	rc = siglist_x509_tbs_hash(cert, md, data);
+	X509_free(cert);
+
+	if (rc) {
+		fprintf(stderr, "Error hashing certificate\n");
+		talloc_free(data);
+		return -1;
+	}
+
+	talloc_free(ctx->data);
+	ctx->data = data;
+	ctx->data_len = len;
+
+	return 0;
+}
+
 static int siglist_create(struct siglist_context *ctx)
 {
 	EFI_SIGNATURE_LIST *siglist;
 	EFI_SIGNATURE_DATA *sigdata;
 	uint32_t size;
 
+	if (ctx->type->cert_hash_nid != NID_undef && siglist_hash_cert(ctx))
+		return -1;
+
 	if (ctx->type->sigsize && ctx->data_len != ctx->type->sigsize) {
 		fprintf(stderr, "Error: signature lists of type '%s' expect "
 					"%d bytes of data, "
@@ -259,6 +319,8 @@ int main(int argc, char **argv)
 	if (!ctx->outfilename)
 		set_default_outfilename(ctx);
 
+	OpenSSL_add_all_digests();
+
 	if (fileio_read_file(ctx, ctx->infilename,
 				&ctx->data, &ctx->data_len)) {
 		fprintf(stderr, "Can't read input file %s\n", ctx->infilename);
@@ -31,6 +31,7 @@
  */
 #define _GNU_SOURCE
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -55,6 +56,7 @@
 #include "idc.h"
 #include "image.h"
 #include "fileio.h"
+#include "authenticode.h"
 
 static const char *toolname = "sbsign";
 
@@ -64,11 +66,32 @@ struct sign_context {
 	const char *outfilename;
 	int verbose;
 	int detached;
+	int if_unsigned_by;
+
+	/* signer state, shared by all images */
+	const char *keyfilename;
+	uint8_t keyform;
+	const char *engine;
+	ENGINE *e;
+	UI_METHOD *ui;
+	X509 *cert;
+	STACK_OF(X509) *addcerts;
+	EVP_PKEY *pkey;
+	const EVP_MD *md;
+	bool use_skeleton;
+	struct authenticode_signer *signer;
+};
+
+enum signer_state {
+	SIGNER_OTHER,
+	SIGNER_STALE,
+	SIGNER_VALID,
 };
 
 static struct option options[] = {
 	{ "output", required_argument, NULL, 'o' },
 	{ "cert", required_argument, NULL, 'c' },
+	{ "addcert", required_argument, NULL, 'a' },
 	{ "key", required_argument, NULL, 'k' },
 	{ "keyform", required_argument, NULL, 'f' },
 	{ "detached", no_argument, NULL, 'd' },
@@ -76,26 +99,35 @@ static struct option options[] = {
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
 	{ "engine", required_argument, NULL, 'e'},
+	{ "if-unsigned-by", no_argument, NULL, 'u' },
 	{ NULL, 0, NULL, 0 },
 };
 
 static void usage(void)
 {
 	printf("Usage: %s [options] --key <keyfile> --cert <certfile> "
-			"<efi-boot-image>\n"
-		"Sign an EFI boot image for use with secure boot.\n\n"
+			"<efi-boot-image> [<efi-boot-image>...]\n"
+		"Sign EFI boot images for use with secure boot.\n\n"
 		"Options:\n"
 		"\t--engine <eng>          use the specified engine to load the key\n"
 		"\t--key <keyfile>         signing key (PEM-encoded RSA "
 						"private key)\n"
 		"\t--keyform <PEM|ENGINE>  specify the form of the key  in keyfile\n" 
 		"\t--cert <certfile>       certificate (x509 certificate)\n"
+		"\t--addcert <certfile>    include an intermediate certificate\n"
+		"\t                         in the signature; may be given\n"
+		"\t                         more than once\n"
 		"\t--detached              write a detached signature, instead of\n"
 		"\t                         a signed binary\n"
 		"\t--output <file>         write signed data to <file>\n"
 		"\t                         (default <efi-boot-image>.signed,\n"
 		"\t                         or <efi-boot-image>.pk7 for detached\n"
-		"\t                         signatures)\n",
+		"\t                         signatures). Only valid with a\n"
+		"\t                         single image\n"
+		"\t--if-unsigned-by        only sign if the image does not\n"
+		"\t                         already carry a valid signature\n"
+		"\t                         by <certfile>; stale signatures\n"
+		"\t                         by <certfile> are replaced\n",
 		toolname);
 }
 
@@ -114,41 +146,226 @@ static void set_default_outfilename(struct sign_context *ctx)
 			ctx->infilename, extension);
 }
 
+static bool si_matches_cert(PKCS7_SIGNER_INFO *si, X509 *cert)
+{
+	return !X509_NAME_cmp(si->issuer_and_serial->issuer,
+				X509_get_issuer_name(cert)) &&
+		!ASN1_INTEGER_cmp(si->issuer_and_serial->serial,
+				X509_get_serialNumber(cert));
+}
+
+/* Classify an existing signature: whether it was made by cert, and if so,
+ * whether its IDC digest still matches the (precomputed) image hash, and
+ * its signature verifies against cert's key */
+static enum signer_state signature_state(struct image *image, int signum,
+		X509 *cert, const uint8_t *sha)
+{
+	enum signer_state state = SIGNER_OTHER;
+	PKCS7_SIGNER_INFO *si;
+	const uint8_t *tmp;
+	struct idc *idc;
+	uint8_t *buf;
+	size_t len;
+	PKCS7 *p7;
+	int i;
+
+	if (image_get_signature(image, signum, &buf, &len))
+		return SIGNER_OTHER;
+
+	tmp = buf;
+	p7 = d2i_PKCS7(NULL, &tmp, len);
+	if (!p7)
+		return SIGNER_OTHER;
+
+	if (!PKCS7_type_is_signed(p7))
+		goto out;
+
+	for (i = 0; i < sk_PKCS7_SIGNER_INFO_num(p7->d.sign->signer_info);
+			i++) {
+		si = sk_PKCS7_SIGNER_INFO_value(p7->d.sign->signer_info, i);
+		if (si_matches_cert(si, cert))
+			break;
+	}
+
+	if (i == sk_PKCS7_SIGNER_INFO_num(p7->d.sign->signer_info))
+		goto out;
+
+	state = SIGNER_STALE;
+
+	idc = IDC_get(p7, NULL);
+	if (!idc)
+		goto out;
+
+	if (!IDC_check_digest(idc, sha) &&
+			authenticode_check_signer(p7, si, cert))
+		state = SIGNER_VALID;
+
+	IDC_free(idc);
+out:
+	PKCS7_free(p7);
+	return state;
+}
+
+/**
+ * Check the image's signature table for signatures by cert. Returns the
+ * index of a signature by cert that covers the current image, or -1 if
+ * there is none. In the latter case, any stale signatures by cert are
+ * removed from the table, so that the new signature replaces them.
+ */
+static int find_signature_by(struct image *image, X509 *cert)
+{
+	uint8_t sha[SHA256_DIGEST_LENGTH], *buf;
+	size_t len;
+	int i, n;
+
+	if (!image->sigbuf)
+		return -1;
+
+	/* the image hash doesn't cover the signature table, so a single
+	 * hash serves for every existing signature */
+	if (image_hash_sha256(image, sha))
+		return -1;
+
+	for (n = 0; !image_get_signature(image, n, &buf, &len); n++)
+		if (signature_state(image, n, cert, sha) == SIGNER_VALID)
+			return n;
+
+	/* remove from the end, so the earlier indices remain valid */
+	for (i = n - 1; i >= 0; i--) {
+		if (signature_state(image, i, cert, sha) != SIGNER_STALE)
+			continue;
+
+		fprintf(stderr, "Replacing stale signature %d by this "
+				"certificate\n", i + 1);
+		image_remove_signature(image, i);
+	}
+
+	return -1;
+}
+
+static int load_key(struct sign_context *ctx)
+{
+	if (ctx->pkey)
+		return 0;
+
+	if (ctx->engine) {
+		ctx->e = setup_engine(ctx->engine, ctx->ui);
+		if (!ctx->e)
+			return -1;
+
+		ctx->pkey = fileio_read_engine_key(ctx->e, ctx->keyfilename,
+				ctx->keyform, ctx->ui);
+	} else
+		ctx->pkey = fileio_read_pkey(ctx->keyfilename);
+
+	return ctx->pkey ? 0 : -1;
+}
+
+static int sign_image(struct sign_context *ctx)
+{
+	uint8_t *buf;
+	size_t len;
+	int i, rc;
+
+	ctx->image = image_load(ctx->infilename);
+	if (!ctx->image)
+		return -1;
+
+	talloc_steal(ctx, ctx->image);
+
+	/* check for an existing signature before loading the key, so that
+	 * re-running over already-signed images doesn't touch the key */
+	if (ctx->if_unsigned_by) {
+		int signum = find_signature_by(ctx->image, ctx->cert);
+
+		if (signum >= 0) {
+			fprintf(stderr, "Image is already signed by this "
+					"certificate; not re-signing\n");
+			if (ctx->detached)
+				rc = image_write_detached(ctx->image, signum,
+						ctx->outfilename);
+			else if (strcmp(ctx->outfilename, ctx->infilename))
+				rc = image_write(ctx->image, ctx->outfilename);
+			else
+				rc = 0;
+
+			goto out;
+		}
+	}
+
+	rc = load_key(ctx);
+	if (rc)
+		goto out;
+
+	if (!ctx->signer) {
+		ctx->signer = authenticode_signer_new(ctx, ctx->cert,
+				ctx->pkey, ctx->md, ctx->use_skeleton);
+		for (i = 0; i < sk_X509_num(ctx->addcerts); i++)
+			authenticode_signer_add_cert(ctx->signer,
+					sk_X509_value(ctx->addcerts, i));
+	}
+
+	rc = authenticode_sign(ctx->signer, ctx->image, &buf, &len);
+	if (rc)
+		goto out;
+
+	image_add_signature(ctx->image, buf, len);
+	talloc_free(buf);
+
+	if (ctx->detached) {
+		int i;
+		uint8_t *buf;
+		size_t len;
+
+		for (i = 0; !image_get_signature(ctx->image, i, &buf, &len); i++)
+			;
+		rc = image_write_detached(ctx->image, i - 1, ctx->outfilename);
+	} else
+		rc = image_write(ctx->image, ctx->outfilename);
+
+out:
+	talloc_free(ctx->image);
+	ctx->image = NULL;
+	return rc;
+}
+
 int main(int argc, char **argv)
 {
-	const char *keyfilename, *keyformname, *certfilename, *engine;
-	uint8_t keyform;
-	ENGINE* e;
-	UI_METHOD *ui;
+	const char *keyformname, *certfilename, *outfilename;
 	struct sign_context *ctx;
-	uint8_t *buf, *tmp;
-	int rc, c, sigsize;
-	EVP_PKEY *pkey;
+	int i, c, rc;
+	X509 *cert;
 
 	ctx = talloc_zero(NULL, struct sign_context);
 
-	keyfilename = NULL;
-	keyform = KEYFORM_PEM;
+	ctx->keyform = KEYFORM_PEM;
+	keyformname = NULL;
 	certfilename = NULL;
-	engine = NULL;
-	e = NULL;
-	ui = NULL;
+	outfilename = NULL;
 
 	for (;;) {
 		int idx;
-		c = getopt_long(argc, argv, "o:c:k:f:dvVhe:", options, &idx);
+		c = getopt_long(argc, argv, "o:c:a:k:f:duvVhe:", options, &idx);
 		if (c == -1)
 			break;
 
 		switch (c) {
 		case 'o':
-			ctx->outfilename = talloc_strdup(ctx, optarg);
+			outfilename = optarg;
 			break;
 		case 'c':
 			certfilename = optarg;
 			break;
+		case 'a':
+			if (!ctx->addcerts)
+				ctx->addcerts = sk_X509_new_null();
+			cert = fileio_read_cert(optarg);
+			if (!cert)
+				return EXIT_FAILURE;
+			sk_X509_push(ctx->addcerts, cert);
+			break;
 		case 'k':
-			keyfilename = optarg;
+			ctx->keyfilename = optarg;
 			break;
 		case 'f':
 			keyformname = optarg;
@@ -156,6 +373,9 @@ int main(int argc, char **argv)
 		case 'd':
 			ctx->detached = 1;
 			break;
+		case 'u':
+			ctx->if_unsigned_by = 1;
+			break;
 		case 'v':
 			ctx->verbose = 1;
 			break;
@@ -166,19 +386,22 @@ int main(int argc, char **argv)
 			usage();
 			return EXIT_SUCCESS;
 		case 'e':
-			engine = optarg;
+			ctx->engine = optarg;
 			break;
 		}
 	}
 
-	if (argc != optind + 1) {
+	if (argc < optind + 1) {
 		usage();
 		return EXIT_FAILURE;
 	}
 
-	ctx->infilename = argv[optind];
-	if (!ctx->outfilename)
-		set_default_outfilename(ctx);
+	if (outfilename && argc != optind + 1) {
+		fprintf(stderr,
+			"error: --output is only valid with a single image\n");
+		usage();
+		return EXIT_FAILURE;
+	}
 
 	if (!certfilename) {
 		fprintf(stderr,
@@ -186,7 +409,7 @@ int main(int argc, char **argv)
 		usage();
 		return EXIT_FAILURE;
 	}
-	if (!keyfilename) {
+	if (!ctx->keyfilename) {
 		fprintf(stderr,
 			"error: No key specified (with --key)\n");
 		usage();
@@ -195,16 +418,16 @@ int main(int argc, char **argv)
 
 	if (keyformname) {
 		if (strcmp(keyformname, "PEM") == 0) {
-			keyform = KEYFORM_PEM;
+			ctx->keyform = KEYFORM_PEM;
 		} else if (strcmp(keyformname, "ENGINE") == 0) {
-			if (!engine) {
+			if (!ctx->engine) {
 				fprintf(stderr, 
 					"error: Specified keyform as engine but no engine specified\n");
 				usage();
 				return EXIT_FAILURE;
 			}
 
-			keyform = KEYFORM_ENGINE;
+			ctx->keyform = KEYFORM_ENGINE;
 		} else {
 			fprintf(stderr,
 				"error: Unrecognized keyform, use PEM or ENGINE\n");
@@ -213,12 +436,6 @@ int main(int argc, char **argv)
 		}
 	}
 
-	ctx->image = image_load(ctx->infilename);
-	if (!ctx->image)
-		return EXIT_FAILURE;
-
-	talloc_steal(ctx, ctx->image);
-
 	ERR_load_crypto_strings();
 	OpenSSL_add_all_digests();
 	OpenSSL_add_all_ciphers();
@@ -228,66 +445,43 @@ int main(int argc, char **argv)
 	 * module isn't present).  In either case ignore the errors
 	 * (malloc will cause other failures out lower down */
 	ERR_clear_error();
-	if (engine) {
-		e = setup_engine(engine, ui);
-		if (!e) 
-			return EXIT_FAILURE;
-
-		pkey = fileio_read_engine_key(e, keyfilename, keyform, ui);
-	} else
-		pkey = fileio_read_pkey(keyfilename);
-	if (!pkey)
-		return EXIT_FAILURE;
 
-	X509 *cert = fileio_read_cert(certfilename);
-	if (!cert)
+	ctx->cert = fileio_read_cert(certfilename);
+	if (!ctx->cert)
 		return EXIT_FAILURE;
 
-	const EVP_MD *md = EVP_get_digestbyname("SHA256");
+	ctx->md = EVP_get_digestbyname("SHA256");
 
-	/* set up the PKCS7 object */
-	PKCS7 *p7 = PKCS7_new();
-	PKCS7_set_type(p7, NID_pkcs7_signed);
+	/* when signing more than one image, encode the invariant parts of
+	 * the signature once, and just patch in the per-image values */
+	ctx->use_skeleton = argc - optind > 1;
 
-	PKCS7_SIGNER_INFO *si = PKCS7_sign_add_signer(p7, cert,
-			pkey, md, PKCS7_BINARY);
-	if (!si) {
-		fprintf(stderr, "error in key/certificate chain\n");
-		ERR_print_errors_fp(stderr);
-		return EXIT_FAILURE;
-	}
-
-	PKCS7_content_new(p7, NID_pkcs7_data);
-
-	rc = IDC_set(p7, si, ctx->image);
-	if (rc)
-		return EXIT_FAILURE;
+	rc = 0;
+	for (i = optind; i < argc; i++) {
+		ctx->infilename = argv[i];
+		if (outfilename)
+			ctx->outfilename = talloc_strdup(ctx, outfilename);
+		else
+			set_default_outfilename(ctx);
 
-	sigsize = i2d_PKCS7(p7, NULL);
-	tmp = buf = talloc_array(ctx->image, uint8_t, sigsize);
-	i2d_PKCS7(p7, &tmp);
-	ERR_print_errors_fp(stdout);
+		if (sign_image(ctx))
+			rc = -1;
 
-	image_add_signature(ctx->image, buf, sigsize);
+		talloc_free((void *)ctx->outfilename);
+	}
 
-	if (ctx->detached) {
-		int i;
-		uint8_t *buf;
-		size_t len;
+	talloc_free(ctx->signer);
+	EVP_PKEY_free(ctx->pkey);
+	X509_free(ctx->cert);
+	if (ctx->addcerts)
+		sk_X509_pop_free(ctx->addcerts, X509_free);
 
-		for (i = 0; !image_get_signature(ctx->image, i, &buf, &len); i++)
-			;
-		image_write_detached(ctx->image, i - 1, ctx->outfilename);
-	} else
-		image_write(ctx->image, ctx->outfilename);
+	if (ctx->e) {
+		ENGINE_finish(ctx->e);
+		ENGINE_free(ctx->e);
+	}
 
 	talloc_free(ctx);
 
-	if (e) {
-		ENGINE_finish(e);
-		ENGINE_free(e);
-	}
-
-	return EXIT_SUCCESS;
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
 }
-
@@ -46,7 +46,12 @@
 
 #include "image.h"
 #include "idc.h"
+#include "authenticode.h"
 #include "fileio.h"
+#include "siglist.h"
+#include "sha256mb.h"
+#include "fat.h"
+#include "workpool.h"
 
 #include <openssl/conf.h>
 #include <openssl/err.h>
@@ -54,31 +59,40 @@
 #include <openssl/evp.h>
 #include <openssl/pkcs7.h>
 #include <openssl/pem.h>
-#include <openssl/x509v3.h>
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 #define X509_OBJECT_get0_X509(obj) ((obj)->data.x509)
 #define X509_OBJECT_get_type(obj) ((obj)->type)
-#define X509_STORE_CTX_get0_cert(ctx) ((ctx)->cert)
 #define X509_STORE_get0_objects(certs) ((certs)->objs)
-#define X509_get_extended_key_usage(cert) ((cert)->ex_xkusage)
-#if OPENSSL_VERSION_NUMBER < 0x10020000L
-#define X509_STORE_CTX_get0_store(ctx) ((ctx)->ctx)
-#endif
 #endif
 
 static const char *toolname = "sbverify";
 static const int cert_name_len = 160;
 
+/* number of images loaded and hashed together when verifying a batch */
+#define VERIFY_BATCH_SIZE	(SHA256MB_LANES * 4)
+
 enum verify_status {
 	VERIFY_FAIL = 0,
 	VERIFY_OK = 1,
 };
 
+struct verify_context {
+	struct authenticode_verifier	*verifier;
+	const char			*detached_sig_filename;
+	uint8_t				*dbx_buf;
+	size_t				dbx_size;
+	bool				verbose;
+	int				list;
+};
+
 static struct option options[] = {
 	{ "cert", required_argument, NULL, 'c' },
 	{ "list", no_argument, NULL, 'l' },
 	{ "detached", required_argument, NULL, 'd' },
+	{ "dbx", required_argument, NULL, 'x' },
+	{ "disk-image", no_argument, NULL, 'D' },
+	{ "jobs", required_argument, NULL, 'j' },
 	{ "verbose", no_argument, NULL, 'v' },
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
@@ -87,13 +101,23 @@ static struct option options[] = {
 
 static void usage(void)
 {
-	printf("Usage: %s [options] --cert <certfile> <efi-boot-image>\n"
-		"Verify a UEFI secure boot image.\n\n"
+	printf("Usage: %s [options] --cert <certfile> <efi-boot-image>...\n"
+		"Verify UEFI secure boot images.\n\n"
 		"Options:\n"
 		"\t--cert <certfile>  certificate (x509 certificate)\n"
 		"\t--list             list all signatures (but don't verify)\n"
 		"\t--detached <file>  read signature from <file>, instead of\n"
-		"\t                    looking for an embedded signature\n",
+		"\t                    looking for an embedded signature\n"
+		"\t                    (only valid with a single image)\n"
+		"\t--dbx <file>       reject the image, or signatures by\n"
+		"\t                    certificates, listed in the\n"
+		"\t                    EFI_SIGNATURE_LIST data in <file>\n"
+		"\t--disk-image       arguments are disk images; verify each\n"
+		"\t                    .efi file on their EFI system\n"
+		"\t                    partition. Disks without any .efi\n"
+		"\t                    files fail verification\n"
+		"\t--jobs <n>         with --disk-image, the number of disk\n"
+		"\t                    images to process in parallel\n",
 			toolname);
 }
 
@@ -102,18 +126,6 @@ static void version(void)
 	printf("%s %s\n", toolname, VERSION);
 }
 
-int load_cert(X509_STORE *certs, const char *filename)
-{
-	X509 *cert;
-
-	cert = fileio_read_cert(filename);
-	if (!cert)
-		return -1;
-
-	X509_STORE_add_cert(certs, cert);
-	return 0;
-}
-
 static void print_signature_info(PKCS7 *p7)
 {
 	char subject_name[cert_name_len + 1], issuer_name[cert_name_len + 1];
@@ -181,74 +193,300 @@ static int load_detached_signature_data(struct image *image,
 	return fileio_read_file(image, filename, buf, len);
 }
 
-static int cert_in_store(X509 *cert, X509_STORE_CTX *ctx)
+/* Is any certificate carried by the signature revoked by dbx? */
+static bool signature_revoked(PKCS7 *p7, const uint8_t *dbx, size_t dbx_len)
 {
-	STACK_OF(X509_OBJECT) *objs;
-	X509_OBJECT *obj;
 	int i;
 
-	objs = X509_STORE_get0_objects(X509_STORE_CTX_get0_store(ctx));
+	for (i = 0; i < sk_X509_num(p7->d.sign->cert); i++)
+		if (siglist_cert_revoked(dbx, dbx_len,
+					sk_X509_value(p7->d.sign->cert, i)))
+			return true;
 
-	for (i = 0; i < sk_X509_OBJECT_num(objs); i++) {
-		obj = sk_X509_OBJECT_value(objs, i);
+	return false;
+}
+
+/* Called before each signature is checked: list it, and skip it when
+ * only listing, or when dbx revokes it */
+static bool check_signature(void *arg, int signum, PKCS7 *p7)
+{
+	struct verify_context *ctx = arg;
+
+	if (ctx->verbose || ctx->list) {
+		printf("signature %d\n", signum + 1);
+		print_signature_info(p7);
+		//print_certificate_store_certs(certs);
+	}
+
+	if (ctx->list)
+		return false;
+
+	if (ctx->dbx_buf &&
+			signature_revoked(p7, ctx->dbx_buf, ctx->dbx_size)) {
+		if (ctx->verbose)
+			printf("Signature certificate is revoked by dbx\n");
+		return false;
+	}
+
+	return true;
+}
+
+static enum verify_status verify_image(struct verify_context *ctx,
+		const char *image_filename, struct image *image)
+{
+	const char *detached_sig_filename = ctx->detached_sig_filename;
+	enum authenticode_status status;
+	const char *message;
+	uint8_t *sig_buf;
+	size_t sig_size;
+
+	if (!image) {
+		fprintf(stderr, "Can't open image %s\n", image_filename);
+		return VERIFY_FAIL;
+	}
+
+	if (ctx->dbx_buf && !ctx->list &&
+			siglist_image_revoked(ctx->dbx_buf, ctx->dbx_size,
+				image)) {
+		printf("Image hash is revoked by dbx\n");
+		talloc_free(image);
+		return VERIFY_FAIL;
+	}
 
-		if (X509_OBJECT_get_type(obj) == X509_LU_X509 &&
-		    !X509_cmp(X509_OBJECT_get0_X509(obj), cert))
-			return 1;
+	sig_buf = NULL;
+	sig_size = 0;
+
+	if (detached_sig_filename &&
+			load_detached_signature_data(image,
+				detached_sig_filename, &sig_buf, &sig_size)) {
+		talloc_free(image);
+		return VERIFY_FAIL;
+	}
+
+	status = authenticode_verify_image(ctx->verifier, image,
+			sig_buf, sig_size, check_signature, ctx, &message);
+	if (status == AUTHENTICODE_INVALID) {
+		fprintf(stderr, "%s\n", message);
+		ERR_print_errors_fp(stderr);
 	}
 
+	talloc_free(image);
+
+	/* when listing, we only fail if the signatures couldn't be read */
+	if (ctx->list)
+		return status == AUTHENTICODE_INVALID ?
+			VERIFY_FAIL : VERIFY_OK;
+
+	return status == AUTHENTICODE_OK ? VERIFY_OK : VERIFY_FAIL;
+}
+
+/* verify a set of loaded images; the images are freed */
+static enum verify_status verify_batch(struct verify_context *ctx,
+		const char **filenames, struct image **images, int n_images,
+		bool show_names)
+{
+	enum verify_status status, batch_status;
+	int i, j, n;
+
+	batch_status = VERIFY_OK;
+
+	for (i = 0; i < n_images; i += n) {
+		n = n_images - i;
+		if (n > VERIFY_BATCH_SIZE)
+			n = VERIFY_BATCH_SIZE;
+
+		/* hash the batch together, so that verify_image() can use
+		 * the cached hashes */
+		if (n > 1 && !ctx->list)
+			image_hash_sha256_multi(images + i, n);
+
+		for (j = i; j < i + n; j++) {
+			const char *filename = filenames[j];
+
+			if (show_names && (ctx->list || ctx->verbose))
+				printf("%s:\n", filename);
+
+			status = verify_image(ctx, filename, images[j]);
+
+			if (ctx->list) {
+				if (status != VERIFY_OK)
+					batch_status = VERIFY_FAIL;
+				continue;
+			}
+
+			if (show_names)
+				printf("%s: ", filename);
+
+			if (status == VERIFY_OK)
+				printf("Signature verification OK\n");
+			else {
+				printf("Signature verification failed\n");
+				batch_status = VERIFY_FAIL;
+			}
+		}
+	}
+
+	return batch_status;
+}
+
+struct disk_files {
+	struct verify_context	*ctx;
+	const char		*disk_filename;
+	const char		*filenames[VERIFY_BATCH_SIZE];
+	struct image		*images[VERIFY_BATCH_SIZE];
+	int			n;
+	int			n_total;
+	enum verify_status	status;
+};
+
+static bool is_efi_binary(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 4 && !strcasecmp(name + len - 4, ".efi");
+}
+
+/* verify the files collected so far, so that we only hold one batch of
+ * a disk's images in memory at a time */
+static void verify_disk_batch(struct disk_files *files)
+{
+	int i;
+
+	if (verify_batch(files->ctx, files->filenames, files->images,
+				files->n, true) != VERIFY_OK)
+		files->status = VERIFY_FAIL;
+
+	for (i = 0; i < files->n; i++)
+		talloc_free((void *)files->filenames[i]);
+	files->n = 0;
+}
+
+static int add_disk_file(const char *path, uint8_t *buf, size_t len,
+		void *arg)
+{
+	struct disk_files *files = arg;
+
+	files->filenames[files->n] = talloc_asprintf(files, "%s:%s",
+			files->disk_filename, path);
+	files->images[files->n] = image_load_buf(buf, len);
+	files->n++;
+	files->n_total++;
+
+	if (files->n == VERIFY_BATCH_SIZE)
+		verify_disk_batch(files);
+
 	return 0;
 }
 
-static int x509_verify_cb(int status, X509_STORE_CTX *ctx)
+/* verify every EFI binary on the ESP of a disk image. A disk without any
+ * is a failure, as it can't be booted with secure boot enabled. */
+static enum verify_status verify_disk(struct verify_context *ctx,
+		const char *filename)
 {
-	int err = X509_STORE_CTX_get_error(ctx);
-
-	/* also accept code-signing keys */
-	if (err == X509_V_ERR_INVALID_PURPOSE &&
-			X509_get_extended_key_usage(X509_STORE_CTX_get0_cert(ctx))
-			== XKU_CODE_SIGN)
-		status = 1;
-
-	else if (err == X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY ||
-		 err == X509_V_ERR_CERT_UNTRUSTED ||
-		 err == X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT ||
-		 err == X509_V_ERR_UNABLE_TO_VERIFY_LEAF_SIGNATURE) {
-		/* all certs given with the --cert argument are trusted */
-
-		if (cert_in_store(X509_STORE_CTX_get_current_cert(ctx), ctx))
-			status = 1;
-	} else if (err == X509_V_ERR_CERT_HAS_EXPIRED ||
-		   err == X509_V_ERR_ERROR_IN_CERT_NOT_BEFORE_FIELD ||
-		   err == X509_V_ERR_CERT_NOT_YET_VALID ||
-		   err == X509_V_ERR_ERROR_IN_CERT_NOT_AFTER_FIELD)
-		/* UEFI explicitly allows expired certificates */
-		status = 1;
+	enum verify_status status;
+	struct disk_files *files;
+	struct fat_volume *vol;
+
+	files = talloc_zero(ctx, struct disk_files);
+	files->ctx = ctx;
+	files->disk_filename = filename;
+	files->status = VERIFY_OK;
+	status = VERIFY_FAIL;
+
+	vol = fat_open_disk(files, filename);
+	if (!vol) {
+		printf("%s: Signature verification failed\n", filename);
+		goto out;
+	}
+
+	if (fat_walk(vol, is_efi_binary, add_disk_file, files)) {
+		/* report what we did read before the error */
+		verify_disk_batch(files);
+		printf("%s: Can't read EFI system partition\n", filename);
+		goto out;
+	}
+
+	if (files->n)
+		verify_disk_batch(files);
+
+	if (!files->n_total) {
+		printf("%s: No EFI binaries found\n", filename);
+		goto out;
+	}
+
+	status = files->status;
+
+out:
+	talloc_free(files);
+	return status;
+}
+
+struct disk_args {
+	struct verify_context	*ctx;
+	char			**filenames;
+};
+
+static int verify_disk_item(void *arg, unsigned int i)
+{
+	struct disk_args *args = arg;
+
+	return verify_disk(args->ctx, args->filenames[i]);
+}
+
+/*
+ * Verify disk images using n_jobs processes. The output for each disk is
+ * printed in argument order.
+ */
+static enum verify_status verify_disks(struct verify_context *ctx,
+		char **filenames, int n_disks, int n_jobs)
+{
+	struct disk_args args = { ctx, filenames };
+	enum verify_status status;
+	struct workpool *pool;
+	int i, result;
+
+	status = VERIFY_OK;
+
+	if (n_jobs <= 1 || n_disks <= 1) {
+		for (i = 0; i < n_disks; i++)
+			if (verify_disk(ctx, filenames[i]) != VERIFY_OK)
+				status = VERIFY_FAIL;
+		return status;
+	}
+
+	pool = workpool_run(ctx, n_disks, n_jobs, verify_disk_item, &args);
+	if (!pool)
+		return VERIFY_FAIL;
 
+	for (i = 0; i < n_disks; i++) {
+		workpool_copy_output(pool, i, stdout);
+
+		result = workpool_status(pool, i);
+		if (result == WORKPOOL_NOT_RUN)
+			printf("%s: Signature verification failed\n",
+					filenames[i]);
+		if (result != VERIFY_OK)
+			status = VERIFY_FAIL;
+	}
+
+	talloc_free(pool);
 	return status;
 }
 
 int main(int argc, char **argv)
 {
-	const char *detached_sig_filename, *image_filename;
+	const char *dbx_filename;
+	struct verify_context *ctx;
+	struct image *images[VERIFY_BATCH_SIZE];
 	enum verify_status status;
-	int rc, c, flags, list;
-	const uint8_t *tmp_buf;
-	struct image *image;
-	X509_STORE *certs;
-	uint8_t *sig_buf;
-	size_t sig_size;
-	struct idc *idc;
-	bool verbose;
-	BIO *idcbio;
-	PKCS7 *p7;
-	int sig_count = 0;
+	int rc, c, i, j, n, n_images, n_jobs;
+	bool disk_images;
 
-	status = VERIFY_FAIL;
-	certs = X509_STORE_new();
-	list = 0;
-	verbose = false;
-	detached_sig_filename = NULL;
+	ctx = talloc_zero(NULL, struct verify_context);
+	ctx->verifier = authenticode_verifier_new(ctx);
+	dbx_filename = NULL;
+	disk_images = false;
+	n_jobs = 1;
 
 	OpenSSL_add_all_digests();
 	ERR_load_crypto_strings();
@@ -261,24 +499,39 @@ int main(int argc, char **argv)
 
 	for (;;) {
 		int idx;
-		c = getopt_long(argc, argv, "c:d:lvVh", options, &idx);
+		c = getopt_long(argc, argv, "c:d:x:Dj:lvVh", options, &idx);
 		if (c == -1)
 			break;
 
 		switch (c) {
 		case 'c':
-			rc = load_cert(certs, optarg);
+			rc = authenticode_verifier_load_cert(ctx->verifier,
+					optarg);
 			if (rc)
 				return EXIT_FAILURE;
 			break;
 		case 'd':
-			detached_sig_filename = optarg;
+			ctx->detached_sig_filename = optarg;
+			break;
+		case 'x':
+			dbx_filename = optarg;
+			break;
+		case 'D':
+			disk_images = true;
+			break;
+		case 'j':
+			n_jobs = workpool_parse_jobs(optarg);
+			if (n_jobs < 1) {
+				fprintf(stderr, "Invalid number of jobs: %s\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
 			break;
 		case 'l':
-			list = 1;
+			ctx->list = 1;
 			break;
 		case 'v':
-			verbose = true;
+			ctx->verbose = true;
 			break;
 		case 'V':
 			version();
@@ -290,97 +543,47 @@ int main(int argc, char **argv)
 
 	}
 
-	if (argc != optind + 1) {
+	n_images = argc - optind;
+	if (n_images < 1 || ((n_images > 1 || disk_images) &&
+				ctx->detached_sig_filename)) {
 		usage();
 		return EXIT_FAILURE;
 	}
 
-	image_filename = argv[optind];
-
-	image = image_load(image_filename);
-	if (!image) {
-		fprintf(stderr, "Can't open image %s\n", image_filename);
-		return EXIT_FAILURE;
+	if (dbx_filename) {
+		rc = fileio_read_file(ctx, dbx_filename,
+				&ctx->dbx_buf, &ctx->dbx_size);
+		if (rc)
+			return EXIT_FAILURE;
 	}
 
-	for (;;) {
-		if (detached_sig_filename) {
-			if (sig_count++)
-				break;
-
-			rc = load_detached_signature_data(image, detached_sig_filename,
-							  &sig_buf, &sig_size);
-		} else
-			rc = image_get_signature(image, sig_count++, &sig_buf, &sig_size);
-
-		if (rc) {
-			if (sig_count == 0) {
-				fprintf(stderr, "Unable to read signature data from %s\n",
-					detached_sig_filename ? : image_filename);
-			}
-			break;
-		}
+	authenticode_verifier_set_verbose(ctx->verifier, ctx->verbose);
 
-		tmp_buf = sig_buf;
-		if (verbose || list)
-			printf("signature %d\n", sig_count);
-		p7 = d2i_PKCS7(NULL, &tmp_buf, sig_size);
-		if (!p7) {
-			fprintf(stderr, "Unable to parse signature data\n");
-			ERR_print_errors_fp(stderr);
-			break;
-		}
+	if (disk_images) {
+		status = verify_disks(ctx, argv + optind, n_images, n_jobs);
+	} else {
+		status = VERIFY_OK;
 
-		if (verbose || list) {
-			print_signature_info(p7);
-			//print_certificate_store_certs(certs);
-		}
+		/* load the images a batch at a time, so that we don't hold
+		 * all of them in memory */
+		for (i = optind; i < argc; i += n) {
+			n = argc - i;
+			if (n > VERIFY_BATCH_SIZE)
+				n = VERIFY_BATCH_SIZE;
 
-		if (list)
-			continue;
+			for (j = 0; j < n; j++)
+				images[j] = image_load(argv[i + j]);
 
-		idcbio = BIO_new(BIO_s_mem());
-		idc = IDC_get(p7, idcbio);
-		if (!idc) {
-			fprintf(stderr, "Unable to get IDC from PKCS7\n");
-			break;
-		}
-
-		rc = IDC_check_hash(idc, image);
-		if (rc) {
-			fprintf(stderr, "Image fails hash check\n");
-			break;
+			if (verify_batch(ctx, (const char **)argv + i,
+						images, n, n_images > 1)
+					!= VERIFY_OK)
+				status = VERIFY_FAIL;
 		}
-
-		flags = PKCS7_BINARY;
-
-		/* OpenSSL 1.0.2e no longer allows calling PKCS7_verify with
-		 * both data and content. Empty out the content. */
-		p7->d.sign->contents->d.ptr = NULL;
-
-		X509_STORE_set_verify_cb_func(certs, x509_verify_cb);
-		rc = PKCS7_verify(p7, NULL, certs, idcbio, NULL, flags);
-		if (rc) {
-			if (verbose)
-				printf("PKCS7 verification passed\n");
-
-			status = VERIFY_OK;
-		} else if (verbose) {
-			printf("PKCS7 verification failed\n");
-			ERR_print_errors_fp(stderr);
-		}
-
 	}
 
-	talloc_free(image);
-
-	if (list)
-		exit(EXIT_SUCCESS);
+	rc = status == VERIFY_OK ? EXIT_SUCCESS : EXIT_FAILURE;
 
-	if (status == VERIFY_OK)
-		printf("Signature verification OK\n");
-	else
-		printf("Signature verification failed\n");
+	talloc_free(ctx);
 
-	return status == VERIFY_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+	return rc;
 }
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include <ccan/talloc/talloc.h>
+
+#include "sha256mb.h"
+
+/*
+ * Benchmark (and correctness check) for the multi-buffer SHA-256
+ * implementation: hash a corpus of synthetic images, each made up of
+ * a few regions like those from image_find_regions(), both one image at
+ * a time with OpenSSL's SHA-256 (the one-image-per-core baseline), and
+ * SHA256MB_LANES images at a time with sha256mb_hash().
+ */
+
+static const int n_regions = 6;
+
+struct bench_image {
+	struct region	*regions;
+	uint8_t		digest[SHA256_DIGEST_LENGTH];
+	uint8_t		digest_mb[SHA256_DIGEST_LENGTH];
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t create_corpus(void *ctx, struct bench_image *images, int n,
+		int min_size, int max_size)
+{
+	size_t total = 0;
+	int i, j, k, size;
+
+	for (i = 0; i < n; i++) {
+		images[i].regions = talloc_array(ctx, struct region,
+				n_regions);
+
+		for (j = 0; j < n_regions; j++) {
+			struct region *region = &images[i].regions[j];
+			uint8_t *data;
+
+			/* a few small header regions, then larger sections */
+			if (j < 3)
+				size = 8 + rand() % 512;
+			else
+				size = min_size / (n_regions - 3) +
+					rand() % ((max_size - min_size) /
+						(n_regions - 3) + 1);
+
+			data = talloc_array(images[i].regions, uint8_t, size);
+			for (k = 0; k < size; k++)
+				data[k] = rand();
+
+			region->data = data;
+			region->size = size;
+			region->name = NULL;
+			total += size;
+		}
+	}
+
+	return total;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-n <images>] [-i <iterations>] "
+			"[-s <min-kB>] [-S <max-kB>]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, iter, n, iterations, min_size, max_size, errors;
+	struct sha256mb_job *jobs;
+	struct bench_image *images;
+	double t_base, t_mb, start;
+	SHA256_CTX sha_ctx;
+	size_t total;
+	void *ctx;
+
+	n = 1024;
+	iterations = 4;
+	min_size = 16 * 1024;
+	max_size = 256 * 1024;
+
+	while ((c = getopt(argc, argv, "n:i:s:S:h")) != -1) {
+		switch (c) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			min_size = atoi(optarg) * 1024;
+			break;
+		case 'S':
+			max_size = atoi(optarg) * 1024;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (n < 1 || iterations < 1 || min_size < 0 || max_size < min_size) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	ctx = talloc_new(NULL);
+	images = talloc_zero_array(ctx, struct bench_image, n);
+	jobs = talloc_array(ctx, struct sha256mb_job, n);
+
+	srand(1);
+	total = create_corpus(ctx, images, n, min_size, max_size);
+
+	for (i = 0; i < n; i++) {
+		jobs[i].regions = images[i].regions;
+		jobs[i].n_regions = n_regions;
+		jobs[i].digest = images[i].digest_mb;
+	}
+
+	start = now();
+	for (iter = 0; iter < iterations; iter++) {
+		for (i = 0; i < n; i++) {
+			int j;
+
+			SHA256_Init(&sha_ctx);
+			for (j = 0; j < n_regions; j++)
+				SHA256_Update(&sha_ctx,
+						images[i].regions[j].data,
+						images[i].regions[j].size);
+			SHA256_Final(images[i].digest, &sha_ctx);
+		}
+	}
+	t_base = now() - start;
+
+	start = now();
+	for (iter = 0; iter < iterations; iter++)
+		sha256mb_hash(jobs, n);
+	t_mb = now() - start;
+
+	errors = 0;
+	for (i = 0; i < n; i++) {
+		if (memcmp(images[i].digest, images[i].digest_mb,
+					SHA256_DIGEST_LENGTH)) {
+			fprintf(stderr, "digest mismatch on image %d\n", i);
+			errors++;
+		}
+	}
+
+	printf("%d images, %zd bytes, %d iterations\n", n, total, iterations);
+	printf("  sequential:   %8.1f MB/s\n",
+			total * iterations / t_base / 1e6);
+	printf("  multi-buffer: %8.1f MB/s (%d lanes%s)\n",
+			total * iterations / t_mb / 1e6, SHA256MB_LANES,
+			sha256mb_preferred() ? "" :
+				"; CPU has SHA instructions, not used");
+
+	talloc_free(ctx);
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
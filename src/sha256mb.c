@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+
+/*
+ * Multi-buffer SHA-256: rather than hashing one stream at a time (where
+ * every block depends on the previous one), we hash SHA256MB_LANES
+ * independent streams at once, with one stream in each lane of a vector.
+ * As a stream finishes, the next job is started in its lane, so streams
+ * of differing lengths keep the lanes busy.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+#include "sha256mb.h"
+
+#define SHA256_BLOCK_SIZE	64
+
+typedef uint32_t vu32 __attribute__((vector_size(SHA256MB_LANES * 4)));
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* per-lane stream state */
+struct lane {
+	struct sha256mb_job	*job;
+	int			region;
+	size_t			offset;
+	uint64_t		len;
+	uint64_t		remaining;
+
+	/* the final (padded) blocks of the stream */
+	uint8_t			tail[2 * SHA256_BLOCK_SIZE];
+	int			tail_blocks;
+	int			tail_next;
+
+	/* staging for blocks that span regions */
+	uint8_t			block[SHA256_BLOCK_SIZE];
+};
+
+static inline vu32 rotr(vu32 x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t x)
+{
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+}
+
+static void sha256mb_compress(vu32 state[8],
+		const uint8_t *blocks[SHA256MB_LANES])
+{
+	vu32 w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i, l;
+
+	for (i = 0; i < 16; i++)
+		for (l = 0; l < SHA256MB_LANES; l++)
+			w[i][l] = load_be32(blocks[l] + i * 4);
+
+	for (i = 16; i < 64; i++)
+		w[i] = (rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10)) +
+			w[i-7] +
+			(rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^
+			 (w[i-15] >> 3)) +
+			w[i-16];
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+			((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void lane_start(struct lane *lane, struct sha256mb_job *job,
+		vu32 state[8], int l)
+{
+	int i;
+
+	lane->job = job;
+	lane->region = 0;
+	lane->offset = 0;
+	lane->len = 0;
+	lane->tail_blocks = 0;
+	lane->tail_next = 0;
+
+	for (i = 0; i < job->n_regions; i++)
+		if (job->regions[i].size > 0)
+			lane->len += job->regions[i].size;
+	lane->remaining = lane->len;
+
+	for (i = 0; i < 8; i++)
+		state[i][l] = sha256_iv[i];
+}
+
+/* copy the next len bytes of the lane's stream to buf */
+static void lane_copy(struct lane *lane, uint8_t *buf, size_t len)
+{
+	const struct region *region;
+	size_t n;
+
+	while (len) {
+		region = &lane->job->regions[lane->region];
+		if (region->size <= 0 || lane->offset >= (size_t)region->size) {
+			lane->region++;
+			lane->offset = 0;
+			continue;
+		}
+
+		n = region->size - lane->offset;
+		if (n > len)
+			n = len;
+
+		memcpy(buf, region->data + lane->offset, n);
+		buf += n;
+		len -= n;
+		lane->offset += n;
+	}
+}
+
+/* Returns the lane's next 64-byte block, or NULL if the stream (including
+ * padding) has been completely consumed */
+static const uint8_t *lane_next_block(struct lane *lane)
+{
+	const struct region *region;
+	const uint8_t *block;
+	size_t r;
+
+	if (lane->remaining >= SHA256_BLOCK_SIZE) {
+		/* skip exhausted and empty regions */
+		for (;;) {
+			region = &lane->job->regions[lane->region];
+			if (region->size > 0 &&
+					lane->offset < (size_t)region->size)
+				break;
+			lane->region++;
+			lane->offset = 0;
+		}
+
+		lane->remaining -= SHA256_BLOCK_SIZE;
+
+		/* use the image data directly where we can */
+		if (region->size - lane->offset >= SHA256_BLOCK_SIZE) {
+			block = region->data + lane->offset;
+			lane->offset += SHA256_BLOCK_SIZE;
+			return block;
+		}
+
+		lane_copy(lane, lane->block, SHA256_BLOCK_SIZE);
+		return lane->block;
+	}
+
+	if (!lane->tail_blocks) {
+		r = lane->remaining;
+		memset(lane->tail, 0, sizeof(lane->tail));
+		lane_copy(lane, lane->tail, r);
+		lane->remaining = 0;
+
+		lane->tail[r] = 0x80;
+		lane->tail_blocks = (r + 1 + 8 <= SHA256_BLOCK_SIZE) ? 1 : 2;
+
+		r = lane->tail_blocks * SHA256_BLOCK_SIZE;
+		store_be32(lane->tail + r - 8, (lane->len * 8) >> 32);
+		store_be32(lane->tail + r - 4, lane->len * 8);
+	}
+
+	if (lane->tail_next == lane->tail_blocks)
+		return NULL;
+
+	return lane->tail + SHA256_BLOCK_SIZE * lane->tail_next++;
+}
+
+/**
+ * CPUs with dedicated SHA-256 instructions (x86 SHA extensions, ARMv8
+ * SHA2) hash a single stream faster than we can hash several in vector
+ * lanes, so callers should only use sha256mb_hash() where this returns
+ * true.
+ */
+bool sha256mb_preferred(void)
+{
+	static int preferred = -1;
+
+	if (preferred >= 0)
+		return preferred;
+
+	preferred = 1;
+
+#if defined(__x86_64__) || defined(__i386__)
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+				(ebx & bit_SHA))
+			preferred = 0;
+	}
+#elif defined(__aarch64__)
+	/* HWCAP_SHA2 */
+	if (getauxval(AT_HWCAP) & (1 << 6))
+		preferred = 0;
+#endif
+
+	return preferred;
+}
+
+/**
+ * Hash each job's regions, writing the SHA-256 digest to job->digest.
+ */
+void sha256mb_hash(struct sha256mb_job *jobs, unsigned int n_jobs)
+{
+	static const uint8_t idle_block[SHA256_BLOCK_SIZE];
+	const uint8_t *blocks[SHA256MB_LANES];
+	struct lane lanes[SHA256MB_LANES];
+	unsigned int next_job;
+	vu32 state[8];
+	int i, l, active;
+
+	next_job = 0;
+	memset(state, 0, sizeof(state));
+
+	for (l = 0; l < SHA256MB_LANES; l++) {
+		lanes[l].job = NULL;
+		if (next_job < n_jobs)
+			lane_start(&lanes[l], &jobs[next_job++], state, l);
+	}
+
+	for (;;) {
+		active = 0;
+
+		for (l = 0; l < SHA256MB_LANES; l++) {
+			struct lane *lane = &lanes[l];
+
+			blocks[l] = NULL;
+
+			while (lane->job) {
+				blocks[l] = lane_next_block(lane);
+				if (blocks[l])
+					break;
+
+				/* stream complete: store the digest, and start
+				 * the next job in this lane */
+				for (i = 0; i < 8; i++)
+					store_be32(lane->job->digest + i * 4,
+							state[i][l]);
+
+				lane->job = NULL;
+				if (next_job < n_jobs)
+					lane_start(lane, &jobs[next_job++],
+							state, l);
+			}
+
+			if (blocks[l])
+				active++;
+			else
+				blocks[l] = idle_block;
+		}
+
+		if (!active)
+			break;
+
+		sha256mb_compress(state, blocks);
+	}
+}
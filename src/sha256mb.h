@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#ifndef SHA256MB_H
+#define SHA256MB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "image.h"
+
+/* Number of independent SHA-256 streams hashed in parallel. This follows
+ * the vector width that the compiler is targeting: 16 lanes for AVX-512,
+ * 8 for AVX2, and 4 for SSE2/NEON (or the scalar fallback). */
+#if defined(__AVX512F__)
+#define SHA256MB_LANES	16
+#elif defined(__AVX2__)
+#define SHA256MB_LANES	8
+#else
+#define SHA256MB_LANES	4
+#endif
+
+/* A single stream to hash: the concatenation of the given regions */
+struct sha256mb_job {
+	const struct region	*regions;
+	int			n_regions;
+	uint8_t			*digest;
+};
+
+bool sha256mb_preferred(void);
+void sha256mb_hash(struct sha256mb_job *jobs, unsigned int n_jobs);
+
+#endif /* SHA256MB_H */
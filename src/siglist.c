@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include <openssl/asn1.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "siglist.h"
+
+struct siglist_hash_type {
+	EFI_GUID	guid;
+	int		nid;
+	bool		is_x509;
+};
+
+static const struct siglist_hash_type hash_types[] = {
+	{ EFI_CERT_SHA256_GUID,      NID_sha256, false },
+	{ EFI_CERT_SHA384_GUID,      NID_sha384, false },
+	{ EFI_CERT_SHA512_GUID,      NID_sha512, false },
+	{ EFI_CERT_X509_SHA256_GUID, NID_sha256, true },
+	{ EFI_CERT_X509_SHA384_GUID, NID_sha384, true },
+	{ EFI_CERT_X509_SHA512_GUID, NID_sha512, true },
+};
+
+/**
+ * Iterates a buffer of EFI_SIGNATURE_LISTs (at buf, of length len),
+ * and calls fn on the SignatureData of each EFI_SIGNATURE_DATA item
+ * found, with the owner GUID stripped. Iteration stops at the first
+ * non-zero return from fn, which is passed back to the caller.
+ */
+int siglist_iterate(const uint8_t *buf, size_t len,
+		siglist_fn fn, void *arg)
+{
+	const EFI_SIGNATURE_LIST *siglist;
+	const EFI_SIGNATURE_DATA *sigdata;
+	unsigned int i, j;
+	int rc = 0;
+
+	for (i = 0; i + sizeof(*siglist) <= len && !rc;
+			i += siglist->SignatureListSize) {
+		siglist = (const void *)(buf + i);
+
+		if (siglist->SignatureListSize < sizeof(*siglist) ||
+				i + siglist->SignatureListSize > len)
+			return -1;
+
+		/* ensure that the header & sig sizes are sensible */
+		if (siglist->SignatureHeaderSize > siglist->SignatureListSize)
+			continue;
+
+		if (siglist->SignatureSize < sizeof(*sigdata))
+			continue;
+
+		for (j = sizeof(*siglist) + siglist->SignatureHeaderSize;
+				j + siglist->SignatureSize <=
+					siglist->SignatureListSize && !rc;
+				j += siglist->SignatureSize) {
+			sigdata = (const void *)siglist + j;
+			rc = fn(&siglist->SignatureType,
+					sigdata->SignatureData,
+					siglist->SignatureSize -
+						sizeof(*sigdata),
+					arg);
+		}
+	}
+
+	return rc;
+}
+
+/* Returns the digest used by a hash-based signature list type, or NULL for
+ * types that don't contain hashes. */
+const EVP_MD *siglist_hash_md(const EFI_GUID *type, bool *is_x509)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(hash_types) / sizeof(hash_types[0]); i++) {
+		if (memcmp(&hash_types[i].guid, type, sizeof(*type)))
+			continue;
+
+		if (is_x509)
+			*is_x509 = hash_types[i].is_x509;
+		return EVP_get_digestbynid(hash_types[i].nid);
+	}
+
+	return NULL;
+}
+
+/**
+ * Hash the TBSCertificate of cert, as used by the EFI_CERT_X509_SHA*
+ * signature types. We hash the original DER encoding of the
+ * TBSCertificate (the first element of the Certificate sequence), rather
+ * than a re-encoding. hash must have space for EVP_MD_size(md) bytes.
+ */
+int siglist_x509_tbs_hash(X509 *cert, const EVP_MD *md, uint8_t *hash)
+{
+	const unsigned char *p, *tbs;
+	unsigned char *der = NULL;
+	int der_len, tag, class, rc;
+	long len;
+
+	rc = -1;
+
+	der_len = i2d_X509(cert, &der);
+	if (der_len <= 0)
+		return -1;
+
+	p = der;
+	if (ASN1_get_object(&p, &len, &tag, &class, der_len) & 0x80)
+		goto out;
+
+	tbs = p;
+	if (ASN1_get_object(&p, &len, &tag, &class,
+				der_len - (p - der)) & 0x80)
+		goto out;
+
+	if (!EVP_Digest(tbs, (p - tbs) + len, hash, NULL, md, NULL))
+		goto out;
+
+	rc = 0;
+
+out:
+	OPENSSL_free(der);
+	return rc;
+}
+
+/* Hash-based entries are grouped into lists of one type, so we cache the
+ * hash for the most recently used digest, rather than rehashing for every
+ * entry */
+struct hash_cache {
+	const EVP_MD	*md;
+	uint8_t		hash[EVP_MAX_MD_SIZE];
+};
+
+struct cert_match_ctx {
+	X509			*cert;
+	unsigned char		*der;
+	int			der_len;
+	struct hash_cache	cache;
+};
+
+struct image_match_ctx {
+	struct image		*image;
+	struct hash_cache	cache;
+};
+
+static int cert_match(const EFI_GUID *type, const uint8_t *data,
+		size_t len, void *arg)
+{
+	EFI_GUID x509_guid = EFI_CERT_X509_GUID;
+	struct cert_match_ctx *ctx = arg;
+	const EVP_MD *md;
+	bool is_x509;
+
+	if (!memcmp(type, &x509_guid, sizeof(*type)))
+		return len == (size_t)ctx->der_len &&
+			!memcmp(data, ctx->der, len);
+
+	md = siglist_hash_md(type, &is_x509);
+	if (!md || !is_x509)
+		return 0;
+
+	/* EFI_CERT_X509_SHA* data is the TBS hash, followed by an EFI_TIME
+	 * for the time of revocation */
+	if (len != EVP_MD_size(md) + sizeof(EFI_TIME))
+		return 0;
+
+	if (ctx->cache.md != md) {
+		if (siglist_x509_tbs_hash(ctx->cert, md, ctx->cache.hash))
+			return 0;
+		ctx->cache.md = md;
+	}
+
+	return !memcmp(data, ctx->cache.hash, EVP_MD_size(md));
+}
+
+/* Is cert listed in the signature database db, either in full or by its
+ * TBS hash? */
+bool siglist_cert_revoked(const uint8_t *db, size_t len, X509 *cert)
+{
+	struct cert_match_ctx ctx;
+	int rc;
+
+	ctx.cert = cert;
+	ctx.cache.md = NULL;
+	ctx.der = NULL;
+	ctx.der_len = i2d_X509(cert, &ctx.der);
+	if (ctx.der_len <= 0)
+		return false;
+
+	rc = siglist_iterate(db, len, cert_match, &ctx);
+
+	OPENSSL_free(ctx.der);
+	return rc > 0;
+}
+
+static int image_match(const EFI_GUID *type, const uint8_t *data,
+		size_t len, void *arg)
+{
+	struct image_match_ctx *ctx = arg;
+	const EVP_MD *md;
+	bool is_x509;
+
+	md = siglist_hash_md(type, &is_x509);
+	if (!md || is_x509 || len != (size_t)EVP_MD_size(md))
+		return 0;
+
+	if (ctx->cache.md != md) {
+		if (image_hash(ctx->image, md, ctx->cache.hash))
+			return 0;
+		ctx->cache.md = md;
+	}
+
+	return !memcmp(data, ctx->cache.hash, len);
+}
+
+/* Is the image's Authenticode hash listed in the signature database db? */
+bool siglist_image_revoked(const uint8_t *db, size_t len,
+		struct image *image)
+{
+	struct image_match_ctx ctx;
+
+	ctx.image = image;
+	ctx.cache.md = NULL;
+
+	return siglist_iterate(db, len, image_match, &ctx) > 0;
+}
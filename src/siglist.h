@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#ifndef SIGLIST_H
+#define SIGLIST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "efivars.h"
+#include "image.h"
+
+typedef int (*siglist_fn)(const EFI_GUID *type, const uint8_t *data,
+		size_t len, void *arg);
+
+int siglist_iterate(const uint8_t *buf, size_t len,
+		siglist_fn fn, void *arg);
+const EVP_MD *siglist_hash_md(const EFI_GUID *type, bool *is_x509);
+int siglist_x509_tbs_hash(X509 *cert, const EVP_MD *md, uint8_t *hash);
+bool siglist_cert_revoked(const uint8_t *db, size_t len, X509 *cert);
+bool siglist_image_revoked(const uint8_t *db, size_t len,
+		struct image *image);
+
+#endif /* SIGLIST_H */
@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ccan/endian/endian.h>
+#include <ccan/talloc/talloc.h>
+
+#include "fileio.h"
+#include "varstore.h"
+
+/*
+ * Access to an edk2 non-volatile variable store file (as used by OVMF, in
+ * OVMF_VARS.fd), for provisioning keys without booting the firmware.
+ *
+ * The file starts with a firmware volume header, followed by an
+ * authenticated variable store. Variables are written log-style: an update
+ * appends a new copy of the variable to the store, and marks the old copy
+ * as deleted, so we do the same here.
+ */
+
+#define EFI_SYSTEM_NV_DATA_FV_GUID \
+	{ 0xfff12b8d, 0x7696, 0x4c8b, \
+	{ 0xa9, 0x85, 0x27, 0x47, 0x07, 0x5b, 0x4f, 0x50 } }
+
+#define EFI_AUTHENTICATED_VARIABLE_GUID \
+	{ 0xaaf32c78, 0x947b, 0x439a, \
+	{ 0xa1, 0x80, 0x2e, 0x14, 0x4e, 0xc3, 0x77, 0x92 } }
+
+#define EFI_FVH_SIGNATURE	0x4856465f	/* "_FVH" */
+
+#define VARIABLE_STORE_FORMATTED	0x5a
+#define VARIABLE_STORE_HEALTHY		0xfe
+
+#define VARIABLE_DATA			0x55aa
+
+/* variable states: these are programmed by clearing bits, as flash would */
+#define VAR_IN_DELETED_TRANSITION	0xfe
+#define VAR_DELETED			0xfd
+#define VAR_ADDED			0x3f
+
+#define VARIABLE_HEADER_ALIGN		4
+
+struct fv_header {
+	uint8_t		zero_vector[16];
+	EFI_GUID	fs_guid;
+	uint64_t	length;
+	uint32_t	signature;
+	uint32_t	attributes;
+	uint16_t	header_length;
+	uint16_t	checksum;
+	uint16_t	ext_header_offset;
+	uint8_t		reserved;
+	uint8_t		revision;
+} __attribute__((packed));
+
+struct variable_store_header {
+	EFI_GUID	signature;
+	uint32_t	size;
+	uint8_t		format;
+	uint8_t		state;
+	uint16_t	reserved;
+	uint32_t	reserved1;
+} __attribute__((packed));
+
+struct auth_variable_header {
+	uint16_t	start_id;
+	uint8_t		state;
+	uint8_t		reserved;
+	uint32_t	attributes;
+	uint64_t	monotonic_count;
+	EFI_TIME	timestamp;
+	uint32_t	pubkey_index;
+	uint32_t	name_size;
+	uint32_t	data_size;
+	EFI_GUID	vendor_guid;
+} __attribute__((packed));
+
+struct varstore {
+	const char	*filename;
+	uint8_t		*buf;
+	size_t		size;
+
+	/* the variable area, within buf */
+	size_t		start;
+	size_t		end;
+
+	/* offset of the first free byte after the last variable */
+	size_t		free;
+	bool		dirty;
+};
+
+static const EFI_GUID fv_nv_guid = EFI_SYSTEM_NV_DATA_FV_GUID;
+static const EFI_GUID auth_var_guid = EFI_AUTHENTICATED_VARIABLE_GUID;
+
+static size_t variable_align(size_t off)
+{
+	return (off + VARIABLE_HEADER_ALIGN - 1) & ~(VARIABLE_HEADER_ALIGN - 1);
+}
+
+static struct auth_variable_header *variable_at(struct varstore *vs,
+		size_t off)
+{
+	return (void *)(vs->buf + off);
+}
+
+static uint8_t *variable_name(struct auth_variable_header *var)
+{
+	return (uint8_t *)(var + 1);
+}
+
+static uint8_t *variable_data(struct auth_variable_header *var)
+{
+	return variable_name(var) + le32_to_cpu(var->name_size);
+}
+
+static size_t variable_size(struct auth_variable_header *var)
+{
+	return sizeof(*var) + le32_to_cpu(var->name_size) +
+		le32_to_cpu(var->data_size);
+}
+
+static bool variable_valid(struct auth_variable_header *var)
+{
+	return var->state == VAR_ADDED ||
+		var->state == (VAR_ADDED & VAR_IN_DELETED_TRANSITION);
+}
+
+/* variable names are stored as NUL-terminated UCS-2 strings */
+static bool variable_name_match(struct auth_variable_header *var,
+		const char *name)
+{
+	uint8_t *p = variable_name(var);
+	size_t i, len = strlen(name);
+
+	if (le32_to_cpu(var->name_size) != (len + 1) * 2)
+		return false;
+
+	for (i = 0; i <= len; i++)
+		if (p[i * 2] != (uint8_t)name[i] || p[i * 2 + 1] != 0)
+			return false;
+
+	return true;
+}
+
+static bool variable_same(struct auth_variable_header *a,
+		struct auth_variable_header *b)
+{
+	return !memcmp(&a->vendor_guid, &b->vendor_guid, sizeof(EFI_GUID)) &&
+		a->name_size == b->name_size &&
+		!memcmp(variable_name(a), variable_name(b),
+				le32_to_cpu(a->name_size));
+}
+
+/* A copy left in the deleted-transition state is only current if the
+ * update that replaced it didn't complete; otherwise, finish deleting it */
+static void varstore_resolve_transitions(struct varstore *vs)
+{
+	struct auth_variable_header *var, *tmp;
+	size_t off, tmp_off;
+
+	for (off = vs->start; off < vs->free;
+			off = variable_align(off + variable_size(var))) {
+		var = variable_at(vs, off);
+
+		if (var->state != (VAR_ADDED & VAR_IN_DELETED_TRANSITION))
+			continue;
+
+		for (tmp_off = vs->start; tmp_off < vs->free;
+				tmp_off = variable_align(tmp_off +
+					variable_size(tmp))) {
+			tmp = variable_at(vs, tmp_off);
+			if (tmp->state == VAR_ADDED && variable_same(var, tmp)) {
+				var->state &= VAR_DELETED;
+				break;
+			}
+		}
+	}
+}
+
+/* walk the variable list, to find the start of free space */
+static int varstore_scan(struct varstore *vs)
+{
+	struct auth_variable_header *var;
+	size_t off;
+
+	for (off = vs->start; off + sizeof(*var) <= vs->end;
+			off = variable_align(off + variable_size(var))) {
+		var = variable_at(vs, off);
+
+		if (le16_to_cpu(var->start_id) != VARIABLE_DATA)
+			break;
+
+		if (le32_to_cpu(var->name_size) > vs->end ||
+				le32_to_cpu(var->data_size) > vs->end ||
+				variable_size(var) > vs->end - off) {
+			fprintf(stderr, "Invalid variable at offset 0x%zx "
+					"in %s\n", off, vs->filename);
+			return -1;
+		}
+	}
+
+	vs->free = off < vs->end ? off : vs->end;
+	varstore_resolve_transitions(vs);
+	return 0;
+}
+
+static struct auth_variable_header *varstore_find(struct varstore *vs,
+		const char *name, const EFI_GUID *guid)
+{
+	struct auth_variable_header *var;
+	size_t off;
+
+	for (off = vs->start; off < vs->free;
+			off = variable_align(off + variable_size(var))) {
+		var = variable_at(vs, off);
+
+		if (!variable_valid(var))
+			continue;
+
+		if (memcmp(&var->vendor_guid, guid, sizeof(*guid)) ||
+				!variable_name_match(var, name))
+			continue;
+
+		return var;
+	}
+
+	return NULL;
+}
+
+/* the space used by variables that would be kept by a reclaim */
+static size_t varstore_live_size(struct varstore *vs)
+{
+	struct auth_variable_header *var;
+	size_t off, len, live;
+
+	for (off = vs->start, live = 0; off < vs->free; off += len) {
+		var = variable_at(vs, off);
+		len = variable_align(variable_size(var));
+		if (variable_valid(var))
+			live += len;
+	}
+
+	return live;
+}
+
+/* drop deleted variables, to make room for new ones */
+static void varstore_reclaim(struct varstore *vs)
+{
+	struct auth_variable_header *var;
+	size_t off, dst, len;
+
+	for (off = dst = vs->start; off < vs->free; off += len) {
+		var = variable_at(vs, off);
+		len = variable_align(variable_size(var));
+		if (off + len > vs->free)
+			len = vs->free - off;
+
+		if (!variable_valid(var))
+			continue;
+
+		var->state = VAR_ADDED;
+		memmove(vs->buf + dst, var, len);
+		dst += len;
+	}
+
+	memset(vs->buf + dst, 0xff, vs->end - dst);
+	vs->free = dst;
+}
+
+struct varstore *varstore_open(void *ctx, const char *filename)
+{
+	struct variable_store_header *vsh;
+	struct fv_header *fvh;
+	struct varstore *vs;
+	uint16_t sum, hdr_len;
+	uint32_t store_size;
+	unsigned int i;
+
+	vs = talloc_zero(ctx, struct varstore);
+	vs->filename = talloc_strdup(vs, filename);
+
+	if (fileio_read_file(vs, filename, &vs->buf, &vs->size))
+		goto err;
+
+	fvh = (void *)vs->buf;
+	if (vs->size < sizeof(*fvh) ||
+			le32_to_cpu(fvh->signature) != EFI_FVH_SIGNATURE ||
+			memcmp(&fvh->fs_guid, &fv_nv_guid, sizeof(EFI_GUID))) {
+		fprintf(stderr, "%s is not an NV variable store firmware "
+				"volume\n", filename);
+		goto err;
+	}
+
+	hdr_len = le16_to_cpu(fvh->header_length);
+	if (hdr_len < sizeof(*fvh) || hdr_len % 2 ||
+			hdr_len + sizeof(*vsh) > vs->size ||
+			le64_to_cpu(fvh->length) > vs->size) {
+		fprintf(stderr, "Invalid firmware volume header in %s\n",
+				filename);
+		goto err;
+	}
+
+	for (sum = 0, i = 0; i < hdr_len; i += 2)
+		sum += vs->buf[i] | vs->buf[i + 1] << 8;
+
+	if (sum) {
+		fprintf(stderr, "Invalid firmware volume header checksum "
+				"in %s\n", filename);
+		goto err;
+	}
+
+	vsh = (void *)(vs->buf + hdr_len);
+	store_size = le32_to_cpu(vsh->size);
+
+	if (memcmp(&vsh->signature, &auth_var_guid, sizeof(EFI_GUID))) {
+		fprintf(stderr, "%s doesn't contain an authenticated "
+				"variable store\n", filename);
+		goto err;
+	}
+
+	if (vsh->format != VARIABLE_STORE_FORMATTED ||
+			vsh->state != VARIABLE_STORE_HEALTHY ||
+			store_size < sizeof(*vsh) ||
+			store_size > vs->size - hdr_len) {
+		fprintf(stderr, "Invalid variable store header in %s\n",
+				filename);
+		goto err;
+	}
+
+	vs->start = variable_align(hdr_len + sizeof(*vsh));
+	vs->end = hdr_len + store_size;
+
+	if (varstore_scan(vs))
+		goto err;
+
+	return vs;
+
+err:
+	talloc_free(vs);
+	return NULL;
+}
+
+int varstore_get_variable(struct varstore *vs, void *ctx, const char *name,
+		const EFI_GUID *guid, uint8_t **data, size_t *len)
+{
+	struct auth_variable_header *var;
+
+	var = varstore_find(vs, name, guid);
+	if (!var)
+		return -1;
+
+	*len = le32_to_cpu(var->data_size);
+	*data = talloc_memdup(ctx, variable_data(var), *len);
+
+	return 0;
+}
+
+static bool sigdb_contains(const uint8_t *db, size_t db_len,
+		const EFI_SIGNATURE_LIST *new_list, const uint8_t *sig)
+{
+	const EFI_SIGNATURE_LIST *siglist;
+	size_t i, j;
+
+	for (i = 0; i + sizeof(*siglist) <= db_len;
+			i += siglist->SignatureListSize) {
+		siglist = (const void *)(db + i);
+
+		if (siglist->SignatureListSize < sizeof(*siglist) ||
+				siglist->SignatureListSize > db_len - i)
+			break;
+
+		if (memcmp(&siglist->SignatureType, &new_list->SignatureType,
+					sizeof(EFI_GUID)) ||
+				siglist->SignatureSize !=
+					new_list->SignatureSize ||
+				!siglist->SignatureSize)
+			continue;
+
+		for (j = sizeof(*siglist) + siglist->SignatureHeaderSize;
+				j + siglist->SignatureSize <=
+					siglist->SignatureListSize;
+				j += siglist->SignatureSize)
+			if (!memcmp(db + i + j, sig, siglist->SignatureSize))
+				return true;
+	}
+
+	return false;
+}
+
+/* As firmware does for appends to signature databases, drop any
+ * EFI_SIGNATURE_DATA entries from the new lists that are already present.
+ * Returns the length of the filtered lists, which are written to out. */
+static size_t sigdb_filter(const uint8_t *db, size_t db_len,
+		const uint8_t *data, size_t len, uint8_t *out)
+{
+	const EFI_SIGNATURE_LIST *siglist;
+	EFI_SIGNATURE_LIST *out_list;
+	size_t i, j, hdr_len, out_len;
+
+	out_len = 0;
+
+	for (i = 0; i + sizeof(*siglist) <= len;
+			i += siglist->SignatureListSize) {
+		siglist = (const void *)(data + i);
+
+		/* not a signature list: append it unchanged */
+		if (siglist->SignatureListSize < sizeof(*siglist) ||
+				siglist->SignatureListSize > len - i ||
+				siglist->SignatureHeaderSize >
+					siglist->SignatureListSize -
+						sizeof(*siglist) ||
+				!siglist->SignatureSize) {
+			memcpy(out + out_len, data + i, len - i);
+			return out_len + len - i;
+		}
+
+		hdr_len = sizeof(*siglist) + siglist->SignatureHeaderSize;
+		out_list = (void *)(out + out_len);
+		memcpy(out_list, siglist, hdr_len);
+		out_list->SignatureListSize = hdr_len;
+
+		for (j = hdr_len; j + siglist->SignatureSize <=
+					siglist->SignatureListSize;
+				j += siglist->SignatureSize) {
+			if (sigdb_contains(db, db_len, siglist, data + i + j))
+				continue;
+			memcpy(out + out_len + out_list->SignatureListSize,
+					data + i + j, siglist->SignatureSize);
+			out_list->SignatureListSize += siglist->SignatureSize;
+		}
+
+		if (out_list->SignatureListSize > hdr_len)
+			out_len += out_list->SignatureListSize;
+	}
+
+	if (i < len) {
+		memcpy(out + out_len, data + i, len - i);
+		out_len += len - i;
+	}
+
+	return out_len;
+}
+
+static int time_cmp(const EFI_TIME *a, const EFI_TIME *b)
+{
+	if (a->Year != b->Year)
+		return a->Year - b->Year;
+	if (a->Month != b->Month)
+		return a->Month - b->Month;
+	if (a->Day != b->Day)
+		return a->Day - b->Day;
+	if (a->Hour != b->Hour)
+		return a->Hour - b->Hour;
+	if (a->Minute != b->Minute)
+		return a->Minute - b->Minute;
+	return a->Second - b->Second;
+}
+
+int varstore_set_variable(struct varstore *vs, const char *name,
+		const EFI_GUID *guid, uint32_t attributes,
+		const EFI_TIME *timestamp, const uint8_t *data, size_t len)
+{
+	struct auth_variable_header *old, *var;
+	size_t name_size, data_size, old_size, size, i;
+	uint8_t *buf, *p;
+	EFI_TIME time, old_time;
+	uint8_t old_state;
+	bool append;
+
+	append = attributes & EFI_VARIABLE_APPEND_WRITE;
+	attributes &= ~EFI_VARIABLE_APPEND_WRITE;
+
+	old = varstore_find(vs, name, guid);
+	old_size = old ? le32_to_cpu(old->data_size) : 0;
+	time = *timestamp;
+
+	/* build the new variable contents separately, as a reclaim may
+	 * move the old copy */
+	buf = talloc_array(vs, uint8_t, old_size + len + 1);
+
+	if (append && old) {
+		memcpy(buf, variable_data(old), old_size);
+		data_size = old_size + sigdb_filter(variable_data(old),
+				old_size, data, len, buf + old_size);
+
+		/* firmware keeps the later of the two timestamps */
+		old_time = old->timestamp;
+		if (time_cmp(&old_time, &time) > 0)
+			time = old_time;
+
+		/* nothing new to add */
+		if (data_size == old_size &&
+				!memcmp(&time, &old_time, sizeof(time))) {
+			talloc_free(buf);
+			return 0;
+		}
+	} else {
+		memcpy(buf, data, len);
+		data_size = len;
+	}
+
+	name_size = (strlen(name) + 1) * 2;
+	size = sizeof(*var) + name_size + data_size;
+
+	old_state = old ? old->state : 0;
+	if (old)
+		old->state &= VAR_IN_DELETED_TRANSITION & VAR_DELETED;
+
+	if (variable_align(vs->free) + size > vs->end) {
+		if (vs->start + varstore_live_size(vs) + size > vs->end) {
+			fprintf(stderr, "No space for variable %s in %s\n",
+					name, vs->filename);
+			if (old)
+				old->state = old_state;
+			talloc_free(buf);
+			return -1;
+		}
+		varstore_reclaim(vs);
+	}
+
+	vs->free = variable_align(vs->free);
+	var = variable_at(vs, vs->free);
+
+	memset(var, 0, sizeof(*var));
+	var->start_id = cpu_to_le16(VARIABLE_DATA);
+	var->state = VAR_ADDED;
+	var->attributes = cpu_to_le32(attributes);
+	var->timestamp = time;
+	var->name_size = cpu_to_le32(name_size);
+	var->data_size = cpu_to_le32(data_size);
+	var->vendor_guid = *guid;
+
+	p = variable_name(var);
+	for (i = 0; i < name_size / 2; i++) {
+		p[i * 2] = name[i];
+		p[i * 2 + 1] = 0;
+	}
+
+	memcpy(variable_data(var), buf, data_size);
+	vs->free += size;
+	vs->dirty = true;
+
+	talloc_free(buf);
+	return 0;
+}
+
+int varstore_write(struct varstore *vs)
+{
+	size_t off;
+	ssize_t rc;
+	int fd;
+
+	if (!vs->dirty)
+		return 0;
+
+	/* only the variable area changes: write it in place, so that the
+	 * file keeps its ownership and mode */
+	fd = open(vs->filename, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", vs->filename,
+				strerror(errno));
+		return -1;
+	}
+
+	for (off = vs->start; off < vs->end; off += rc) {
+		rc = pwrite(fd, vs->buf + off, vs->end - off, off);
+		if (rc < 0 && errno == EINTR) {
+			rc = 0;
+			continue;
+		}
+		if (rc <= 0) {
+			fprintf(stderr, "Error writing %s: %s\n",
+					vs->filename, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (fsync(fd) || close(fd)) {
+		fprintf(stderr, "Error writing %s: %s\n", vs->filename,
+				strerror(errno));
+		return -1;
+	}
+
+	vs->dirty = false;
+	return 0;
+}
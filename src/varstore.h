@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#ifndef VARSTORE_H
+#define VARSTORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "efivars.h"
+
+struct varstore;
+
+struct varstore *varstore_open(void *ctx, const char *filename);
+
+/* on success, *data is a talloc-allocated copy of the variable contents,
+ * with ctx as its parent */
+int varstore_get_variable(struct varstore *vs, void *ctx, const char *name,
+		const EFI_GUID *guid, uint8_t **data, size_t *len);
+
+/* update a time-based authenticated variable. With
+ * EFI_VARIABLE_APPEND_WRITE in attributes, data is appended to any
+ * existing contents, otherwise it replaces them */
+int varstore_set_variable(struct varstore *vs, const char *name,
+		const EFI_GUID *guid, uint32_t attributes,
+		const EFI_TIME *timestamp, const uint8_t *data, size_t len);
+
+int varstore_write(struct varstore *vs);
+
+#endif /* VARSTORE_H */
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <ccan/talloc/talloc.h>
+
+#include "workpool.h"
+
+/* where an item's output lies in its worker's output file */
+struct workpool_result {
+	int	worker;
+	off_t	start;
+	off_t	end;
+	int	status;
+};
+
+struct workpool {
+	/* shared with the workers: the next item, then the results */
+	unsigned int		*next;
+	struct workpool_result	*results;
+	size_t			map_size;
+	unsigned int		n_items;
+	int			*fds;
+	unsigned int		n_fds;
+};
+
+static int workpool_destroy(struct workpool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->n_fds; i++)
+		close(pool->fds[i]);
+	munmap(pool->next, pool->map_size);
+	return 0;
+}
+
+static void run_worker(struct workpool *pool, int worker, workpool_fn fn,
+		void *arg)
+{
+	struct workpool_result *result;
+	unsigned int i;
+
+	dup2(pool->fds[worker], STDOUT_FILENO);
+
+	for (;;) {
+		i = __atomic_fetch_add(pool->next, 1, __ATOMIC_RELAXED);
+		if (i >= pool->n_items)
+			break;
+
+		result = &pool->results[i];
+		result->start = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		result->status = fn(arg, i);
+		if (fflush(stdout) || ferror(stdout))
+			_exit(EXIT_FAILURE);
+		result->end = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		result->worker = worker;
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+struct workpool *workpool_run(void *ctx, unsigned int n_items,
+		unsigned int n_workers, workpool_fn fn, void *arg)
+{
+	struct workpool *pool;
+	unsigned int i;
+	void *map;
+	pid_t pid;
+
+	if (n_workers > n_items)
+		n_workers = n_items;
+
+	pool = talloc_zero(ctx, struct workpool);
+	pool->n_items = n_items;
+	pool->map_size = sizeof(*pool->next) +
+		n_items * sizeof(*pool->results);
+
+	map = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		talloc_free(pool);
+		return NULL;
+	}
+	pool->next = map;
+	pool->results = (void *)(pool->next + 1);
+	*pool->next = 0;
+	for (i = 0; i < n_items; i++)
+		pool->results[i].worker = -1;
+
+	pool->fds = talloc_array(pool, int, n_workers);
+	talloc_set_destructor(pool, workpool_destroy);
+	fflush(NULL);
+
+	for (i = 0; i < n_workers; i++) {
+		FILE *fp = tmpfile();
+
+		pool->fds[i] = fp ? dup(fileno(fp)) : -1;
+		if (fp)
+			fclose(fp);
+		if (pool->fds[i] < 0) {
+			perror("tmpfile");
+			break;
+		}
+		pool->n_fds++;
+
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			break;
+		}
+
+		if (!pid)
+			run_worker(pool, i, fn, arg);
+	}
+
+	/* items left by workers that failed are reported as not run */
+	while (wait(NULL) > 0)
+		;
+
+	return pool;
+}
+
+int workpool_status(struct workpool *pool, unsigned int item)
+{
+	if (pool->results[item].worker < 0)
+		return WORKPOOL_NOT_RUN;
+
+	return pool->results[item].status;
+}
+
+void workpool_copy_output(struct workpool *pool, unsigned int item,
+		FILE *out)
+{
+	struct workpool_result *result = &pool->results[item];
+	char buf[4096];
+	off_t off, len;
+	ssize_t rc;
+
+	if (result->worker < 0)
+		return;
+
+	for (off = result->start; off < result->end; off += rc) {
+		len = result->end - off;
+		if (len > (off_t)sizeof(buf))
+			len = sizeof(buf);
+		rc = pread(pool->fds[result->worker], buf, len, off);
+		if (rc <= 0)
+			break;
+		fwrite(buf, 1, rc, out);
+	}
+}
+
+int workpool_parse_jobs(const char *str)
+{
+	char *end;
+	long n;
+
+	/* strtol would accept leading whitespace and signs */
+	if (!isdigit((unsigned char)*str))
+		return -1;
+
+	errno = 0;
+	n = strtol(str, &end, 10);
+	if (errno || *end || n < 1 || n > INT_MAX)
+		return -1;
+
+	return n;
+}
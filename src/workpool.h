@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2012 Jeremy Kerr <jeremy.kerr@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the OpenSSL
+ * library under certain conditions as described in each individual source file,
+ * and distribute linked combinations including the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ */
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <limits.h>
+#include <stdio.h>
+
+/* status of an item that no worker completed */
+#define WORKPOOL_NOT_RUN	INT_MIN
+
+struct workpool;
+
+typedef int (*workpool_fn)(void *arg, unsigned int item);
+
+/*
+ * Process items [0, n_items) with n_workers forked processes, returning
+ * once all of them have exited. Workers take the next item from a shared
+ * counter, so a few slow items don't hold up one worker's whole share,
+ * and call fn(arg, item). Anything fn writes to stdout is captured for
+ * workpool_copy_output(). Returns NULL if the pool can't be set up.
+ */
+struct workpool *workpool_run(void *ctx, unsigned int n_items,
+		unsigned int n_workers, workpool_fn fn, void *arg);
+
+/* fn's return value for item, or WORKPOOL_NOT_RUN if no worker completed
+ * it (or its output couldn't be saved) */
+int workpool_status(struct workpool *pool, unsigned int item);
+
+/* copy the output captured while processing item to out */
+void workpool_copy_output(struct workpool *pool, unsigned int item,
+		FILE *out);
+
+/* parse a number of workers, as given to a --jobs option: returns the
+ * number, or -1 if str isn't a positive integer */
+int workpool_parse_jobs(const char *str);
+
+#endif /* WORKPOOL_H */
@@ -0,0 +1,75 @@
+#!/bin/bash -e
+##
+# Sign and verify a manifest with sbbatch, using several workers and
+# small chunks, and check that the report is complete and in manifest
+# order
+##
+
+for i in $(seq 1 10)
+do
+	cp "$image" "test.$i"
+	printf 'test.%d\ttest.%d.out\n' $i $i >> sign.manifest
+	echo "test.$i.out" >> verify.manifest
+done
+
+"$sbbatch" --sign --cert "$cert" --key "$key" --workers 3 --chunk-size 2 \
+	sign.manifest > sign.report
+[ $(grep -c '	OK	signed$' sign.report) -eq 10 ]
+[ "$(cut -f1 sign.report | tr '\n' ' ')" = "$(seq -s ' ' 1 10) " ]
+
+"$sbverify" --cert "$cert" test.1.out test.10.out
+
+# an unsigned and a missing image fail, without affecting the others
+sed -i -e '3s/.*/test.3/' -e '7s/.*/missing/' verify.manifest
+! "$sbbatch" --verify --cert "$cert" --workers 2 --chunk-size 4 \
+	verify.manifest > verify.report
+[ $(grep -c '	OK	' verify.report) -eq 8 ]
+[ "$(grep '	FAIL	' verify.report | cut -f1 | tr '\n' ' ')" = "3 7 " ]
+[ "$(cut -f2 verify.report | sed -n 7p)" = "missing" ]
+
+# a coordinator with no local workers, served by a separately-started one
+sed -i -e '3d' -e '7d' verify.manifest
+"$sbbatch" --verify --cert "$cert" --workers 0 --socket batch.sock \
+	--report remote.report verify.manifest &
+coordinator=$!
+while [ ! -S batch.sock ]
+do
+	sleep 0.1
+done
+"$sbbatch" --worker --socket batch.sock
+wait $coordinator
+[ $(grep -c '	OK	' remote.report) -eq 8 ]
+
+# sbbatch accepts what sbverify accepts: here, a trusted code-signing
+# certificate whose issuer isn't in the trust store
+openssl req -x509 -sha256 -subj '/CN=root' -new -newkey rsa:2048 -nodes \
+	-keyout root.key -out root.pem 2>/dev/null
+openssl req -sha256 -subj '/CN=leaf' -new -newkey rsa:2048 -nodes \
+	-keyout leaf.key -out leaf.csr 2>/dev/null
+printf 'extendedKeyUsage=codeSigning\n' > leaf.ext
+openssl x509 -req -sha256 -in leaf.csr -CA root.pem -CAkey root.key \
+	-set_serial 2 -extfile leaf.ext -out leaf.pem 2>/dev/null
+"$sbsign" --cert leaf.pem --key leaf.key --output leaf.signed "$image"
+echo leaf.signed > leaf.manifest
+"$sbverify" --cert leaf.pem leaf.signed
+"$sbbatch" --verify --cert leaf.pem --workers 1 leaf.manifest
+
+# counts must be integers; only --workers and --retries may be zero
+! "$sbbatch" --verify --cert leaf.pem --workers 1x leaf.manifest
+! "$sbbatch" --verify --cert leaf.pem --chunk-size 0 leaf.manifest
+! "$sbbatch" --verify --cert leaf.pem --retries -1 leaf.manifest
+"$sbbatch" --verify --cert leaf.pem --workers 1 --retries 0 leaf.manifest
+
+# as with sbverify, a signature that doesn't cover the image fails it,
+# even when a later one verifies
+cp "$image" other.efi
+printf 'trailing' >> other.efi
+"$sbsign" --cert "$cert" --key "$key" --detached --output stale.pk7 other.efi
+"$sbsign" --cert "$cert" --key "$key" --detached --output good.pk7 "$image"
+cp "$image" stale.signed
+"$sbattach" --attach stale.pk7 stale.signed
+"$sbattach" --attach good.pk7 stale.signed
+! "$sbverify" --cert "$cert" stale.signed
+echo stale.signed > stale.manifest
+! "$sbbatch" --verify --cert "$cert" --workers 1 stale.manifest > stale.report
+grep -q '	FAIL	Image fails hash check$' stale.report
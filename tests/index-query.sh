@@ -0,0 +1,91 @@
+#!/bin/bash -e
+##
+# Build a signature index over a small corpus, query it, and check that
+# an update only re-reads the files that have changed
+##
+
+mkdir -p corpus/sub
+cp "$image" corpus/unsigned.efi
+"$sbsign" --cert "$cert" --key "$key" --output corpus/sub/signed.efi "$image"
+echo "not an image" > corpus/notes.txt
+
+"$sbindex" --update index corpus
+
+[ "$("$sbindex" --signed-by "$cert" index | xargs -n1 basename)" = \
+	"signed.efi" ]
+[ "$("$sbindex" --not-signed-by "$cert" index | xargs -n1 basename)" = \
+	"unsigned.efi" ]
+[ "$("$sbindex" --unsigned index | xargs -n1 basename)" = "unsigned.efi" ]
+[ $("$sbindex" --list index | grep -c '^ signatures: ') -eq 2 ]
+
+"$sbsign" --cert "$cert" --key "$key" --output corpus/unsigned.efi \
+	corpus/unsigned.efi
+"$sbindex" --verbose --update index corpus 2>&1 |
+	grep -q '^Indexed 3 files, 1 read, 2 unchanged$'
+[ $("$sbindex" --signed-by "$cert" index | wc -l) -eq 2 ]
+[ -z "$("$sbindex" --unsigned index)" ]
+
+# a signature that doesn't carry its signer's certificate is matched on
+# the signer's issuer and serial: alter the serial of the certificate the
+# signature carries, so it no longer matches the signer info
+mkdir corpus2
+"$sbsign" --cert "$cert" --key "$key" --output corpus2/nocert.efi "$image"
+serial=$(openssl x509 -noout -serial -in "$cert" | cut -d= -f2 |
+	tr A-F a-f)
+hex=$(od -An -tx1 -v corpus2/nocert.efi | tr -d ' \n')
+pos=$(awk -v h="$hex" -v s="$serial" 'BEGIN { print index(h, s) }')
+[ $(($pos % 2)) -eq 1 ]
+off=$((($pos - 1 + ${#serial}) / 2 - 1))
+byte=$(od -An -tu1 -j $off -N1 corpus2/nocert.efi)
+printf "$(printf '\\x%02x' $(($byte ^ 0xff)))" |
+	dd of=corpus2/nocert.efi bs=1 seek=$off conv=notrunc 2>/dev/null
+
+"$sbindex" --update index2 corpus2
+"$sbindex" --list index2 | grep -q '(certificate not in signature)'
+[ "$("$sbindex" --signed-by "$cert" index2 | xargs -n1 basename)" = \
+	"nocert.efi" ]
+[ -z "$("$sbindex" --not-signed-by "$cert" index2)" ]
+
+# an index whose contents point outside their columns is rejected
+function header_u32() {
+	od -An -tu4 -j $2 -N 4 "$1" | tr -d ' '
+}
+function header_u64() {
+	od -An -tu8 -j $2 -N 8 "$1" | tr -d ' '
+}
+function patch_u32() {
+	printf "$(printf '\\x%02x\\x%02x\\x%02x\\x%02x' \
+		$(($3 & 0xff)) $(($3 >> 8 & 0xff)) \
+		$(($3 >> 16 & 0xff)) $(($3 >> 24 & 0xff)))" |
+		dd of="$1" bs=1 seek=$2 conv=notrunc 2>/dev/null
+}
+
+n_signers=$(header_u32 index 16)
+strtab_size=$(header_u32 index 20)
+path_col=$(header_u64 index $((24 + 4 * 8)))
+signer_start_col=$(header_u64 index $((24 + 8 * 8)))
+strtab_col=$(header_u64 index $((24 + 13 * 8)))
+
+cp index bad-path
+patch_u32 bad-path $path_col $strtab_size
+"$sbindex" --list bad-path 2>&1 | grep -q "^Invalid index bad-path"
+! "$sbindex" --list bad-path >/dev/null 2>&1
+
+cp index bad-strtab
+printf 'x' | dd of=bad-strtab bs=1 seek=$(($strtab_col + $strtab_size - 1)) \
+	conv=notrunc 2>/dev/null
+! "$sbindex" --list bad-strtab >/dev/null 2>&1
+
+cp index bad-start
+patch_u32 bad-start $(($signer_start_col + 4)) $(($n_signers + 1))
+! "$sbindex" --list bad-start >/dev/null 2>&1
+
+cp index bad-order
+patch_u32 bad-order $(($signer_start_col + 4)) $n_signers
+patch_u32 bad-order $(($signer_start_col + 8)) 0
+! "$sbindex" --list bad-order >/dev/null 2>&1
+
+"$sbindex" --list index >/dev/null
+
+! "$sbindex" --update --jobs 0 index corpus
+! "$sbindex" --update --jobs 1x index corpus
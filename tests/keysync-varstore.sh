@@ -0,0 +1,196 @@
+#!/bin/bash -e
+##
+# Provision keys into edk2 variable store files, and check that they're
+# read back from the store on the next sync.
+##
+
+owner=12345678-1234-1234-1234-123456789012
+
+# a blank OVMF-style store: the NV firmware volume header, an empty
+# authenticated variable store header, and erased (0xff) flash
+function blank_varstore()
+{
+	printf '\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00'
+	printf '\x8d\x2b\xf1\xff\x96\x76\x8b\x4c\xa9\x85\x27\x47\x07\x5b\x4f\x50'
+	printf '\x00\x00\x01\x00\x00\x00\x00\x00\x5f\x46\x56\x48\xff\xfe\x04\x00'
+	printf '\x48\x00\x2a\xf9\x00\x00\x00\x02\x10\x00\x00\x00\x00\x10\x00\x00'
+	printf '\x00\x00\x00\x00\x00\x00\x00\x00\x78\x2c\xf3\xaa\x7b\x94\x9a\x43'
+	printf '\xa1\x80\x2e\x14\x4e\xc3\x77\x92\xb8\xdf\x00\x00\x5a\xfe\x00\x00'
+	printf '\x00\x00\x00\x00'
+	head -c $((0x10000 - 100)) /dev/zero | tr '\0' '\377'
+}
+
+# add_key <db> <name>: create a signed update for <db> in the keystore,
+# from a new certificate with subject CN=<name>
+function add_key()
+{
+	mkdir -p keys/$1
+	openssl req -x509 -sha256 -subj "/CN=$2" -new -key "$key" \
+		-outform DER -out $2.der
+	"$sbsiglist" --owner $owner --type x509 --output $2.esl $2.der
+	"$sbvarsign" --key "$key" --cert "$cert" --output keys/$1/$2.auth \
+		$1 $2.esl
+}
+
+# set_timestamp <auth> <year> <month> <day>: change the timestamp of a
+# signed update. Its signature isn't checked when writing to a store.
+function set_timestamp()
+{
+	printf "$(printf '\\x%02x\\x%02x\\x%02x\\x%02x' \
+		$(($2 & 0xff)) $(($2 >> 8)) $3 $4)" |
+		dd of=$1 bs=1 conv=notrunc 2>/dev/null
+}
+
+# has_timestamp <store> <year> <month> <day>: check whether any variable
+# in <store> carries this timestamp
+function has_timestamp()
+{
+	od -An -tx1 -v $1 | tr -d ' \n' |
+		grep -q $(printf '%02x%02x%02x%02x' \
+			$(($2 & 0xff)) $(($2 >> 8)) $3 $4)
+}
+
+# set_store_size <store> <size>: shrink the variable store within the
+# firmware volume
+function set_store_size()
+{
+	printf "$(printf '\\x%02x\\x%02x\\x%02x\\x%02x' \
+		$(($2 & 0xff)) $(($2 >> 8 & 0xff)) \
+		$(($2 >> 16 & 0xff)) $(($2 >> 24 & 0xff)))" |
+		dd of=$1 bs=1 seek=$((0x58)) conv=notrunc 2>/dev/null
+}
+
+# keys <store> <db>: list the firmware keys in <db> of <store>
+function keys()
+{
+	"$sbkeysync" --no-default-keystores --keystore keys --dry-run \
+		--verbose --varstore $1 |
+		sed -n '/^firmware keys:/,/^filesystem keys:/p' |
+		sed -n "/^  $2:/,/^  [^ ]/s/^    //p"
+}
+
+blank_varstore > vars.fd
+
+add_key KEK kek1
+add_key db db1
+"$sbkeysync" --no-default-keystores --keystore keys --varstore vars.fd
+
+[ "$(keys vars.fd KEK)" = "/CN=kek1" ]
+[ "$(keys vars.fd db)" = "/CN=db1" ]
+
+# syncing again doesn't change the store
+cp vars.fd vars.fd.orig
+"$sbkeysync" --no-default-keystores --keystore keys --varstore vars.fd
+cmp vars.fd vars.fd.orig
+
+# new db keys are appended to the existing db
+add_key db db2
+"$sbkeysync" --no-default-keystores --keystore keys --varstore vars.fd
+[ "$(keys vars.fd db | sort | tr '\n' ' ')" = "/CN=db1 /CN=db2 " ]
+
+# stamp several stores in parallel
+for i in 1 2 3
+do
+	blank_varstore > batch$i.fd
+done
+"$sbkeysync" --no-default-keystores --keystore keys --jobs 2 \
+	--varstore batch1.fd --varstore batch2.fd --varstore batch3.fd
+
+for i in 1 2 3
+do
+	[ "$(keys batch$i.fd KEK)" = "/CN=kek1" ]
+	[ "$(keys batch$i.fd db | sort | tr '\n' ' ')" = "/CN=db1 /CN=db2 " ]
+done
+
+# anything else isn't touched
+head -c 4096 /dev/zero > notvars.fd
+! "$sbkeysync" --no-default-keystores --keystore keys --varstore notvars.fd
+cmp notvars.fd <(head -c 4096 /dev/zero)
+
+# a store given twice, under any name, is rejected without being touched
+cp batch1.fd batch1.fd.orig
+! "$sbkeysync" --no-default-keystores --keystore keys --jobs 2 \
+	--varstore batch1.fd --varstore ./batch1.fd
+cmp batch1.fd batch1.fd.orig
+
+# as are job counts that aren't positive integers
+for jobs in 0 -1 2x ''
+do
+	! "$sbkeysync" --no-default-keystores --keystore keys \
+		--jobs "$jobs" --varstore batch1.fd
+done
+
+function sync()
+{
+	"$sbkeysync" --no-default-keystores --keystore keys "$@"
+}
+
+# a new PK replaces the old one, rather than being appended
+rm -rf keys
+blank_varstore > pk.fd
+add_key PK pk1
+sync --pk --varstore pk.fd
+[ "$(keys pk.fd PK)" = "/CN=pk1" ]
+rm keys/PK/pk1.auth
+add_key PK pk2
+sync --pk --varstore pk.fd
+[ "$(keys pk.fd PK)" = "/CN=pk2" ]
+
+# an update carrying keys that are already present only adds the new ones
+rm -rf keys
+blank_varstore > overlap.fd
+add_key db db1
+sync --varstore overlap.fd
+add_key db db3
+rm keys/db/db3.auth
+cat db1.esl db3.esl > db13.esl
+"$sbvarsign" --key "$key" --cert "$cert" --output keys/db/db13.auth \
+	db db13.esl
+sync --varstore overlap.fd
+[ "$(keys overlap.fd db | sort | tr '\n' ' ')" = "/CN=db1 /CN=db3 " ]
+
+# appends keep the later of the existing and new timestamps
+rm -rf keys
+blank_varstore > time.fd
+add_key db db1
+set_timestamp keys/db/db1.auth 2030 6 15
+sync --varstore time.fd
+add_key db db2
+set_timestamp keys/db/db2.auth 2001 2 3
+sync --varstore time.fd
+has_timestamp time.fd 2030 6 15
+! has_timestamp time.fd 2001 2 3
+add_key db db3
+set_timestamp keys/db/db3.auth 2031 1 1
+sync --varstore time.fd
+has_timestamp time.fd 2031 1 1
+[ "$(keys time.fd db | sort | tr '\n' ' ')" = "/CN=db1 /CN=db2 /CN=db3 " ]
+
+# in a small store, each db update (about 800 bytes per certificate) is
+# written after the last, until the space held by replaced copies has to
+# be reclaimed
+rm -rf keys
+blank_varstore > small.fd
+set_store_size small.fd 4000
+add_key KEK kek1
+add_key db db1
+sync --varstore small.fd
+add_key db db2
+sync --varstore small.fd
+add_key db db3
+sync --varstore small.fd
+[ "$(keys small.fd KEK)" = "/CN=kek1" ]
+[ "$(keys small.fd db | sort | tr '\n' ' ')" = "/CN=db1 /CN=db2 /CN=db3 " ]
+
+# once the live variables don't fit, the whole sync fails, leaving the
+# store unchanged even though the smaller dbx update would fit
+cp small.fd small.fd.orig
+add_key db db4
+mkdir -p keys/dbx
+head -c 32 /dev/urandom > hash.bin
+"$sbsiglist" --owner $owner --type sha256 --output hash.esl hash.bin
+"$sbvarsign" --key "$key" --cert "$cert" --output keys/dbx/hash.auth \
+	dbx hash.esl
+! sync --varstore small.fd 2> sync.err
+grep -qx 'No space for variable db in small.fd' sync.err
+cmp small.fd small.fd.orig
@@ -0,0 +1,41 @@
+#!/bin/bash -e
+##
+# Pruning keeps a signature whose signer chains to a trusted certificate
+# through an intermediate carried in the signature
+##
+
+signed="test.signed"
+
+openssl req -x509 -sha256 -subj '/CN=root' -new -newkey rsa:2048 -nodes \
+	-keyout root.key -out root.pem 2>/dev/null
+openssl req -sha256 -subj '/CN=intermediate' -new -newkey rsa:2048 -nodes \
+	-keyout intermediate.key -out intermediate.csr 2>/dev/null
+printf 'basicConstraints=critical,CA:TRUE\nkeyUsage=keyCertSign\n' \
+	> intermediate.ext
+openssl x509 -req -sha256 -in intermediate.csr -CA root.pem \
+	-CAkey root.key -set_serial 2 -extfile intermediate.ext \
+	-out intermediate.pem 2>/dev/null
+openssl req -sha256 -subj '/CN=leaf' -new -newkey rsa:2048 -nodes \
+	-keyout leaf.key -out leaf.csr 2>/dev/null
+printf 'extendedKeyUsage=codeSigning\n' > leaf.ext
+openssl x509 -req -sha256 -in leaf.csr -CA intermediate.pem \
+	-CAkey intermediate.key -set_serial 3 -extfile leaf.ext \
+	-out leaf.pem 2>/dev/null
+
+# one signature that chains to root, and one that doesn't
+"$sbsign" --cert leaf.pem --addcert intermediate.pem --key leaf.key \
+	--output "$signed" "$image"
+"$sbsign" --cert "$cert" --key "$key" --output "$signed" "$signed"
+"$sbverify" --cert root.pem "$signed"
+
+"$sbattach" --prune --cert root.pem "$signed" |
+	grep '^Pruned 1 of 2 signatures'
+
+[ $("$sbverify" --list "$signed" | grep -c '^signature') -eq 1 ]
+"$sbverify" --cert root.pem "$signed"
+! "$sbverify" --cert "$cert" "$signed"
+
+# without the intermediate, the leaf's signature can't be trusted
+"$sbsign" --cert leaf.pem --key leaf.key --output "$signed" "$image"
+"$sbattach" --prune --cert root.pem "$signed"
+[ $("$sbverify" --list "$signed" | grep -c '^signature') -eq 0 ]
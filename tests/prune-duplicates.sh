@@ -0,0 +1,36 @@
+#!/bin/bash -e
+##
+# Pruning an image carrying two signatures by the same certificate
+# should leave a single, valid, signature
+##
+
+signed="test.signed"
+
+"$sbsign" --cert "$cert" --key "$key" --output "$signed" "$image"
+"$sbsign" --cert "$cert" --key "$key" --output "$signed" "$signed"
+[ $("$sbverify" --list "$signed" | grep -c '^signature') -eq 2 ]
+
+"$sbattach" --prune --cert "$cert" "$signed" | grep '^Pruned 1 of 2 signatures'
+
+[ $("$sbverify" --list "$signed" | grep -c '^signature') -eq 1 ]
+"$sbverify" --cert "$cert" "$signed"
+
+# a signature that doesn't verify must not stand for its signer, even
+# when it comes first
+"$sbsign" --cert "$cert" --key "$key" --detached --output good.pk7 "$image"
+cp good.pk7 bad.pk7
+last=$(($(stat -c %s bad.pk7) - 1))
+byte=$(od -An -tu1 -j $last -N1 bad.pk7)
+printf "$(printf '\\x%02x' $(($byte ^ 0xff)))" |
+	dd of=bad.pk7 bs=1 seek=$last conv=notrunc 2>/dev/null
+
+cp "$image" mixed.signed
+"$sbattach" --attach bad.pk7 mixed.signed
+"$sbattach" --attach good.pk7 mixed.signed
+"$sbverify" --cert "$cert" mixed.signed
+
+"$sbattach" --prune --cert "$cert" mixed.signed |
+	grep '^Pruned 1 of 2 signatures'
+"$sbverify" --cert "$cert" mixed.signed
+"$sbattach" --detach kept.pk7 mixed.signed
+cmp kept.pk7 good.pk7
@@ -0,0 +1,33 @@
+#!/bin/bash -e
+##
+# Re-signing with --if-unsigned-by must not add a second signature by
+# the same certificate
+##
+
+signed="test.signed"
+resigned="test.resigned"
+
+"$sbsign" --cert "$cert" --key "$key" --output "$signed" "$image"
+"$sbsign" --if-unsigned-by --cert "$cert" --key "$key" \
+	--output "$resigned" "$signed" 2>&1 |
+	grep '^Image is already signed by this certificate'
+
+[ $("$sbverify" --list "$resigned" | grep -c '^signature') -eq 1 ]
+"$sbverify" --cert "$cert" "$resigned"
+
+# a signature by the certificate that doesn't verify is replaced
+"$sbsign" --cert "$cert" --key "$key" --detached --output bad.pk7 "$image"
+last=$(($(stat -c %s bad.pk7) - 1))
+byte=$(od -An -tu1 -j $last -N1 bad.pk7)
+printf "$(printf '\\x%02x' $(($byte ^ 0xff)))" |
+	dd of=bad.pk7 bs=1 seek=$last conv=notrunc 2>/dev/null
+
+cp "$image" corrupt.signed
+"$sbattach" --attach bad.pk7 corrupt.signed
+! "$sbverify" --cert "$cert" corrupt.signed
+"$sbsign" --if-unsigned-by --cert "$cert" --key "$key" \
+	--output "$resigned" corrupt.signed 2>&1 |
+	grep '^Replacing stale signature 1 by this certificate'
+
+[ $("$sbverify" --list "$resigned" | grep -c '^signature') -eq 1 ]
+"$sbverify" --cert "$cert" "$resigned"
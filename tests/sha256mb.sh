@@ -0,0 +1,7 @@
+#!/bin/bash -e
+##
+# Check the multi-buffer SHA-256 implementation against OpenSSL over a
+# small corpus of varying-sized images
+##
+
+"$bindir/sha256mb-bench" -n 67 -i 1 -s 0 -S 64
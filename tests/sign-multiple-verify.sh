@@ -0,0 +1,21 @@
+#!/bin/bash -e
+##
+# Sign several images in one sbsign invocation, so that the signatures
+# are built from a pre-encoded skeleton, and verify each of them
+##
+
+for i in 1 2 3
+do
+	cp "$image" "test.$i"
+done
+
+"$sbsign" --cert "$cert" --key "$key" test.1 test.2 test.3
+"$sbverify" --cert "$cert" test.1.signed test.2.signed test.3.signed
+
+"$sbsign" --cert "$cert" --key "$key" --detached test.1 test.2 test.3
+for i in 1 2 3
+do
+	"$sbverify" --cert "$cert" --detached "test.$i.pk7" "test.$i"
+done
+
+! "$sbsign" --cert "$cert" --key "$key" --output test.signed test.1 test.2
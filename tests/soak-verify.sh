@@ -0,0 +1,71 @@
+#!/bin/bash -e
+##
+# Soak test: verifying or signing a large batch of images in one process
+# should run in constant memory. Compare the peak RSS of a small and a
+# large batch; any per-image leak shows up as growth in the latter.
+##
+
+time=$(type -P time || true)
+if [ -z "$time" ] || ! "$time" -f %M true >/dev/null 2>&1
+then
+	echo "GNU time not available, skipping soak test"
+	exit 0
+fi
+
+signed="test.signed"
+small=200
+large=8200
+# peak RSS is only reported in kB pages, and varies by a few hundred kB
+# from run to run; anything retained per image is at least one
+# allocation, so this still catches the smallest leak
+max_growth_per_image=64
+
+"$sbsign" --cert "$cert" --key "$key" --output "$signed" "$image"
+"$sbsign" --cert "$cert" --key "$key" --output "$signed" "$signed"
+
+function peak_rss() {
+	count=$1
+	input=$2
+	shift 2
+	images=$(for (( i = 0; $i < $count; i++ )); do echo "$input"; done)
+	"$time" -f %M -o rss.out "$@" $images >/dev/null 2>&1
+	cat rss.out
+}
+
+function soak() {
+	name=$1
+	shift
+	rss_small=$(peak_rss $small "$@")
+	rss_large=$(peak_rss $large "$@")
+
+	echo "$name peak RSS: $small images: ${rss_small}kB," \
+		"$large images: ${rss_large}kB"
+
+	[ $((($rss_large - $rss_small) * 1024)) -le \
+		$((($large - $small) * $max_growth_per_image)) ]
+}
+
+soak verify "$signed" "$sbverify" --cert "$cert"
+soak sign "$image" "$sbsign" --cert "$cert" --key "$key"
+soak sign-if-unsigned-by "$signed" \
+	"$sbsign" --if-unsigned-by --cert "$cert" --key "$key"
+
+# sbattach handles a single image per process, so check its attach,
+# detach and prune paths for leaks directly where valgrind is available
+if ! type -P valgrind >/dev/null
+then
+	echo "valgrind not available, skipping sbattach leak checks"
+	exit 0
+fi
+
+function leak_check() {
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite \
+		--error-exitcode=2 "$@" >/dev/null
+}
+
+"$sbsign" --cert "$cert" --key "$key" --detached --output test.pk7 "$image"
+cp "$signed" attach.signed
+leak_check "$sbattach" --attach test.pk7 attach.signed
+leak_check "$sbattach" --detach detached.pk7 attach.signed
+leak_check "$sbattach" --prune --cert "$cert" attach.signed
+leak_check "$sbattach" --remove attach.signed
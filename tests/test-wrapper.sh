@@ -8,11 +8,17 @@ bindir="$datadir/../src"
 sbsign=$bindir/sbsign
 sbverify=$bindir/sbverify
 sbattach=$bindir/sbattach
+sbsiglist=$bindir/sbsiglist
+sbbatch=$bindir/sbbatch
+sbindex=$bindir/sbindex
+sbvarsign=$bindir/sbvarsign
+sbkeysync=$bindir/sbkeysync
 
 key="$datadir/private-key.rsa"
 cert="$datadir/public-cert.pem"
 
-export basedir datadir bindir sbsign sbverify sbattach key cert
+export basedir datadir bindir sbsign sbverify sbattach sbsiglist sbbatch \
+	sbindex sbvarsign sbkeysync key cert
 
 # 'test' needs to be an absolute path, as we will cd to a temporary
 # directory before running the test
@@ -0,0 +1,38 @@
+#!/bin/bash -e
+##
+# Chain validation results are cached across a batch of images, but each
+# image's chain is built from the intermediates it carries itself: an
+# image signed by the same leaf without its intermediate must fail,
+# whichever order the images are given in
+##
+
+openssl req -x509 -sha256 -subj '/CN=root' -new -newkey rsa:2048 -nodes \
+	-keyout root.key -out root.pem 2>/dev/null
+openssl req -sha256 -subj '/CN=intermediate' -new -newkey rsa:2048 -nodes \
+	-keyout intermediate.key -out intermediate.csr 2>/dev/null
+printf 'basicConstraints=critical,CA:TRUE\nkeyUsage=keyCertSign\n' \
+	> intermediate.ext
+openssl x509 -req -sha256 -in intermediate.csr -CA root.pem \
+	-CAkey root.key -set_serial 2 -extfile intermediate.ext \
+	-out intermediate.pem 2>/dev/null
+openssl req -sha256 -subj '/CN=leaf' -new -newkey rsa:2048 -nodes \
+	-keyout leaf.key -out leaf.csr 2>/dev/null
+printf 'extendedKeyUsage=codeSigning\n' > leaf.ext
+openssl x509 -req -sha256 -in leaf.csr -CA intermediate.pem \
+	-CAkey intermediate.key -set_serial 3 -extfile leaf.ext \
+	-out leaf.pem 2>/dev/null
+
+"$sbsign" --cert leaf.pem --key leaf.key --output leaf-only.signed "$image"
+"$sbsign" --cert leaf.pem --addcert intermediate.pem --key leaf.key \
+	--output chained.signed "$image"
+
+! "$sbverify" --cert root.pem leaf-only.signed
+"$sbverify" --cert root.pem chained.signed
+
+for order in "chained.signed leaf-only.signed" \
+		"leaf-only.signed chained.signed"
+do
+	! "$sbverify" --cert root.pem $order > result
+	grep -qx 'chained.signed: Signature verification OK' result
+	grep -qx 'leaf-only.signed: Signature verification failed' result
+done
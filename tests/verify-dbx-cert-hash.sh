@@ -0,0 +1,70 @@
+#!/bin/bash -e
+##
+# A certificate revoked by its TBS hash (EFI_CERT_X509_SHA{256,384,512})
+# in dbx should cause verification to fail. Check the layout of each
+# hash list type, against a TBS hash computed without sbsiglist.
+##
+
+signed="test.signed"
+der="test.der"
+dbx="test.dbx"
+owner=00000000-0000-0000-0000-000000000000
+
+"$sbsign" --cert "$cert" --key "$key" --output "$signed" "$image"
+
+openssl x509 -in "$cert" -outform DER -out "$der"
+"$sbsiglist" --owner $owner --type x509-sha256 --output "$dbx" "$der"
+
+# EFI_SIGNATURE_LIST (28) + owner GUID (16) + hash (32) + EFI_TIME (16)
+[ $(stat --format=%s "$dbx") -eq 92 ]
+
+"$sbverify" --cert "$cert" "$signed"
+! "$sbverify" --cert "$cert" --dbx "$dbx" "$signed"
+
+# the TBSCertificate is the first element of the certificate
+tbs_offset=$(openssl asn1parse -inform DER -in "$der" |
+	sed -n '2s/^ *\([0-9]*\):.*/\1/p')
+openssl asn1parse -inform DER -in "$der" -strparse $tbs_offset \
+	-noout -out tbs.der
+
+function u32() {
+	od -An -tu4 -j $2 -N 4 "$1" | tr -d ' '
+}
+function hex() {
+	od -An -tx1 -v | tr -d ' \n'
+}
+function bytes() {
+	hex < <(tail -c +$(($2 + 1)) "$1" | head -c $3)
+}
+
+# check_list <file> <data size>: a single list, holding a single entry
+function check_list() {
+	sig_size=$((16 + $2))
+	[ $(stat --format=%s "$1") -eq $((28 + $sig_size)) ]
+	[ $(u32 "$1" 16) -eq $((28 + $sig_size)) ]	# ListSize
+	[ $(u32 "$1" 20) -eq 0 ]			# HeaderSize
+	[ $(u32 "$1" 24) -eq $sig_size ]		# SignatureSize
+}
+
+for bits in 256 384 512
+do
+	len=$(($bits / 8))
+
+	"$sbsiglist" --owner $owner --type x509-sha$bits \
+		--output x509-sha$bits.dbx "$der"
+	check_list x509-sha$bits.dbx $(($len + 16))
+	[ "$(bytes x509-sha$bits.dbx 44 $len)" = \
+		"$(openssl dgst -sha$bits -binary tbs.der | hex)" ]
+	# a zero EFI_TIME revokes the certificate for all time
+	[ "$(bytes x509-sha$bits.dbx $((44 + $len)) 16)" = \
+		"$(head -c 16 /dev/zero | hex)" ]
+	! "$sbverify" --cert "$cert" --dbx x509-sha$bits.dbx "$signed"
+
+	# an image hash that isn't this image's doesn't revoke it
+	head -c $len /dev/urandom > hash.bin
+	"$sbsiglist" --owner $owner --type sha$bits \
+		--output sha$bits.dbx hash.bin
+	check_list sha$bits.dbx $len
+	[ "$(bytes sha$bits.dbx 44 $len)" = "$(hex < hash.bin)" ]
+	"$sbverify" --cert "$cert" --dbx sha$bits.dbx "$signed"
+done
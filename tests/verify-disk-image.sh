@@ -0,0 +1,75 @@
+#!/bin/bash -e
+##
+# Verify the EFI binaries on FAT filesystem images, without mounting
+# them. The images are built by mkfatimage.
+##
+
+mkfatimage="$bindir/mkfatimage"
+
+"$sbsign" --cert "$cert" --key "$key" --output test.signed "$image"
+
+for disk in good.img bad.img
+do
+	"$mkfatimage" $disk EFI/BOOT/BOOTX64.EFI=test.signed
+done
+"$mkfatimage" bad.img EFI/BOOT/BOOTX64.EFI=test.signed \
+	EFI/BOOT/UNSIGNED.EFI="$image"
+
+"$sbverify" --cert "$cert" --disk-image good.img |
+	grep -qx 'good.img:/EFI/BOOT/BOOTX64.EFI: Signature verification OK'
+
+! "$sbverify" --cert "$cert" --disk-image --jobs 2 good.img bad.img \
+	> report
+
+# results are reported in argument order, regardless of which job
+# finished first
+[ "$(cut -d: -f1 report | uniq | tr '\n' ' ')" = "good.img bad.img " ]
+grep -qx 'bad.img:/EFI/BOOT/UNSIGNED.EFI: Signature verification failed' \
+	report
+
+# more binaries than fit in one verification batch; all are reported
+files=
+for i in $(seq 1 40)
+do
+	files="$files EFI/BOOT/TEST$i.EFI=test.signed"
+done
+"$mkfatimage" many.img $files
+"$sbverify" --cert "$cert" --disk-image many.img > report
+[ $(grep -c ': Signature verification OK$' report) -eq 40 ]
+
+# a disk with nothing to boot fails verification
+"$mkfatimage" empty.img
+! "$sbverify" --cert "$cert" --disk-image empty.img > report
+grep -qx 'empty.img: No EFI binaries found' report
+
+# FAT12 and FAT32 volumes. On FAT32, the root directory and every file
+# live above cluster 65535, so need the high word of the cluster number
+for fat in 12 32
+do
+	"$mkfatimage" -f $fat fat$fat.img EFI/BOOT/BOOTX64.EFI=test.signed \
+		EFI/BOOT/UNSIGNED.EFI="$image"
+	! "$sbverify" --cert "$cert" --disk-image fat$fat.img > report
+	grep -qx "fat$fat.img:/EFI/BOOT/BOOTX64.EFI: Signature verification OK" \
+		report
+	grep -qx "fat$fat.img:/EFI/BOOT/UNSIGNED.EFI: Signature verification failed" \
+		report
+done
+
+# an EFI system partition behind a Linux partition, in an MBR or a GPT
+for table in mbr gpt
+do
+	for fat in 16 32
+	do
+		disk=$table$fat.img
+		"$mkfatimage" -t $table -f $fat $disk \
+			EFI/BOOT/BOOTX64.EFI=test.signed
+		"$sbverify" --cert "$cert" --disk-image $disk > report
+		grep -qx "$disk:/EFI/BOOT/BOOTX64.EFI: Signature verification OK" \
+			report
+	done
+done
+
+# a directory containing itself must not be walked forever
+"$mkfatimage" -l EFI loop.img EFI/BOOT/BOOTX64.EFI=test.signed
+! "$sbverify" --cert "$cert" --disk-image loop.img > report 2> errors
+grep -qx 'Directories nested too deeply in loop.img' errors
@@ -0,0 +1,23 @@
+#!/bin/bash -e
+##
+# Verify several images in one sbverify invocation; all must pass, and a
+# single unsigned image must fail the batch
+##
+
+for i in 1 2 3
+do
+	"$sbsign" --cert "$cert" --key "$key" --output "test.signed.$i" "$image"
+done
+
+"$sbverify" --cert "$cert" test.signed.1 test.signed.2 test.signed.3 |
+	grep -c ': Signature verification OK$' | grep -qx 3
+
+! "$sbverify" --cert "$cert" test.signed.1 "$image" test.signed.3
+
+# listing doesn't check signatures, but images that can't be loaded
+# still fail
+"$sbverify" --list test.signed.1 "$image" > /dev/null
+! "$sbverify" --list test.signed.1 missing.efi > /dev/null
+
+"$sbverify" --cert "$cert" --disk-image --jobs 0 test.signed.1 2>&1 |
+	grep -q '^Invalid number of jobs: 0$'